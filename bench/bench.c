@@ -0,0 +1,431 @@
+#include <vm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Synthetic guest workloads run headless on every engine. Results go to
+// stdout as JSON, progress to stderr; guest console output is discarded.
+
+#define BENCH_CODE 0x1000          // Where workloads are assembled
+#define BENCH_STACK 0x80000
+#define BENCH_SRC 0x20000          // REP MOVSB source and destination
+#define BENCH_DST 0x30000
+#define BENCH_COPY 4096
+#define BENCH_DISK_BUFFER 0x8000   // INT 13h destination, ES:BX with ES = 0
+#define BENCH_DISK_SECTORS 18      // One track per read
+#define BENCH_DISK_SIZE (80 * 2 * 18 * 512)
+#define BENCH_SLICE (1 << 20)
+#define BENCH_MAX_CODE 256
+
+typedef struct {
+    uint8_t code[BENCH_MAX_CODE];
+    uint32_t len;
+} BenchAsm;
+
+typedef struct {
+    const char* name;
+    uint32_t iterations;           // At scale 1
+    int needs_disk;
+    void (*build)(BenchAsm* a, uint32_t iterations);
+} BenchWorkload;
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t ns;
+    uint64_t cycles;               // Host counters, valid when counted is set
+    uint64_t host_instructions;
+    int counted;
+} BenchResult;
+
+static void emit8(BenchAsm* a, uint8_t v) {
+    if (a->len < BENCH_MAX_CODE) a->code[a->len] = v;
+    a->len++;
+}
+
+static void emit32(BenchAsm* a, uint32_t v) {
+    for (int i = 0; i < 4; i++) emit8(a, (uint8_t)(v >> (i * 8)));
+}
+
+static void emit_r(BenchAsm* a, uint8_t opcode, uint8_t reg) {
+    emit8(a, opcode);
+    emit8(a, reg);
+}
+
+static void emit_rr(BenchAsm* a, uint8_t opcode, uint8_t reg1, uint8_t reg2) {
+    emit8(a, opcode);
+    emit8(a, reg1);
+    emit8(a, reg2);
+}
+
+static void emit_mov(BenchAsm* a, uint8_t reg, uint32_t imm) {
+    emit_r(a, 0x01, reg);
+    emit32(a, imm);
+}
+
+static uint32_t here(const BenchAsm* a) {
+    return BENCH_CODE + a->len;
+}
+
+// DEC counter; JNZ top
+static void emit_loop_end(BenchAsm* a, uint8_t counter, uint32_t top) {
+    emit_r(a, 0x31, counter);
+    emit8(a, 0x53);
+    emit32(a, top);
+}
+
+static void build_arith(BenchAsm* a, uint32_t iterations) {
+    emit_mov(a, 3, iterations);
+    emit_mov(a, 4, 0x12345678);
+    uint32_t top = here(a);
+    emit_rr(a, 0x20, 0, 4);     // ADD r0, r4
+    emit_rr(a, 0x42, 5, 0);     // XOR r5, r0
+    emit_rr(a, 0x46, 4, 3);     // ROL r4, imm8 3
+    emit_rr(a, 0x22, 6, 5);     // SUB r6, r5
+    emit_r(a, 0x30, 4);         // INC r4
+    emit_loop_end(a, 3, top);
+    emit8(a, 0xB2);             // HLT
+}
+
+// Register-only operations the JIT compiles natively, unlike ROL in arith
+static void build_arith_regs(BenchAsm* a, uint32_t iterations) {
+    emit_mov(a, 3, iterations);
+    emit_mov(a, 4, 0x12345678);
+    uint32_t top = here(a);
+    emit_rr(a, 0x20, 0, 4);     // ADD r0, r4
+    emit_rr(a, 0x42, 5, 0);     // XOR r5, r0
+    emit_rr(a, 0x22, 6, 5);     // SUB r6, r5
+    emit_rr(a, 0x40, 1, 6);     // AND r1, r6
+    emit_rr(a, 0x41, 2, 1);     // OR r2, r1
+    emit_r(a, 0x30, 4);         // INC r4
+    emit_loop_end(a, 3, top);
+    emit8(a, 0xB2);             // HLT
+}
+
+static void build_rep_movsb(BenchAsm* a, uint32_t iterations) {
+    emit_mov(a, 3, iterations);
+    uint32_t top = here(a);
+    emit_mov(a, 4, BENCH_SRC);
+    emit_mov(a, 5, BENCH_DST);
+    emit_mov(a, 2, BENCH_COPY);
+    emit8(a, 0x90);             // REP MOVSB
+    emit8(a, 0x82);
+    emit_loop_end(a, 3, top);
+    emit8(a, 0xB2);
+}
+
+static void build_calls(BenchAsm* a, uint32_t iterations) {
+    emit_mov(a, 7, BENCH_STACK);
+    emit_mov(a, 3, iterations);
+    uint32_t top = here(a);
+    uint32_t call = a->len;
+    emit8(a, 0x60);             // CALL leaf, patched below
+    emit32(a, 0);
+    emit_loop_end(a, 3, top);
+    emit8(a, 0xB2);
+    uint32_t leaf = here(a);
+    emit_rr(a, 0x20, 0, 3);     // ADD r0, r3
+    emit8(a, 0x61);             // RET
+    for (int i = 0; i < 4; i++) a->code[call + 1 + i] = (uint8_t)(leaf >> (i * 8));
+}
+
+static void build_int10(BenchAsm* a, uint32_t iterations) {
+    emit_mov(a, 3, iterations);
+    emit_mov(a, 0, 0x0E41);     // AH = teletype, AL = 'A'
+    uint32_t top = here(a);
+    emit8(a, 0xCD);             // INT 10h
+    emit8(a, 0x10);
+    emit_loop_end(a, 3, top);
+    emit8(a, 0xB2);
+}
+
+static void build_int13(BenchAsm* a, uint32_t iterations) {
+    emit_mov(a, 6, iterations);
+    emit_mov(a, 1, 0x0001);     // Cylinder 0, sector 1
+    emit_mov(a, 2, 0);          // Head 0
+    emit_mov(a, 3, BENCH_DISK_BUFFER);
+    uint32_t top = here(a);
+    emit_mov(a, 0, 0x0200 | BENCH_DISK_SECTORS);  // AH = read, AL = count
+    emit8(a, 0xCD);             // INT 13h
+    emit8(a, 0x13);
+    emit_loop_end(a, 6, top);
+    emit8(a, 0xB2);
+}
+
+static const BenchWorkload workloads[] = {
+    {"arith", 8000000, 0, build_arith},
+    {"arith_regs", 8000000, 0, build_arith_regs},
+    {"rep_movsb", 2000000, 0, build_rep_movsb},
+    {"calls", 10000000, 0, build_calls},
+    {"int10_teletype", 2000000, 0, build_int10},
+    {"int13_read", 1000000, 1, build_int13},
+};
+#define BENCH_NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static const struct {
+    const char* name;
+    CpuEngine engine;
+} engines[] = {
+    {"interp", CPU_ENGINE_INTERP},
+    {"threaded", CPU_ENGINE_THREADED},
+    {"jit", CPU_ENGINE_JIT},
+};
+#define BENCH_NUM_ENGINES (int)(sizeof(engines) / sizeof(engines[0]))
+
+// Host cycles and instructions of this thread in user mode, so the counters
+// work at the default perf_event_paranoid setting
+typedef struct {
+    int cycles;
+    int instructions;
+} BenchCounters;
+
+#ifdef __linux__
+static int bench_open_counter(uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static int bench_counters_open(BenchCounters* c) {
+    c->cycles = bench_open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    c->instructions = c->cycles >= 0 ?
+        bench_open_counter(PERF_COUNT_HW_INSTRUCTIONS, c->cycles) : -1;
+    if (c->instructions < 0) {
+        if (c->cycles >= 0) close(c->cycles);
+        c->cycles = -1;
+        return 0;
+    }
+    return 1;
+}
+
+static void bench_counters_start(BenchCounters* c) {
+    if (c->cycles < 0) return;
+    ioctl(c->cycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static int bench_counters_stop(BenchCounters* c, BenchResult* r) {
+    if (c->cycles < 0) return 0;
+    ioctl(c->cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t cycles, instructions;
+    if (read(c->cycles, &cycles, sizeof(cycles)) != sizeof(cycles) ||
+        read(c->instructions, &instructions, sizeof(instructions)) != sizeof(instructions)) {
+        return 0;
+    }
+    r->cycles = cycles;
+    r->host_instructions = instructions;
+    return 1;
+}
+
+static void bench_counters_close(BenchCounters* c) {
+    if (c->cycles < 0) return;
+    close(c->instructions);
+    close(c->cycles);
+}
+#else
+static int bench_counters_open(BenchCounters* c) {
+    c->cycles = c->instructions = -1;
+    return 0;
+}
+
+static void bench_counters_start(BenchCounters* c) {
+    (void)c;
+}
+
+static int bench_counters_stop(BenchCounters* c, BenchResult* r) {
+    (void)c;
+    (void)r;
+    return 0;
+}
+
+static void bench_counters_close(BenchCounters* c) {
+    (void)c;
+}
+#endif
+
+// A track-patterned floppy image for the INT 13h workload
+static int bench_make_disk(char* path) {
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create disk image %s\n", path);
+        return 0;
+    }
+    uint8_t sector[512];
+    int ok = 1;
+    for (uint32_t i = 0; i < BENCH_DISK_SIZE / sizeof(sector) && ok; i++) {
+        memset(sector, (int)(i & 0xFF), sizeof(sector));
+        ok = write(fd, sector, sizeof(sector)) == sizeof(sector);
+    }
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "Failed to write disk image %s\n", path);
+        unlink(path);
+    }
+    return ok;
+}
+
+static int bench_run(const BenchWorkload* w, CpuEngine engine, uint32_t iterations,
+                     const char* disk, int async_disk, BenchCounters* counters,
+                     BenchResult* r) {
+    VMConfig config = {0};
+    config.headless = 1;
+    config.async_disk = async_disk;
+    VM* vm = calloc(1, sizeof(VM));
+    if (!vm || !vm_init(vm, &config)) {
+        free(vm);
+        return 0;
+    }
+    if (!cpu_set_engine(&vm->cpu, engine) || (w->needs_disk && !vm_load_iso(vm, disk))) {
+        vm_cleanup(vm);
+        free(vm);
+        return 0;
+    }
+
+    BenchAsm a = {{0}, 0};
+    w->build(&a, iterations);
+    vm_write_range(vm, BENCH_CODE, a.code, a.len);
+    vm->cpu.ip = BENCH_CODE;
+
+    vm->running = 1;
+    bench_counters_start(counters);
+    uint64_t start = vm_now_ns();
+    while (vm->running && !vm->cpu.halted && !vm->idle) {
+        if (vm_disk_waiting(vm)) vm_disk_wait(vm, 1000000000ULL);
+        vm_run_slice(vm, BENCH_SLICE);
+    }
+    r->ns = vm_now_ns() - start;
+    r->counted = bench_counters_stop(counters, r);
+    r->instructions = vm->instructions;
+
+    int ok = vm->cpu.halted;
+    vm_cleanup(vm);
+    free(vm);
+    return ok;
+}
+
+static void bench_json_result(FILE* out, const char* workload, const char* engine,
+                              const BenchResult* r, int first) {
+    double seconds = r->ns / 1e9;
+    fprintf(out, "%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", "
+            "\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.2f, "
+            "\"ns_per_insn\": %.3f, ", first ? "" : ",", workload, engine,
+            (unsigned long long)r->instructions, seconds,
+            seconds > 0 ? r->instructions / seconds / 1e6 : 0.0,
+            r->instructions ? (double)r->ns / r->instructions : 0.0);
+    if (r->counted && r->instructions) {
+        fprintf(out, "\"cycles_per_insn\": %.3f, \"host_insns_per_insn\": %.3f}",
+                (double)r->cycles / r->instructions,
+                (double)r->host_instructions / r->instructions);
+    } else {
+        fprintf(out, "\"cycles_per_insn\": null, \"host_insns_per_insn\": null}");
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-e interp|threaded|jit] [-w workload] [-r repeats] "
+            "[-s scale] [-a] [-o results.json]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    const char* only_engine = NULL;
+    const char* only_workload = NULL;
+    const char* out_path = NULL;
+    int repeats = 3;
+    double scale = 1.0;
+    int async_disk = 0;
+    int opt;
+
+    // -a serves INT 13h reads from the I/O threads, as xvm -A does
+    while ((opt = getopt(argc, argv, "e:w:r:s:ao:")) != -1) {
+        switch (opt) {
+            case 'e': only_engine = optarg; break;
+            case 'w': only_workload = optarg; break;
+            case 'r': repeats = atoi(optarg); break;
+            case 's': scale = atof(optarg); break;
+            case 'a': async_disk = 1; break;
+            case 'o': out_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (repeats < 1 || scale <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The guest's teletype output goes through stdio, so results get their
+    // own stream and stdout is silenced
+    FILE* out = out_path ? fopen(out_path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", out_path ? out_path : "stdout");
+        return 1;
+    }
+    if (!freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Failed to silence guest output\n");
+        fclose(out);
+        return 1;
+    }
+
+    char disk[] = "/tmp/xvm-bench-XXXXXX";
+    if (!bench_make_disk(disk)) {
+        fclose(out);
+        return 1;
+    }
+
+    BenchCounters counters;
+    int counted = bench_counters_open(&counters);
+    if (!counted) fprintf(stderr, "Hardware counters unavailable, reporting time only\n");
+
+    fprintf(out, "{\n  \"perf_counters\": %s,\n  \"repeats\": %d,\n  \"scale\": %g,\n"
+            "  \"results\": [", counted ? "true" : "false", repeats, scale);
+    int first = 1, failed = 0;
+    for (int wi = 0; wi < BENCH_NUM_WORKLOADS; wi++) {
+        const BenchWorkload* w = &workloads[wi];
+        if (only_workload && strcmp(only_workload, w->name) != 0) continue;
+        uint32_t iterations = (uint32_t)(w->iterations * scale);
+        if (iterations == 0) iterations = 1;
+
+        for (int ei = 0; ei < BENCH_NUM_ENGINES; ei++) {
+            if (only_engine && strcmp(only_engine, engines[ei].name) != 0) continue;
+
+            // Best of the repeats, which is the least disturbed by the host
+            BenchResult best = {0};
+            int ok = 1;
+            for (int i = 0; i < repeats && ok; i++) {
+                BenchResult r = {0};
+                ok = bench_run(w, engines[ei].engine, iterations, disk, async_disk,
+                               &counters, &r);
+                if (ok && (i == 0 || r.ns < best.ns)) best = r;
+            }
+            if (!ok) {
+                fprintf(stderr, "%-16s %-9s failed\n", w->name, engines[ei].name);
+                failed++;
+                continue;
+            }
+            double seconds = best.ns / 1e9;
+            fprintf(stderr, "%-16s %-9s %12llu insns %8.3f s %9.2f MIPS\n", w->name,
+                    engines[ei].name, (unsigned long long)best.instructions, seconds,
+                    seconds > 0 ? best.instructions / seconds / 1e6 : 0.0);
+            bench_json_result(out, w->name, engines[ei].name, &best, first);
+            first = 0;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    bench_counters_close(&counters);
+    unlink(disk);
+    int ok = fclose(out) == 0;
+    return ok && !failed ? 0 : 1;
+}
\ No newline at end of file
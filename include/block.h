@@ -0,0 +1,87 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <cpu.h>
+#include <stdint.h>
+
+#define BLOCK_MAX_INSNS 32       // Longest basic block before a forced exit
+#define BLOCK_HASH_SIZE 4096     // Lookup buckets (power of two)
+#define BLOCK_MAX_BLOCKS 8192
+#define BLOCK_POOL_SIZE 32768    // Total instruction slots across all blocks
+#define BLOCK_LINE_SHIFT 6       // Code tracking granularity (64 bytes)
+
+#define JIT_THRESHOLD 64          // Block executions before native compilation
+#define JIT_LOOP_BUDGET 65536     // Instructions a native self-loop may retire per call
+
+// Threaded-code operation kinds; block_exec() owns the matching labels
+enum {
+    BOP_CALL,       // Generic handler, falls through to the next slot
+    BOP_CALL_END,   // Generic handler that ends the block
+    BOP_EXIT,       // Sentinel after the last instruction
+    BOP_MOV_RI,
+    BOP_MOV_RR,
+    BOP_ADD_RR,
+    BOP_ADD_RI,
+    BOP_SUB_RR,
+    BOP_INC,
+    BOP_DEC,
+    BOP_NEG,
+    BOP_AND,
+    BOP_OR,
+    BOP_XOR,
+    BOP_NOT,
+    BOP_SHL,
+    BOP_SHR,
+    BOP_CMP,
+    BOP_JMP,
+    BOP_JZ,
+    BOP_JNZ,
+    BOP_JA,
+    BOP_JB,
+    BOP_LOOP,
+    BOP_COUNT
+};
+
+// Native translation of a block; returns instructions retired
+typedef int (*JitFn)(CPU* cpu, int budget);
+struct Jit;
+
+// One threaded-code slot: the dispatch label and its decoded operands
+typedef struct {
+    const void* op;
+    CpuInsn insn;
+    uint8_t kind;            // BOP_* value behind op
+} BlockInsn;
+
+// Straight-line guest code ending at a branch, store or INT
+typedef struct Block {
+    uint32_t start;
+    uint32_t count;          // Instructions, excluding the exit slot
+    BlockInsn* insns;
+    struct Block* next;      // Hash chain
+    uint32_t exec_count;
+    int jit_failed;          // Contains operations the JIT cannot translate
+    JitFn native;
+} Block;
+
+typedef struct BlockCache {
+    Block* hash[BLOCK_HASH_SIZE];
+    Block blocks[BLOCK_MAX_BLOCKS];
+    int num_blocks;
+    BlockInsn pool[BLOCK_POOL_SIZE];
+    int pool_used;
+    uint8_t* code_lines;     // Bitmap of lines covered by some block
+    uint32_t num_lines;
+    uint32_t lines_lo;       // Bitmap bytes [lines_lo, lines_hi) may be set,
+    uint32_t lines_hi;       // so a flush need not clear all of it
+    int flush_pending;
+    struct Jit* jit;         // Native code buffer for CPU_ENGINE_JIT
+} BlockCache;
+
+BlockCache* block_cache_create(uint32_t memory_size);
+void block_cache_destroy(BlockCache* cache);
+void block_cache_flush(BlockCache* cache);
+void block_invalidate_range(BlockCache* cache, uint32_t address, uint32_t size);
+int block_run(CPU* cpu);
+
+#endif // BLOCK_H
\ No newline at end of file
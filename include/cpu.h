@@ -3,23 +3,173 @@
 
 #include <stdint.h>
 
-#define MEMORY_SIZE (1024*1024)  // 1MB of RAM
+#define CPU_PAGE_SHIFT 12        // 4KB pages
+#define CPU_PAGE_SIZE (1u << CPU_PAGE_SHIFT)
 
+// Guest RAM is sized at startup in whole pages; addresses are 32-bit
+#define CPU_DEFAULT_MEMORY (1024*1024)  // 1MB of RAM
+#define CPU_MIN_MEMORY (64*1024)
+#define CPU_MAX_MEMORY (0xFFFFFFFFu & ~(CPU_PAGE_SIZE - 1))
+#define CPU_MAX_INSN_LEN 6       // Longest encoding in the ISA
+#define CPU_MAX_ENTRY_LEN (2 * CPU_MAX_INSN_LEN)  // Longest icache entry (fused pair)
+#define ICACHE_SIZE 4096         // Decoded instruction cache entries (power of two)
+
+// Page attributes, one byte per page so a plain RAM store costs one lookup
+#define CPU_PAGE_CODE 0x01       // Holds cached decodes
+#define CPU_PAGE_HOOK 0x02       // Stores are reported to the write hook (MMIO)
+#define CPU_PAGE_DIRTY 0x04      // Written since memory was last frozen, or ever
+
+// Superinstructions: adjacent pairs the interpreter runs as one icache entry
+#define CPU_FUSE_CMP_JCC 0x01    // CMP r1, r2 + JZ/JNZ/JA/JB
+#define CPU_FUSE_DEC_JCC 0x02    // DEC r + JZ/JNZ
+#define CPU_FUSE_MOV_ADD 0x04    // MOV r, imm32 + ADD r2, r
+#define CPU_FUSE_ALL     0x07
+#define CPU_FUSE_MIN_SHARE 100   // A profiled pair needs 1 in this many executions
+
+// Instruction classes recorded by cpu_decode()
+#define CPU_INSN_BRANCH 0x01     // Ends a basic block (control transfer, HLT)
+#define CPU_INSN_STORE  0x02     // Writes guest memory
+
+#define CPU_IVT_VECTORS 256      // Real-mode vector table at 0, segment:offset each
+
+typedef enum {
+    CPU_ENGINE_INTERP,           // One cached decode per cycle (reference)
+    CPU_ENGINE_THREADED,         // Basic blocks with threaded dispatch
+    CPU_ENGINE_JIT               // Threaded, with hot blocks compiled to x86-64
+} CpuEngine;
+
+typedef struct CPU CPU;
+typedef struct CpuInsn CpuInsn;
+struct BlockCache;
+struct MemImage;
+struct Prof;
+struct Trace;
+
+// Called after a store to a hooked page has landed in memory
+typedef void (*CpuWriteHookFn)(void* data, uint32_t address, uint32_t size);
+
+// Offered every INT before the vector table; returns 1 if it serviced it
+typedef int (*CpuIntHookFn)(void* data, uint8_t vector);
+
+// Handler for a pre-decoded instruction; responsible for advancing ip
+typedef void (*CpuOpFn)(CPU* cpu, const CpuInsn* insn);
+
+// Pages cpu_hook_range() marked, first and last inclusive
 typedef struct {
-    uint8_t memory[MEMORY_SIZE];
+    uint32_t first;
+    uint32_t last;
+} CpuPageRange;
+
+// Pre-decoded instruction, filled lazily by cpu_decode()
+struct CpuInsn {
+    CpuOpFn fn;        // Handler, NULL if the entry is empty
+    uint32_t addr;     // Guest address the entry was decoded from
+    uint32_t imm;      // Immediate, absolute address or resolved branch target
+    uint8_t opcode;    // Opcode (second byte for 0x0F, repeated op for REP)
+    uint8_t reg1;
+    uint8_t reg2;
+    uint8_t len;       // Encoded length in bytes
+    uint8_t flags;     // CPU_INSN_* class bits
+    uint8_t count;     // Guest instructions retired, 2 for a superinstruction
+};
+
+struct CPU {
+    uint8_t* memory;                  // memory_size bytes from mem_alloc()
+    uint32_t memory_size;
+    uint32_t num_pages;
+    int mem_flags;                    // MEM_* flags memory was allocated with
+    struct MemImage* image;           // Shared copy-on-write backing, if forked
+    uint32_t* dirty_pages;            // Pages with CPU_PAGE_DIRTY set, num_pages room
+    uint32_t num_dirty;
     uint32_t registers[8];  // General purpose registers
     uint32_t ip;           // Instruction pointer
-    uint32_t flags;        // CPU flags
+    uint32_t flags;        // CPU flags, current only when flags_op is CPU_FLAGS_SET
+    uint32_t flags_op;     // CPU_FLAGS_* recipe for the pending flags
+    uint32_t flags_a;      // Operands of the last flag-setting operation
+    uint32_t flags_b;
     uint16_t cs, ds, es, ss, fs, gs;  // Segment registers
-    uint32_t last_write_addr;         // Track last memory write
-} CPU;
+    int halted;                       // Set by HLT
+    uint64_t tsc;                     // Per-CPU time stamp counter for RDTSC
+    CpuInsn icache[ICACHE_SIZE];      // Direct-mapped by guest address
+    uint32_t fusions;                 // CPU_FUSE_* pairs the interpreter may fuse
+    uint64_t* pair_counts;            // Executed opcode pairs, while profiling
+    uint32_t pair_next;               // Address that continues the current pair
+    uint8_t pair_first;               // Opcode byte of the pair's first instruction
+    uint8_t* page_attr;               // CPU_PAGE_* bits, num_pages entries
+    CpuPageRange* hooked;             // Ranges given to cpu_hook_range()
+    int num_hooked;
+    CpuWriteHookFn write_hook;
+    void* write_hook_data;
+    CpuIntHookFn int_hook;
+    void* int_hook_data;
+    int ivt;                          // INT vectors through the table at 0
+    CpuEngine engine;
+    struct BlockCache* blocks;        // Allocated for the block engines
+    struct Prof* prof;                // Execution profiler, NULL when off
+    struct Trace* trace;              // Instruction trace recorder, NULL when off
+};
+
+// Flags are evaluated lazily: arithmetic only records its operands, and the
+// bits are computed when a branch, PUSHF or carry-consuming op reads them
+#define CPU_FLAGS_SET     0      // flags holds the value
+#define CPU_FLAGS_RESULT  1      // ZF = (flags_a == 0)
+#define CPU_FLAGS_COMPARE 2      // ZF and CF of flags_a - flags_b
+
+static inline uint32_t cpu_get_flags(const CPU* cpu) {
+    switch (cpu->flags_op) {
+        case CPU_FLAGS_RESULT:
+            return cpu->flags_a == 0;
+        case CPU_FLAGS_COMPARE:
+            return (cpu->flags_a == cpu->flags_b) | (cpu->flags_a < cpu->flags_b) << 1;
+    }
+    return cpu->flags;
+}
+
+static inline void cpu_set_flags(CPU* cpu, uint32_t flags) {
+    cpu->flags = flags;
+    cpu->flags_op = CPU_FLAGS_SET;
+}
+
+static inline void cpu_flags_result(CPU* cpu, uint32_t result) {
+    cpu->flags_a = result;
+    cpu->flags_op = CPU_FLAGS_RESULT;
+}
+
+static inline void cpu_flags_compare(CPU* cpu, uint32_t a, uint32_t b) {
+    cpu->flags_a = a;
+    cpu->flags_b = b;
+    cpu->flags_op = CPU_FLAGS_COMPARE;
+}
 
 // CPU operations
-void cpu_init(CPU* cpu);
-void cpu_emulate_cycle(CPU* cpu);
-void cpu_load_program(CPU* cpu, const char* filename);
+int cpu_init(CPU* cpu, uint32_t memory_size, int mem_flags);
+void cpu_cleanup(CPU* cpu);
+int cpu_fork(CPU* dst, CPU* src);
+int cpu_emulate_cycle(CPU* cpu);
+int cpu_step(CPU* cpu);
+int cpu_set_engine(CPU* cpu, CpuEngine engine);
+int cpu_enable_profiler(CPU* cpu);
+int cpu_load_program(CPU* cpu, const char* filename);
+void cpu_clear_memory(CPU* cpu);
+
+// Decoded instruction cache
+void cpu_decode(CPU* cpu, uint32_t address, CpuInsn* insn);
+void cpu_invalidate_range(CPU* cpu, uint32_t address, uint32_t size);
+void cpu_flush_icache(CPU* cpu);
+
+// Superinstruction selection; profiling counts adjacent executed pairs
+void cpu_set_fusions(CPU* cpu, uint32_t fusions);
+int cpu_record_pairs(CPU* cpu);
+int cpu_save_pair_profile(CPU* cpu, const char* path);
+int cpu_load_fusion_profile(CPU* cpu, const char* path);
 
-// Memory operations
+// Memory operations; every store is reported through cpu_note_write()
+void cpu_set_write_hook(CPU* cpu, CpuWriteHookFn hook, void* data);
+void cpu_set_int_hook(CPU* cpu, CpuIntHookFn hook, void* data);
+void cpu_interrupt(CPU* cpu, uint8_t vector);
+void cpu_hook_range(CPU* cpu, uint32_t address, uint32_t size);
+void cpu_note_write(CPU* cpu, uint32_t address, uint32_t size);
+void cpu_mark_dirty(CPU* cpu, uint32_t address, uint32_t size);
 uint8_t cpu_read_byte(CPU* cpu, uint32_t address);
 void cpu_write_byte(CPU* cpu, uint32_t address, uint8_t value);
 uint16_t cpu_read_word(CPU* cpu, uint32_t address);
@@ -0,0 +1,55 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <stdint.h>
+
+#define DISKCACHE_READAHEAD_MIN 8    // First prefetch once a read continues the last one
+#define DISKCACHE_READAHEAD_MAX 64   // Default cap on the doubling readahead window
+
+typedef struct {
+    uint64_t hits;                   // Sectors served from the cache
+    uint64_t misses;                 // Sectors the guest waited on the image for
+    uint64_t reads;                  // Reads issued against the image
+    uint64_t readahead;              // Sectors fetched beyond what the guest asked for
+} DiskCacheStats;
+
+// Fixed number of sector slots with LRU replacement. Slots are found through
+// a hash on the sector number and kept on a recency list, head most recent.
+typedef struct {
+    uint32_t capacity;               // Sectors
+    uint32_t sector_size;
+    uint32_t used;
+    uint8_t* data;                   // capacity slots of sector_size bytes
+    uint8_t* staging;                // Room for one read of up to capacity sectors
+    uint64_t* lbas;
+    uint32_t* chain;                 // Next slot in the same bucket
+    uint32_t* prev;
+    uint32_t* next;
+    uint32_t* buckets;
+    uint32_t num_buckets;            // Power of two
+    uint32_t head;
+    uint32_t tail;
+    uint32_t max_readahead;
+    uint32_t window;                 // Current readahead, 0 for random access
+    uint64_t next_lba;               // Where a sequential reader continues
+    DiskCacheStats stats;
+} DiskCache;
+
+DiskCache* diskcache_create(uint32_t sectors, uint32_t sector_size, uint32_t max_readahead);
+void diskcache_destroy(DiskCache* cache);
+
+// Forget every cached sector, for when the disk under the cache changes;
+// the statistics are kept
+void diskcache_clear(DiskCache* cache);
+
+// Cached copy of a sector, made most recent; NULL on a miss
+const uint8_t* diskcache_lookup(DiskCache* cache, uint64_t lba);
+
+// Slot to fill with a sector's data, evicting the least recent if full
+uint8_t* diskcache_insert(DiskCache* cache, uint64_t lba);
+
+// Note a guest read of count sectors at lba and return how many sectors to
+// prefetch after it; the window doubles while reads stay sequential
+uint32_t diskcache_readahead(DiskCache* cache, uint64_t lba, uint32_t count);
+
+#endif // DISKCACHE_H
\ No newline at end of file
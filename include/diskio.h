@@ -0,0 +1,32 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISKIO_THREADS 2         // Reader threads shared by every VM in the process
+
+// One positioned read, owned by the submitter until done is set
+typedef struct DiskRequest {
+    int fd;
+    uint8_t* buffer;
+    uint64_t offset;
+    size_t size;
+    size_t result;               // Bytes read; short on error or end of file
+    atomic_int done;
+    struct DiskRequest* next;
+} DiskRequest;
+
+// Positioned read on the calling thread; returns bytes read, short on error
+// or end of file
+size_t diskio_read(int fd, uint8_t* buffer, size_t size, uint64_t offset);
+
+// Queue req for a reader thread; 0 if no thread could be started
+int diskio_submit(DiskRequest* req);
+int diskio_done(DiskRequest* req);
+
+// Block until req is done or timeout_ns passes; returns diskio_done()
+int diskio_wait(DiskRequest* req, uint64_t timeout_ns);
+
+#endif // DISKIO_H
\ No newline at end of file
@@ -0,0 +1,45 @@
+#ifndef DISKOVERLAY_H
+#define DISKOVERLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sectors the guest wrote, kept apart from the read-only base image. The
+// file holds a header, the block map (one bit per sector) and a data area
+// where sector n lives at data_offset + n * sector_size. Unwritten sectors
+// stay holes, so the file only grows with what the guest changed.
+typedef struct {
+    int fd;
+    uint32_t sector_size;
+    uint64_t sectors;            // Size of the disk it overlays
+    uint8_t* map;                // Bit n set when sector n is in the overlay
+    size_t map_size;
+    uint64_t data_offset;
+    uint64_t written;            // Sectors present in the overlay
+} DiskOverlay;
+
+// Open or create the overlay at path, or a temporary one that disappears
+// on close when path is NULL. An existing file must match the disk's size.
+DiskOverlay* diskoverlay_open(const char* path, uint64_t sectors, uint32_t sector_size);
+void diskoverlay_close(DiskOverlay* overlay);
+
+// Temporary overlay with the same contents, for a forked VM
+DiskOverlay* diskoverlay_clone(const DiskOverlay* overlay);
+
+// Length of the first run of written sectors at or after *lba, at most max
+// long, with *lba moved to its start; 0 when no later sector is written
+uint32_t diskoverlay_next_run(const DiskOverlay* overlay, uint64_t* lba, uint32_t max);
+
+// Replace the sectors of buffer (count sectors from lba) that the overlay
+// holds with its copies, leaving the rest as read from the base image
+int diskoverlay_read(DiskOverlay* overlay, uint64_t lba, uint32_t count, uint8_t* buffer);
+
+// Store count sectors at lba; returns how many were written, 0 when the
+// map could not be updated (sectors already present may then hold the new data)
+uint32_t diskoverlay_write(DiskOverlay* overlay, uint64_t lba, uint32_t count,
+                           const uint8_t* buffer);
+
+// Drop every written sector, returning the disk to the base image
+int diskoverlay_discard(DiskOverlay* overlay);
+
+#endif // DISKOVERLAY_H
\ No newline at end of file
@@ -0,0 +1,28 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMAGECACHE_IDLE_MAX 8    // Unreferenced mappings kept for the next load
+
+typedef struct {
+    uint64_t loads;              // imagecache_acquire() calls that succeeded
+    uint64_t hits;               // Loads served by an existing mapping
+    uint64_t mapped;             // Files actually mapped
+} ImageCacheStats;
+
+// Process-wide read-only view of an image file. Every VM loading the same
+// file shares one mapping and one descriptor: files are told apart by
+// device and inode, so any path to a file finds its mapping, and a changed
+// size or mtime gets a fresh one. Copies of a file are mapped separately.
+const uint8_t* imagecache_acquire(const char* path, size_t* size);
+const uint8_t* imagecache_retain(const uint8_t* data);
+void imagecache_release(const uint8_t* data);
+
+// Read-only descriptor of the file behind data, owned by the cache
+int imagecache_fd(const uint8_t* data);
+
+void imagecache_stats(ImageCacheStats* stats);
+
+#endif // IMAGECACHE_H
\ No newline at end of file
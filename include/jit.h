@@ -0,0 +1,27 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <block.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)  // Executable code per block cache
+
+// mmap'd buffer that native blocks are appended to. Pages holding emitted
+// code are read+execute and only made writable while a block is emitted,
+// so the buffer is never writable and executable at once.
+typedef struct Jit {
+    uint8_t* code;
+    size_t size;
+    size_t used;
+    size_t sealed;           // Bytes from the start mapped read+execute
+    size_t page;             // Host page size
+    int full;                // Set when a compile ran out of space
+} Jit;
+
+Jit* jit_create(void);
+void jit_destroy(Jit* jit);
+void jit_reset(Jit* jit);
+JitFn jit_compile(Jit* jit, const Block* block);
+
+#endif // JIT_H
\ No newline at end of file
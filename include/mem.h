@@ -0,0 +1,52 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEM_PAGE_SIZE 4096       // Copy-on-write granularity
+#define MEM_HUGE_PAGE_SIZE (2u * 1024 * 1024)
+
+// mem_alloc() flags
+#define MEM_HUGE_PAGES 0x01      // Back with huge pages where the host allows
+#define MEM_HUGETLB 0x02         // Set by mem_alloc() when the hugetlb pool backs mem
+
+// Frozen guest memory contents that forked VMs map copy-on-write
+typedef struct MemImage {
+    int fd;                      // memfd holding the pages, -1 for the copy fallback
+    uint8_t* copy;               // Private copy on hosts without memfd
+    size_t size;
+    atomic_int refs;
+} MemImage;
+
+// Anonymous, page-aligned and lazily zero-filled guest memory; nothing is
+// committed until the guest touches it. *flags gains MEM_HUGETLB when the
+// memory came from the hugetlb pool, and is passed to the calls below.
+uint8_t* mem_alloc(size_t size, int* flags);
+void mem_free(uint8_t* mem, size_t size);
+
+// Zero mem by returning its pages to the host rather than writing them
+void mem_reset(uint8_t* mem, size_t size, int flags);
+
+// Freeze the current contents of mem into an image and remap mem onto it;
+// hugetlb memory keeps its own pages and only the image is written.
+// current is the image mem is already mapped from and dirty lists the pages
+// written since: the result is current itself when none were, else current
+// plus those pages. The caller's reference moves to the result.
+MemImage* mem_freeze(uint8_t* mem, size_t size, MemImage* current,
+                     const uint32_t* dirty, uint32_t num_dirty, int flags);
+
+// Replace mem with a copy-on-write view of image. Hugetlb memory would lose
+// its backing to a view, so the image's data is copied into it instead.
+int mem_map_image(uint8_t* mem, MemImage* image, int flags);
+
+// Read-only view of the whole file open as fd, for disk images; the
+// descriptor stays the caller's
+const uint8_t* mem_map_fd(int fd, size_t* size);
+void mem_unmap_file(const uint8_t* data, size_t size);
+
+MemImage* mem_image_retain(MemImage* image);
+void mem_image_release(MemImage* image);
+
+#endif // MEM_H
\ No newline at end of file
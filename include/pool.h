@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <vm.h>
+#include <signal.h>
+#include <stdint.h>
+
+#define POOL_SLICE (1 << 20)     // Instructions a worker runs before rescheduling
+#define POOL_IDLE_NS 100000ULL   // Back-off when there is nothing to steal
+
+typedef enum {
+    POOL_PENDING,                // Not finished yet
+    POOL_HALTED,                 // Guest executed HLT
+    POOL_IDLE,                   // Guest parked in a JMP-to-self loop
+    POOL_LIMIT,                  // Hit the per-VM instruction limit
+    POOL_STOPPED,                // Guest crashed or the run was interrupted
+    POOL_FAILED                  // VM could not be created
+} PoolResult;
+
+// One guest image; its VM only exists while it is being run
+typedef struct {
+    const char* image;
+    VM* vm;
+    uint64_t instructions;
+    PoolResult result;
+} PoolTask;
+
+typedef struct {
+    int threads;
+    CpuEngine engine;
+    uint64_t max_instructions;   // Per VM, 0 for no limit
+    const char* dump_dir;        // Final screen of task i goes to <dump_dir>/<i>.txt
+    volatile sig_atomic_t* stop; // Checked between slices, may be NULL
+    uint32_t memory_size;        // Guest RAM per VM, 0 for the default
+    int huge_pages;
+    int async_disk;              // INT 13h reads go to the I/O threads
+    uint32_t disk_cache;         // Sector cache per VM, 0 for none
+    uint32_t disk_readahead;
+    int boot;                    // Images are boot disks, not flat programs
+} PoolConfig;
+
+typedef struct {
+    uint64_t instructions;       // Retired across all VMs
+    uint64_t elapsed_ns;
+    uint64_t steals;             // Tasks taken from another worker's deque
+} PoolStats;
+
+int pool_run(PoolTask* tasks, int count, const PoolConfig* config, PoolStats* stats);
+const char* pool_result_name(PoolResult result);
+
+#endif // POOL_H
\ No newline at end of file
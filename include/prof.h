@@ -0,0 +1,53 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <cpu.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define PROF_MAX_DEPTH 256       // Calls deeper than this are charged to their caller
+#define PROF_TOP_IPS 40          // Rows in the hot-spot table
+
+// Open-addressed counters; keys are stored plus one so zero marks a free slot
+typedef struct {
+    uint64_t* keys;
+    uint64_t* values;
+    uint32_t capacity;           // Power of two
+    uint32_t used;
+} ProfTable;
+
+// One calling context: a callee entered from its parent context
+typedef struct {
+    uint32_t parent;
+    uint32_t addr;               // Entry point of the callee
+    uint64_t count;              // Instructions retired in this context itself
+} ProfNode;
+
+// Counting profiler fed by cpu_step() while attached to a CPU
+typedef struct Prof {
+    uint64_t instructions;
+    uint64_t opcodes[256];       // By first opcode byte
+    ProfTable ips;               // Guest ip -> instructions started there
+    ProfTable unknown;           // Opcode, << 8 | sub-opcode for groups -> count
+    ProfTable contexts;          // parent << 32 | callee -> node index
+    ProfNode* nodes;             // nodes[0] is the context execution started in
+    uint32_t num_nodes;
+    uint32_t max_nodes;
+    uint32_t current;            // Context of the running code
+    uint32_t overflow;           // Calls not tracked past PROF_MAX_DEPTH
+    uint32_t depth;
+    int failed;                  // Out of memory; later samples are dropped
+} Prof;
+
+Prof* prof_create(void);
+void prof_destroy(Prof* prof);
+
+// Run one profiled instruction; replaces the engine while profiling
+int prof_step(CPU* cpu);
+void prof_unknown(Prof* prof, uint32_t opcode);
+
+// Reports go to path, "-" for stdout
+int prof_write_report(const Prof* prof, const char* path);
+int prof_write_folded(const Prof* prof, const char* path);
+
+#endif // PROF_H
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <vm.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_BUFFER_SIZE (1 << 20)  // Bytes per half of the double buffer
+#define TRACE_MAX_RECORD 64          // Upper bound on one encoded instruction
+
+// Instruction recorder fed by cpu_step() while attached to a CPU. Records
+// fill one buffer while a writer thread drains the other to the file.
+typedef struct Trace {
+    FILE* file;
+    uint8_t* buffers[2];
+    int current;                 // Buffer being filled
+    size_t used;                 // Bytes in the current buffer
+    uint8_t* pending;            // Buffer handed to the writer, NULL when idle
+    size_t pending_size;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;         // Signals pending changes and stop
+    pthread_t writer;
+    int stop;
+    int failed;                  // A write failed; the file is incomplete
+    uint64_t records;
+    int async_disk;              // VM setting to restore when recording stops
+} Trace;
+
+// Record every instruction from the current guest state on; the trace
+// starts with a snapshot so it can be replayed without the program, and
+// names the booted disk image, which replay loads again
+int trace_start(VM* vm, const char* path);
+int trace_stop(VM* vm);
+
+// Run one traced instruction; replaces the engine while tracing
+int trace_step(CPU* cpu);
+
+// Re-execute a trace through cpu_emulate_cycle(), reporting the first
+// instruction whose effect differs from the recorded one
+int trace_replay(const char* path, const VMConfig* config);
+
+#endif // TRACE_H
\ No newline at end of file
@@ -1,9 +1,9 @@
 #ifndef VGA_H
 #define VGA_H
 
-#include <SDL2/SDL.h>
-#include <SDL2/SDL_ttf.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
@@ -13,27 +13,59 @@
 #define WINDOW_HEIGHT (VGA_HEIGHT * CHAR_HEIGHT)
 #define VGA_MEMORY_START 0xB8000
 #define VGA_MEMORY_SIZE (VGA_WIDTH * VGA_HEIGHT * 2)
+#define VGA_ALL_ROWS ((1u << VGA_HEIGHT) - 1)
+
+#define VGA_SHM_MAGIC 0x41475658  // "XVGA"
 
 typedef struct {
     uint8_t character;
     uint8_t attribute;
 } VGACell;
 
+// Layout of the shared-memory screen export; readers retry while seq is odd
+typedef struct {
+    uint32_t magic;           // VGA_SHM_MAGIC
+    uint16_t width;
+    uint16_t height;
+    atomic_uint seq;          // Bumped around every update
+    uint16_t cursor_x;
+    uint16_t cursor_y;
+    VGACell cells[VGA_HEIGHT][VGA_WIDTH];
+} VGAShm;
+
+// SDL window and render thread, private to vga_display.c
+typedef struct VGADisplay VGADisplay;
+
 typedef struct {
     VGACell screen[VGA_HEIGHT][VGA_WIDTH];
-    SDL_Window* window;
-    SDL_Renderer* renderer;
-    TTF_Font* font;
-    SDL_Color textColor;
-    SDL_Color bgColor;
+    uint32_t dirty_rows;      // Rows changed since the last published snapshot
     int cursor_x;
     int cursor_y;
+    VGADisplay* display;      // NULL when headless
+    VGAShm* shm;              // NULL unless exported with vga_export_shm()
+    char* shm_name;
 } VGA;
 
-int vga_init(VGA* vga);
+// Code page 437 to Unicode, shared by the glyph atlas and text dumps
+extern const uint16_t vga_cp437[256];
+
+int vga_init(VGA* vga, int headless);
 void vga_update(VGA* vga);
+int vga_poll_events(VGA* vga);
 void vga_write_memory(VGA* vga, uint32_t address, uint8_t value);
 void vga_cleanup(VGA* vga);
 void vga_scroll_up(VGA* vga);
 
+// Screen export, available with or without a display
+int vga_dump_text(VGA* vga, FILE* out);
+int vga_dump(VGA* vga, const char* path);
+int vga_export_shm(VGA* vga, const char* name);
+
+// Display backend; stubbed out when built with XVM_NO_SDL
+VGADisplay* vga_display_open(void);
+void vga_display_publish(VGADisplay* display, VGACell screen[VGA_HEIGHT][VGA_WIDTH],
+                         uint32_t dirty);
+int vga_display_poll(VGADisplay* display);
+void vga_display_close(VGADisplay* display);
+
 #endif // VGA_H
\ No newline at end of file
@@ -2,10 +2,20 @@
 #define VM_H
 
 #include <cpu.h>
+#include <diskcache.h>
+#include <diskio.h>
+#include <diskoverlay.h>
+#include <imagecache.h>
 #include <vga.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#define VM_FRAME_NS (1000000000ULL / 60)  // Display refresh cadence
+#define VM_SLICE_NS 2000000ULL            // Target length of one CPU time slice
+#define VM_SLICE_MIN 1024                 // Instructions per slice, lower bound
+#define VM_SLICE_MAX (1 << 24)            // Instructions per slice, upper bound
+
 // Function pointer type for memory write hooks
 typedef void (*WriteHookFn)(void* data, uint32_t addr, uint8_t value);
 
@@ -17,23 +27,96 @@ typedef struct {
     void* data;
 } WriteHook;
 
-// VM structure
+// Startup options, zero-initialized for the defaults
+typedef struct {
+    int headless;             // No window; the screen is only reachable via dumps
+    int unthrottled;          // Never sleep on idle loops
+    const char* dump_path;    // Screen dump target on exit and request, "-" for stdout
+    const char* shm_name;     // Mirror the screen into this shared-memory object
+    uint32_t memory_size;     // Guest RAM in bytes, 0 for CPU_DEFAULT_MEMORY
+    int huge_pages;           // Ask the host to back guest RAM with huge pages
+    int async_disk;           // Complete INT 13h reads on a disk I/O thread
+    uint32_t disk_cache;      // INT 13h sector cache size in sectors, 0 for none
+    uint32_t disk_readahead;  // Readahead cap in sectors, 0 for DISKCACHE_READAHEAD_MAX
+    const char* disk_overlay; // Keep disk writes in this file, NULL for a temporary one
+} VMConfig;
+
+// INT 13h read in flight on a disk I/O thread
 typedef struct {
+    DiskRequest io;
+    uint32_t address;         // Guest buffer
+    uint32_t requested;       // Sectors the guest asked for
+    uint32_t packet;          // Disk address packet of an AH=42h read, 0 for AH=02h
+    int cached;               // io fills the sector cache's staging buffer, not the guest
+    uint64_t lba;             // First sector of a cached read
+    uint32_t served;          // Sectors of it already copied from the cache
+    uint32_t wanted;          // Sectors of io the guest still needs
+    int pending;
+} VmDiskRead;
+
+#define VM_BIOS_VECTOR 0xF000FF53u  // IVT entry (F000:FF53) of vectors left to the native BIOS
+#define VM_DISK_IRQ_VECTOR 0x76     // Raised as each deferred INT 13h read completes (IRQ 14)
+#define VM_SECTOR_SIZE 512
+
+typedef struct VM VM;
+
+// Native BIOS service, entered with ip past the INT instruction
+typedef void (*BiosHandlerFn)(VM* vm);
+
+// VM structure
+struct VM {
     CPU cpu;
     VGA vga;
-    FILE* disk_file;
-    long disk_size;
+    const uint8_t* disk_data; // Read-only mapping of the disk image
+    char* disk_path;          // Kept so forked VMs can map their own view
+    size_t disk_size;
+    int disk_fd;              // The image cache's descriptor once a read needs it, else -1
+    int async_disk;
+    VmDiskRead disk_read;
+    DiskCache* disk_cache;    // NULL when reads come straight from the mapping
+    DiskOverlay* disk_overlay; // Sectors the guest wrote, NULL until it writes
+    const char* overlay_path;
     WriteHook* write_hooks;
     int num_write_hooks;
-} VM;
+    int running;
+    int idle;                 // Last slice ended in a JMP-to-self loop
+    int unthrottled;          // Never sleep on idle loops
+    int headless;
+    const char* dump_path;
+    volatile sig_atomic_t dump_requested;  // Set from signal handlers
+    volatile sig_atomic_t stop_requested;
+    uint64_t instructions;    // Retired since vm_init
+    BiosHandlerFn bios[CPU_IVT_VECTORS];  // Native services by INT vector
+};
 
-int vm_init(VM* vm);
+int vm_init(VM* vm, const VMConfig* config);
 void vm_run(VM* vm);
+uint64_t vm_run_slice(VM* vm, uint64_t budget);
 void vm_cleanup(VM* vm);
+int vm_fork(VM* parent, VM* child, const VMConfig* config);
 int vm_load_iso(VM* vm, const char* filename);
 void vm_add_write_hook(VM* vm, uint32_t start, uint32_t size, WriteHookFn hook, void* data);
 void vm_write_memory(VM* vm, uint32_t addr, uint8_t value);
-void vm_handle_disk_interrupt(VM* vm);
+void vm_write_range(VM* vm, uint32_t addr, const uint8_t* data, uint32_t size);
 void vm_handle_int10(VM* vm);
+void vm_set_bios_handler(VM* vm, uint8_t vector, BiosHandlerFn handler);
+void vm_install_ivt(VM* vm);
+uint64_t vm_now_ns(void);
+
+// INT 13h services (vm_disk.c). While an asynchronous read is pending the
+// guest is stalled and vm_run_slice() returns without running it.
+void vm_handle_disk_interrupt(VM* vm);
+int vm_disk_waiting(const VM* vm);
+int vm_disk_wait(VM* vm, uint64_t timeout_ns);
+int vm_disk_poll(VM* vm);
+void vm_disk_flush(VM* vm);
+int vm_disk_discard(VM* vm);
+void vm_disk_close(VM* vm);
+
+// Full guest state to and from a sparse binary file (vm_snapshot.c)
+int vm_snapshot(VM* vm, const char* path);
+int vm_restore(VM* vm, const char* path);
+int vm_snapshot_write(VM* vm, FILE* f);
+int vm_snapshot_read(VM* vm, FILE* f);
 
 #endif // VM_H
\ No newline at end of file
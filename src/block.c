@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <block.h>
+#include <jit.h>
+
+static const void* const* block_labels;
+
+static int block_exec(CPU* cpu, const Block* block);
+
+BlockCache* block_cache_create(uint32_t memory_size) {
+    BlockCache* cache = calloc(1, sizeof(BlockCache));
+    if (!cache) return NULL;
+    // Large guests get a large bitmap; calloc leaves it untouched until used
+    cache->num_lines = (uint32_t)(((uint64_t)memory_size + (1u << BLOCK_LINE_SHIFT) - 1)
+                                  >> BLOCK_LINE_SHIFT);
+    cache->code_lines = calloc((cache->num_lines + 7) / 8, 1);
+    if (!cache->code_lines) {
+        free(cache);
+        return NULL;
+    }
+    if (!block_labels) {
+        block_exec(NULL, NULL);
+    }
+    return cache;
+}
+
+void block_cache_destroy(BlockCache* cache) {
+    if (cache->jit) {
+        jit_destroy(cache->jit);
+    }
+    free(cache->code_lines);
+    free(cache);
+}
+
+void block_cache_flush(BlockCache* cache) {
+    memset(cache->hash, 0, sizeof(cache->hash));
+    if (cache->lines_hi > cache->lines_lo) {
+        memset(&cache->code_lines[cache->lines_lo], 0, cache->lines_hi - cache->lines_lo);
+    }
+    cache->lines_lo = 0;
+    cache->lines_hi = 0;
+    cache->num_blocks = 0;
+    cache->pool_used = 0;
+    cache->flush_pending = 0;
+    if (cache->jit) {
+        jit_reset(cache->jit);
+    }
+}
+
+// Stores end a block, so the flush can wait until the next block_run()
+void block_invalidate_range(BlockCache* cache, uint32_t address, uint32_t size) {
+    uint32_t first = address >> BLOCK_LINE_SHIFT;
+    uint32_t last = (address + size - 1) >> BLOCK_LINE_SHIFT;
+    for (uint32_t line = first; line <= last && line < cache->num_lines; line++) {
+        if (cache->code_lines[line >> 3] & (1 << (line & 7))) {
+            cache->flush_pending = 1;
+            return;
+        }
+    }
+}
+
+static void block_mark_lines(BlockCache* cache, uint32_t address, uint32_t size) {
+    uint32_t first = address >> BLOCK_LINE_SHIFT;
+    uint32_t last = (address + size - 1) >> BLOCK_LINE_SHIFT;
+    if (last >= cache->num_lines) last = cache->num_lines - 1;
+    if (first > last) return;
+    for (uint32_t line = first; line <= last; line++) {
+        cache->code_lines[line >> 3] |= 1 << (line & 7);
+    }
+    if (cache->lines_hi == 0 || (first >> 3) < cache->lines_lo) {
+        cache->lines_lo = first >> 3;
+    }
+    if ((last >> 3) + 1 > cache->lines_hi) {
+        cache->lines_hi = (last >> 3) + 1;
+    }
+}
+
+// Pick an inline label for hot register-only operations
+static int block_select_op(CPU* cpu, const CpuInsn* in) {
+    int regs_ok = in->reg1 < 8 && in->reg2 < 8;
+
+    switch (cpu_read_byte(cpu, in->addr)) {
+        case 0x01: return regs_ok ? BOP_MOV_RI : BOP_CALL;
+        case 0x03: return regs_ok ? BOP_MOV_RR : BOP_CALL;
+        case 0x20: return regs_ok ? BOP_ADD_RR : BOP_CALL;
+        case 0x21: return regs_ok ? BOP_ADD_RI : BOP_CALL;
+        case 0x22: return regs_ok ? BOP_SUB_RR : BOP_CALL;
+        case 0x30: return regs_ok ? BOP_INC : BOP_CALL;
+        case 0x31: return regs_ok ? BOP_DEC : BOP_CALL;
+        case 0x32: return regs_ok ? BOP_NEG : BOP_CALL;
+        case 0x40: return regs_ok ? BOP_AND : BOP_CALL;
+        case 0x41: return regs_ok ? BOP_OR : BOP_CALL;
+        case 0x42: return regs_ok ? BOP_XOR : BOP_CALL;
+        case 0x43: return regs_ok ? BOP_NOT : BOP_CALL;
+        case 0x44: return regs_ok ? BOP_SHL : BOP_CALL;
+        case 0x45: return regs_ok ? BOP_SHR : BOP_CALL;
+        case 0x50: return regs_ok ? BOP_CMP : BOP_CALL;
+        case 0x51: case 0xEB: return BOP_JMP;
+        case 0x52: return BOP_JZ;
+        case 0x53: case 0x75: return BOP_JNZ;
+        case 0x54: return BOP_JA;
+        case 0x55: return BOP_JB;
+        case 0x70: return BOP_LOOP;
+    }
+    return (in->flags & (CPU_INSN_BRANCH | CPU_INSN_STORE)) ? BOP_CALL_END : BOP_CALL;
+}
+
+static Block* block_translate(CPU* cpu, BlockCache* cache, uint32_t start) {
+    if (cache->num_blocks == BLOCK_MAX_BLOCKS ||
+        cache->pool_used + BLOCK_MAX_INSNS + 1 > BLOCK_POOL_SIZE) {
+        block_cache_flush(cache);
+    }
+
+    Block* block = &cache->blocks[cache->num_blocks];
+    memset(block, 0, sizeof(*block));
+    block->start = start;
+    block->insns = &cache->pool[cache->pool_used];
+
+    uint32_t address = start;
+    while (block->count < BLOCK_MAX_INSNS && address < cpu->memory_size) {
+        BlockInsn* slot = &block->insns[block->count];
+        cpu_decode(cpu, address, &slot->insn);
+        slot->kind = block_select_op(cpu, &slot->insn);
+        slot->op = block_labels[slot->kind];
+        block->count++;
+        address += slot->insn.len;
+        if (slot->insn.flags & (CPU_INSN_BRANCH | CPU_INSN_STORE)) break;
+    }
+    if (block->count == 0) return NULL;
+
+    // Exit slot carries the fall-through address
+    BlockInsn* exit = &block->insns[block->count];
+    memset(exit, 0, sizeof(*exit));
+    exit->kind = BOP_EXIT;
+    exit->op = block_labels[BOP_EXIT];
+    exit->insn.addr = address;
+
+    block_mark_lines(cache, start, address - start);
+    cache->pool_used += block->count + 1;
+    cache->num_blocks++;
+
+    uint32_t bucket = start & (BLOCK_HASH_SIZE - 1);
+    block->next = cache->hash[bucket];
+    cache->hash[bucket] = block;
+    return block;
+}
+
+// Execute one block with computed-goto dispatch. Inline operations keep ip
+// stale; it is synced before generic handlers run and on every exit.
+static int block_exec(CPU* cpu, const Block* block) {
+    static const void* const labels[BOP_COUNT] = {
+        [BOP_CALL] = &&op_call,
+        [BOP_CALL_END] = &&op_call_end,
+        [BOP_EXIT] = &&op_exit,
+        [BOP_MOV_RI] = &&op_mov_ri,
+        [BOP_MOV_RR] = &&op_mov_rr,
+        [BOP_ADD_RR] = &&op_add_rr,
+        [BOP_ADD_RI] = &&op_add_ri,
+        [BOP_SUB_RR] = &&op_sub_rr,
+        [BOP_INC] = &&op_inc,
+        [BOP_DEC] = &&op_dec,
+        [BOP_NEG] = &&op_neg,
+        [BOP_AND] = &&op_and,
+        [BOP_OR] = &&op_or,
+        [BOP_XOR] = &&op_xor,
+        [BOP_NOT] = &&op_not,
+        [BOP_SHL] = &&op_shl,
+        [BOP_SHR] = &&op_shr,
+        [BOP_CMP] = &&op_cmp,
+        [BOP_JMP] = &&op_jmp,
+        [BOP_JZ] = &&op_jz,
+        [BOP_JNZ] = &&op_jnz,
+        [BOP_JA] = &&op_ja,
+        [BOP_JB] = &&op_jb,
+        [BOP_LOOP] = &&op_loop,
+    };
+
+    if (!block) {
+        block_labels = labels;
+        return 0;
+    }
+
+    const BlockInsn* bi = block->insns;
+    const CpuInsn* in = &bi->insn;
+    uint32_t* r = cpu->registers;
+
+#define NEXT() do { bi++; in = &bi->insn; goto *bi->op; } while (0)
+#define RETIRED() ((int)(bi - block->insns) + 1)
+#define BRANCH(cond) do { \
+        cpu->ip = (cond) ? in->imm : in->addr + in->len; \
+        return RETIRED(); \
+    } while (0)
+
+    goto *bi->op;
+
+op_call:
+    cpu->ip = in->addr;
+    in->fn(cpu, in);
+    NEXT();
+
+op_call_end:
+    cpu->ip = in->addr;
+    in->fn(cpu, in);
+    return RETIRED();
+
+op_exit:
+    cpu->ip = in->addr;
+    return (int)(bi - block->insns);
+
+op_mov_ri:
+    r[in->reg1] = in->imm;
+    NEXT();
+
+op_mov_rr:
+    r[in->reg1] = r[in->reg2];
+    NEXT();
+
+op_add_rr:
+    r[in->reg1] += r[in->reg2];
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_add_ri:
+    r[in->reg1] += in->imm;
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_sub_rr:
+    r[in->reg1] -= r[in->reg2];
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_inc:
+    r[in->reg1]++;
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_dec:
+    r[in->reg1]--;
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_neg:
+    r[in->reg1] = -r[in->reg1];
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_and:
+    r[in->reg1] &= r[in->reg2];
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_or:
+    r[in->reg1] |= r[in->reg2];
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_xor:
+    r[in->reg1] ^= r[in->reg2];
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_not:
+    r[in->reg1] = ~r[in->reg1];
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_shl:
+    r[in->reg1] <<= in->imm;
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_shr:
+    r[in->reg1] >>= in->imm;
+    cpu_flags_result(cpu, r[in->reg1]);
+    NEXT();
+
+op_cmp:
+    cpu_flags_compare(cpu, r[in->reg1], r[in->reg2]);
+    NEXT();
+
+op_jmp:
+    BRANCH(1);
+
+op_jz:
+    BRANCH(cpu_get_flags(cpu) & 1);
+
+op_jnz:
+    BRANCH(!(cpu_get_flags(cpu) & 1));
+
+op_ja:
+    BRANCH(!(cpu_get_flags(cpu) & 3));
+
+op_jb:
+    BRANCH(cpu_get_flags(cpu) & 2);
+
+op_loop:
+    r[2]--;
+    BRANCH(r[2] != 0);
+
+#undef NEXT
+#undef RETIRED
+#undef BRANCH
+}
+
+int block_run(CPU* cpu) {
+    BlockCache* cache = cpu->blocks;
+    if (cache->flush_pending) {
+        block_cache_flush(cache);
+    }
+
+    uint32_t ip = cpu->ip;
+    Block* block = cache->hash[ip & (BLOCK_HASH_SIZE - 1)];
+    while (block && block->start != ip) {
+        block = block->next;
+    }
+    if (!block && ip < cpu->memory_size) {
+        block = block_translate(cpu, cache, ip);
+    }
+
+    if (!block) {
+        // Out of range
+        return cpu_emulate_cycle(cpu);
+    }
+
+    if (cpu->engine != CPU_ENGINE_JIT) {
+        return block_exec(cpu, block);
+    }
+    if (!block->native && !block->jit_failed && ++block->exec_count >= JIT_THRESHOLD) {
+        block->native = jit_compile(cache->jit, block);
+        block->jit_failed = !block->native;
+        if (cache->jit->full) {
+            // Retranslate everything into an empty buffer
+            cache->flush_pending = 1;
+        }
+    }
+    if (block->native) {
+        // Native code keeps flags in a host register, so resolve them first
+        cpu_set_flags(cpu, cpu_get_flags(cpu));
+        return block->native(cpu, JIT_LOOP_BUDGET);
+    }
+    return block_exec(cpu, block);
+}
\ No newline at end of file
@@ -1,923 +1,1555 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <cpu.h>
-
-void cpu_init(CPU* cpu) {
+#include <block.h>
+#include <jit.h>
+#include <imagecache.h>
+#include <mem.h>
+#include <prof.h>
+#include <trace.h>
+
+int cpu_init(CPU* cpu, uint32_t memory_size, int mem_flags) {
     memset(cpu, 0, sizeof(CPU));
+    if (memory_size < CPU_MIN_MEMORY || memory_size > CPU_MAX_MEMORY ||
+        memory_size & (CPU_PAGE_SIZE - 1)) {
+        printf("Invalid guest memory size: %u bytes\n", memory_size);
+        return 0;
+    }
+    cpu->memory_size = memory_size;
+    cpu->num_pages = memory_size >> CPU_PAGE_SHIFT;
+    cpu->mem_flags = mem_flags;
+    cpu->fusions = CPU_FUSE_ALL;
+    cpu->memory = mem_alloc(memory_size, &cpu->mem_flags);
+    cpu->page_attr = calloc(cpu->num_pages, 1);
+    cpu->dirty_pages = malloc(sizeof(uint32_t) * cpu->num_pages);
+    if (!cpu->memory || !cpu->page_attr || !cpu->dirty_pages) {
+        printf("Failed to allocate %u bytes of guest memory\n", memory_size);
+        cpu_cleanup(cpu);
+        return 0;
+    }
+    return 1;
+}
+
+void cpu_cleanup(CPU* cpu) {
+    if (cpu->blocks) {
+        block_cache_destroy(cpu->blocks);
+        cpu->blocks = NULL;
+    }
+    mem_free(cpu->memory, cpu->memory_size);
+    cpu->memory = NULL;
+    free(cpu->page_attr);
+    cpu->page_attr = NULL;
+    free(cpu->dirty_pages);
+    cpu->dirty_pages = NULL;
+    free(cpu->hooked);
+    cpu->hooked = NULL;
+    cpu->num_hooked = 0;
+    free(cpu->pair_counts);
+    cpu->pair_counts = NULL;
+    prof_destroy(cpu->prof);
+    cpu->prof = NULL;
+    mem_image_release(cpu->image);
+    cpu->image = NULL;
+}
+
+// Forget which pages were written, once memory matches its image again
+static void cpu_clean_pages(CPU* cpu) {
+    for (uint32_t i = 0; i < cpu->num_dirty; i++) {
+        cpu->page_attr[cpu->dirty_pages[i]] &= ~CPU_PAGE_DIRTY;
+    }
+    cpu->num_dirty = 0;
+}
+
+static void cpu_set_hooked(CPU* cpu, const CpuPageRange* ranges, int count, int hooked) {
+    for (int i = 0; i < count; i++) {
+        for (uint32_t page = ranges[i].first; page <= ranges[i].last; page++) {
+            if (hooked) {
+                cpu->page_attr[page] |= CPU_PAGE_HOOK;
+            } else {
+                cpu->page_attr[page] &= ~CPU_PAGE_HOOK;
+            }
+        }
+    }
+}
+
+// Make dst a copy of src whose memory shares src's pages copy-on-write.
+// src's memory is frozen into an image first; when src wrote since the last
+// fork, the new image is the previous one plus the pages it dirtied. No
+// step reads or copies memory the guest never wrote.
+int cpu_fork(CPU* dst, CPU* src) {
+    if (dst->memory_size != src->memory_size) {
+        printf("Cannot fork a %u byte guest into %u bytes\n",
+               src->memory_size, dst->memory_size);
+        return 0;
+    }
+    MemImage* image = mem_freeze(src->memory, src->memory_size, src->image,
+                                 src->dirty_pages, src->num_dirty, src->mem_flags);
+    if (!image) return 0;
+    src->image = image;
+    cpu_clean_pages(src);
+    if (!mem_map_image(dst->memory, image, dst->mem_flags)) return 0;
+    mem_image_release(dst->image);
+    dst->image = mem_image_retain(image);
+
+    memcpy(dst->registers, src->registers, sizeof(dst->registers));
+    dst->ip = src->ip;
+    cpu_set_flags(dst, cpu_get_flags(src));
+    dst->cs = src->cs;
+    dst->ds = src->ds;
+    dst->es = src->es;
+    dst->ss = src->ss;
+    dst->fs = src->fs;
+    dst->gs = src->gs;
+    dst->halted = src->halted;
+    dst->tsc = src->tsc;
+    dst->ivt = src->ivt;
+
+    // Decodes stay valid since memory is identical; blocks are rebuilt.
+    // src's attributes come over in one copy, with the hooked pages then
+    // swapped for dst's own devices. Nothing is dirty in either.
+    memcpy(dst->icache, src->icache, sizeof(dst->icache));
+    memcpy(dst->page_attr, src->page_attr, dst->num_pages);
+    cpu_set_hooked(dst, src->hooked, src->num_hooked, 0);
+    cpu_set_hooked(dst, dst->hooked, dst->num_hooked, 1);
+    dst->num_dirty = 0;
+    if (dst->blocks) {
+        block_cache_flush(dst->blocks);
+    }
+    return cpu_set_engine(dst, src->engine);
+}
+
+int cpu_set_engine(CPU* cpu, CpuEngine engine) {
+    if (engine != CPU_ENGINE_INTERP && !cpu->blocks) {
+        cpu->blocks = block_cache_create(cpu->memory_size);
+        if (!cpu->blocks) {
+            printf("Failed to allocate block cache\n");
+            return 0;
+        }
+    }
+    if (engine == CPU_ENGINE_JIT && !cpu->blocks->jit) {
+        cpu->blocks->jit = jit_create();
+        if (!cpu->blocks->jit) {
+            printf("JIT unavailable on this host, using threaded engine\n");
+            engine = CPU_ENGINE_THREADED;
+        }
+    }
+    cpu->engine = engine;
+    return 1;
+}
+
+// Count every instruction from now on. Profiled instructions run one at a
+// time through the interpreter, unfused, whatever the engine.
+int cpu_enable_profiler(CPU* cpu) {
+    if (!cpu->prof) {
+        cpu->prof = prof_create();
+        if (!cpu->prof) {
+            printf("Failed to allocate profiler\n");
+            return 0;
+        }
+    }
+    cpu_set_fusions(cpu, 0);
+    return 1;
+}
+
+// Drop cached decodes that may overlap a write to [address, address + size)
+void cpu_invalidate_range(CPU* cpu, uint32_t address, uint32_t size) {
+    if (size == 0 || address >= cpu->memory_size) return;
+    uint32_t end = (size > cpu->memory_size - address) ? cpu->memory_size : address + size;
+
+    int touched = 0;
+    for (uint32_t page = address >> CPU_PAGE_SHIFT;
+         page <= ((end - 1) >> CPU_PAGE_SHIFT); page++) {
+        touched |= cpu->page_attr[page] & CPU_PAGE_CODE;
+    }
+    if (!touched) return;
+
+    if (cpu->blocks) {
+        block_invalidate_range(cpu->blocks, address, end - address);
+    }
+
+    if (end - address >= ICACHE_SIZE) {
+        cpu_flush_icache(cpu);
+        return;
+    }
+
+    // An entry starting up to CPU_MAX_ENTRY_LEN - 1 bytes earlier may
+    // still cover the written range
+    uint32_t start = address >= CPU_MAX_ENTRY_LEN - 1 ?
+        address - (CPU_MAX_ENTRY_LEN - 1) : 0;
+    for (uint32_t a = start; a < end; a++) {
+        CpuInsn* insn = &cpu->icache[a & (ICACHE_SIZE - 1)];
+        if (insn->fn && insn->addr == a) {
+            insn->fn = NULL;
+        }
+    }
+}
+
+void cpu_flush_icache(CPU* cpu) {
+    memset(cpu->icache, 0, sizeof(cpu->icache));
+    for (uint32_t page = 0; page < cpu->num_pages; page++) {
+        cpu->page_attr[page] &= ~CPU_PAGE_CODE;
+    }
+    if (cpu->blocks) {
+        block_cache_flush(cpu->blocks);
+    }
+}
+
+void cpu_set_write_hook(CPU* cpu, CpuWriteHookFn hook, void* data) {
+    cpu->write_hook = hook;
+    cpu->write_hook_data = data;
+}
+
+void cpu_set_int_hook(CPU* cpu, CpuIntHookFn hook, void* data) {
+    cpu->int_hook = hook;
+    cpu->int_hook_data = data;
+}
+
+// Take a software interrupt with ip at the return address. The hook (the
+// VM's native BIOS) goes first; otherwise a live IVT entry is followed like
+// real mode, pushing flags, cs and the return address for IRET. Without a
+// table the interrupt does nothing.
+void cpu_interrupt(CPU* cpu, uint8_t vector) {
+    if (cpu->int_hook && cpu->int_hook(cpu->int_hook_data, vector)) return;
+    if (!cpu->ivt) return;
+
+    uint32_t entry = cpu_read_dword(cpu, (uint32_t)vector * 4);
+    cpu->registers[7] -= 12;
+    cpu_write_dword(cpu, cpu->registers[7] + 8, cpu_get_flags(cpu));
+    cpu_write_dword(cpu, cpu->registers[7] + 4, cpu->cs);
+    cpu_write_dword(cpu, cpu->registers[7], cpu->ip);
+    cpu->cs = (uint16_t)(entry >> 16);
+    cpu->ip = ((entry >> 16) << 4) + (entry & 0xFFFF);
+}
+
+// Report stores to [address, address + size) to the write hook
+void cpu_hook_range(CPU* cpu, uint32_t address, uint32_t size) {
+    if (size == 0 || address >= cpu->memory_size) return;
+    uint32_t end = (size > cpu->memory_size - address) ? cpu->memory_size : address + size;
+    CpuPageRange* hooked = realloc(cpu->hooked, sizeof(CpuPageRange) * (cpu->num_hooked + 1));
+    if (!hooked) {
+        printf("Failed to record hooked range\n");
+        return;
+    }
+    cpu->hooked = hooked;
+    CpuPageRange* range = &cpu->hooked[cpu->num_hooked++];
+    range->first = address >> CPU_PAGE_SHIFT;
+    range->last = (end - 1) >> CPU_PAGE_SHIFT;
+    cpu_set_hooked(cpu, range, 1, 1);
+}
+
+// Note pages changed without a store through the CPU, such as bulk loads
+void cpu_mark_dirty(CPU* cpu, uint32_t address, uint32_t size) {
+    if (size == 0 || address >= cpu->memory_size) return;
+    uint32_t end = (size > cpu->memory_size - address) ? cpu->memory_size : address + size;
+    for (uint32_t page = address >> CPU_PAGE_SHIFT;
+         page <= ((end - 1) >> CPU_PAGE_SHIFT); page++) {
+        if (!(cpu->page_attr[page] & CPU_PAGE_DIRTY)) {
+            cpu->page_attr[page] |= CPU_PAGE_DIRTY;
+            cpu->dirty_pages[cpu->num_dirty++] = page;
+        }
+    }
+}
+
+// Every store lands here after updating memory: the pages are marked dirty,
+// decodes of overwritten code are dropped and MMIO pages are forwarded to
+// the write hook
+void cpu_note_write(CPU* cpu, uint32_t address, uint32_t size) {
+    uint32_t first = address >> CPU_PAGE_SHIFT;
+    uint32_t last = (address + size - 1) >> CPU_PAGE_SHIFT;
+    uint8_t attr = cpu->page_attr[first] | cpu->page_attr[last];
+    uint8_t all = cpu->page_attr[first] & cpu->page_attr[last];
+    for (uint32_t page = first + 1; page < last; page++) {
+        attr |= cpu->page_attr[page];
+        all &= cpu->page_attr[page];
+    }
+    if (!(all & CPU_PAGE_DIRTY)) {
+        cpu_mark_dirty(cpu, address, size);
+    }
+    if (!(attr & (CPU_PAGE_CODE | CPU_PAGE_HOOK))) return;
+
+    if (attr & CPU_PAGE_CODE) {
+        cpu_invalidate_range(cpu, address, size);
+    }
+    if ((attr & CPU_PAGE_HOOK) && cpu->write_hook) {
+        cpu->write_hook(cpu->write_hook_data, address, size);
+    }
 }
 
 uint8_t cpu_read_byte(CPU* cpu, uint32_t address) {
-    if (address < MEMORY_SIZE) {
+    if (address < cpu->memory_size) {
         return cpu->memory[address];
     }
     return 0;
 }
 
 void cpu_write_byte(CPU* cpu, uint32_t address, uint8_t value) {
-    if (address < MEMORY_SIZE) {
+    if (address < cpu->memory_size) {
         cpu->memory[address] = value;
+        cpu_note_write(cpu, address, 1);
     }
 }
 
 uint32_t cpu_read_dword(CPU* cpu, uint32_t address) {
-    if (address + 3 < MEMORY_SIZE) {
+    if (address <= cpu->memory_size - 4) {
         return *(uint32_t*)&cpu->memory[address];
     }
     return 0;
 }
 
 void cpu_write_dword(CPU* cpu, uint32_t address, uint32_t value) {
-    if (address + 3 < MEMORY_SIZE) {
+    if (address <= cpu->memory_size - 4) {
         *(uint32_t*)&cpu->memory[address] = value;
+        cpu_note_write(cpu, address, 4);
     }
 }
 
 void cpu_write_word(CPU* cpu, uint32_t address, uint16_t value) {
-    if (address + 1 < MEMORY_SIZE) {
+    if (address <= cpu->memory_size - 2) {
         cpu->memory[address] = value & 0xFF;
         cpu->memory[address + 1] = (value >> 8) & 0xFF;
+        cpu_note_write(cpu, address, 2);
     }
 }
 
 uint16_t cpu_read_word(CPU* cpu, uint32_t address) {
-    if (address + 1 < MEMORY_SIZE) {
+    if (address <= cpu->memory_size - 2) {
         return cpu->memory[address] | (cpu->memory[address + 1] << 8);
     }
     return 0;
 }
 
-void cpu_emulate_cycle(CPU* cpu) {
-    uint8_t opcode = cpu_read_byte(cpu, cpu->ip);
-    uint8_t reg1, reg2, modrm;
-    int8_t offset;
-    uint32_t addr, value;
-    
-    switch(opcode) {
-        // 0x00-0x0F: Basic Data Movement
-        case 0x00: // NOP
-            cpu->ip++;
-            break;
-            
-        case 0x01: // MOV reg, imm32
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            value = cpu_read_dword(cpu, cpu->ip + 2);
-            if (reg1 < 8) cpu->registers[reg1] = value;
-            cpu->ip += 6;
-            break;
-            
-        case 0x02: // MOV [addr], reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            addr = cpu_read_dword(cpu, cpu->ip + 2);
-            if (reg1 < 8) cpu_write_dword(cpu, addr, cpu->registers[reg1]);
-            cpu->ip += 6;
-            break;
-            
-        case 0x03: // MOV reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) cpu->registers[reg1] = cpu->registers[reg2];
-            cpu->ip += 3;
-            break;
-            
-        case 0x04: // MOV reg, [addr]
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            addr = cpu_read_dword(cpu, cpu->ip + 2);
-            if (reg1 < 8) cpu->registers[reg1] = cpu_read_dword(cpu, addr);
-            cpu->ip += 6;
-            break;
-            
-        case 0x05: // XCHG reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                value = cpu->registers[reg1];
-                cpu->registers[reg1] = cpu->registers[reg2];
-                cpu->registers[reg2] = value;
-            }
-            cpu->ip += 3;
-            break;
+// Instruction handlers. Operands were validated by cpu_decode(), so register
+// indices are always < 8 here.
 
-        case 0x06: // PUSH reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                cpu->registers[7] -= 4;
-                cpu_write_dword(cpu, cpu->registers[7], cpu->registers[reg1]);
-            }
-            cpu->ip += 2;
-            break;
+// Encodings with an out-of-range register operand only advance ip
+static void op_skip(CPU* cpu, const CpuInsn* in) {
+    cpu->ip += in->len;
+}
 
-        case 0x07: // POP reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                cpu->registers[reg1] = cpu_read_dword(cpu, cpu->registers[7]);
-                cpu->registers[7] += 4;
-            }
-            cpu->ip += 2;
-            break;
+// 0x00-0x0F: Basic Data Movement
+static void op_mov_reg_imm(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = in->imm;
+    cpu->ip += in->len;
+}
 
-        // 0x10-0x1F: Advanced Data Movement
-        case 0x10: // MOVZX reg1, byte[addr]
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            addr = cpu_read_dword(cpu, cpu->ip + 2);
-            if (reg1 < 8) cpu->registers[reg1] = cpu_read_byte(cpu, addr);
-            cpu->ip += 6;
-            break;
+static void op_mov_mem_reg(CPU* cpu, const CpuInsn* in) {
+    cpu_write_dword(cpu, in->imm, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x11: // MOVSX reg1, byte[addr]
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            addr = cpu_read_dword(cpu, cpu->ip + 2);
-            if (reg1 < 8) {
-                int8_t signed_byte = (int8_t)cpu_read_byte(cpu, addr);
-                cpu->registers[reg1] = (int32_t)signed_byte;
-            }
-            cpu->ip += 6;
-            break;
+static void op_mov_reg_reg(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = cpu->registers[in->reg2];
+    cpu->ip += in->len;
+}
 
-        // 0x20-0x2F: Basic Arithmetic
-        case 0x20: // ADD reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] += cpu->registers[reg2];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_mov_reg_mem(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = cpu_read_dword(cpu, in->imm);
+    cpu->ip += in->len;
+}
 
-        case 0x21: // ADD reg, imm32
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            value = cpu_read_dword(cpu, cpu->ip + 2);
-            if (reg1 < 8) {
-                cpu->registers[reg1] += value;
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 6;
-            break;
+static void op_xchg(CPU* cpu, const CpuInsn* in) {
+    uint32_t value = cpu->registers[in->reg1];
+    cpu->registers[in->reg1] = cpu->registers[in->reg2];
+    cpu->registers[in->reg2] = value;
+    cpu->ip += in->len;
+}
 
-        case 0x22: // SUB reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] -= cpu->registers[reg2];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_push(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] -= 4;
+    cpu_write_dword(cpu, cpu->registers[7], cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x23: // MUL reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                uint64_t result = (uint64_t)cpu->registers[0] * cpu->registers[reg1];
-                cpu->registers[0] = result & 0xFFFFFFFF;
-                cpu->registers[1] = (result >> 32) & 0xFFFFFFFF;
-            }
-            cpu->ip += 2;
-            break;
+static void op_pop(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = cpu_read_dword(cpu, cpu->registers[7]);
+    cpu->registers[7] += 4;
+    cpu->ip += in->len;
+}
 
-        case 0x24: // DIV reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8 && cpu->registers[reg1] != 0) {
-                uint64_t dividend = ((uint64_t)cpu->registers[1] << 32) | cpu->registers[0];
-                cpu->registers[0] = dividend / cpu->registers[reg1];  // quotient
-                cpu->registers[1] = dividend % cpu->registers[reg1];  // remainder
-            }
-            cpu->ip += 2;
-            break;
+// 0x10-0x1F: Advanced Data Movement
+static void op_movzx(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = cpu_read_byte(cpu, in->imm);
+    cpu->ip += in->len;
+}
 
-        // 0x30-0x3F: Advanced Arithmetic
-        case 0x30: // INC reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                cpu->registers[reg1]++;
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 2;
-            break;
+static void op_movsx(CPU* cpu, const CpuInsn* in) {
+    int8_t signed_byte = (int8_t)cpu_read_byte(cpu, in->imm);
+    cpu->registers[in->reg1] = (int32_t)signed_byte;
+    cpu->ip += in->len;
+}
 
-        case 0x31: // DEC reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                cpu->registers[reg1]--;
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 2;
-            break;
+// 0x20-0x2F: Basic Arithmetic
+static void op_add_reg_reg(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] += cpu->registers[in->reg2];
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x32: // NEG reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                cpu->registers[reg1] = -cpu->registers[reg1];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 2;
-            break;
+static void op_add_reg_imm(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] += in->imm;
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        // 0x40-0x4F: Bitwise Operations
-        case 0x40: // AND reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] &= cpu->registers[reg2];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_sub_reg_reg(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] -= cpu->registers[in->reg2];
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x41: // OR reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] |= cpu->registers[reg2];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_mul(CPU* cpu, const CpuInsn* in) {
+    uint64_t result = (uint64_t)cpu->registers[0] * cpu->registers[in->reg1];
+    cpu->registers[0] = result & 0xFFFFFFFF;
+    cpu->registers[1] = (result >> 32) & 0xFFFFFFFF;
+    cpu->ip += in->len;
+}
 
-        case 0x42: // XOR reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] ^= cpu->registers[reg2];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_div(CPU* cpu, const CpuInsn* in) {
+    if (cpu->registers[in->reg1] != 0) {
+        uint64_t dividend = ((uint64_t)cpu->registers[1] << 32) | cpu->registers[0];
+        cpu->registers[0] = dividend / cpu->registers[in->reg1];  // quotient
+        cpu->registers[1] = dividend % cpu->registers[in->reg1];  // remainder
+    }
+    cpu->ip += in->len;
+}
 
-        case 0x43: // NOT reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                cpu->registers[reg1] = ~cpu->registers[reg1];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 2;
-            break;
+// 0x30-0x3F: Advanced Arithmetic
+static void op_inc(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1]++;
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x44: // SHL reg, imm8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            value = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8) {
-                cpu->registers[reg1] <<= value;
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_dec(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1]--;
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x45: // SHR reg, imm8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            value = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8) {
-                cpu->registers[reg1] >>= value;
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_neg(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = -cpu->registers[in->reg1];
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x46: // ROL reg, imm8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            value = cpu_read_byte(cpu, cpu->ip + 2) & 0x1F;
-            if (reg1 < 8) {
-                uint32_t x = cpu->registers[reg1];
-                cpu->registers[reg1] = (x << value) | (x >> (32 - value));
-            }
-            cpu->ip += 3;
-            break;
+// 0x40-0x4F: Bitwise Operations
+static void op_and(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] &= cpu->registers[in->reg2];
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x47: // ROR reg, imm8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            value = cpu_read_byte(cpu, cpu->ip + 2) & 0x1F;
-            if (reg1 < 8) {
-                uint32_t x = cpu->registers[reg1];
-                cpu->registers[reg1] = (x >> value) | (x << (32 - value));
-            }
-            cpu->ip += 3;
-            break;
+static void op_or(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] |= cpu->registers[in->reg2];
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        // 0x50-0x5F: Comparison and Jumps
-        case 0x50: // CMP reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                uint32_t result = cpu->registers[reg1] - cpu->registers[reg2];
-                cpu->flags = 0;
-                if (result == 0) cpu->flags |= 1;  // ZF
-                if (cpu->registers[reg1] < cpu->registers[reg2]) cpu->flags |= 2;  // CF
-            }
-            cpu->ip += 3;
-            break;
+static void op_xor(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] ^= cpu->registers[in->reg2];
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x51: // JMP imm32
-            addr = cpu_read_dword(cpu, cpu->ip + 1);
-            cpu->ip = addr;
-            break;
+static void op_not(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = ~cpu->registers[in->reg1];
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x52: // JZ imm32
-            addr = cpu_read_dword(cpu, cpu->ip + 1);
-            if (cpu->flags & 1) cpu->ip = addr;
-            else cpu->ip += 5;
-            break;
+static void op_shl(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] <<= in->imm;
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x53: // JNZ imm32
-            addr = cpu_read_dword(cpu, cpu->ip + 1);
-            if (!(cpu->flags & 1)) cpu->ip = addr;
-            else cpu->ip += 5;
-            break;
+static void op_shr(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] >>= in->imm;
+    cpu_flags_result(cpu, cpu->registers[in->reg1]);
+    cpu->ip += in->len;
+}
 
-        case 0x54: // JA imm32 (above - unsigned)
-            addr = cpu_read_dword(cpu, cpu->ip + 1);
-            if (!(cpu->flags & 3)) cpu->ip = addr;  // !CF and !ZF
-            else cpu->ip += 5;
-            break;
+static void op_rol(CPU* cpu, const CpuInsn* in) {
+    uint32_t x = cpu->registers[in->reg1];
+    cpu->registers[in->reg1] = (x << in->imm) | (x >> (32 - in->imm));
+    cpu->ip += in->len;
+}
 
-        case 0x55: // JB imm32 (below - unsigned)
-            addr = cpu_read_dword(cpu, cpu->ip + 1);
-            if (cpu->flags & 2) cpu->ip = addr;  // CF
-            else cpu->ip += 5;
-            break;
+static void op_ror(CPU* cpu, const CpuInsn* in) {
+    uint32_t x = cpu->registers[in->reg1];
+    cpu->registers[in->reg1] = (x >> in->imm) | (x << (32 - in->imm));
+    cpu->ip += in->len;
+}
 
-        // 0x60-0x6F: Subroutines and Stack
-        case 0x60: // CALL imm32
-            addr = cpu_read_dword(cpu, cpu->ip + 1);
-            cpu->registers[7] -= 4;
-            cpu_write_dword(cpu, cpu->registers[7], cpu->ip + 5);
-            cpu->ip = addr;
-            break;
+// 0x50-0x5F: Comparison and Jumps
+static void op_cmp(CPU* cpu, const CpuInsn* in) {
+    uint32_t a = cpu->registers[in->reg1];
+    uint32_t b = cpu->registers[in->reg2];
+    cpu_flags_compare(cpu, a, b);     // ZF if a == b, CF if a < b
+    cpu->ip += in->len;
+}
 
-        case 0x61: // RET
-            addr = cpu_read_dword(cpu, cpu->registers[7]);
-            cpu->registers[7] += 4;
-            cpu->ip = addr;
-            break;
+static void op_jmp(CPU* cpu, const CpuInsn* in) {
+    cpu->ip = in->imm;
+}
 
-        case 0x62: // PUSHF
-            cpu->registers[7] -= 4;
-            cpu_write_dword(cpu, cpu->registers[7], cpu->flags);
-            cpu->ip++;
-            break;
+static void op_jz(CPU* cpu, const CpuInsn* in) {
+    if (cpu_get_flags(cpu) & 1) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
 
-        case 0x63: // POPF
-            cpu->flags = cpu_read_dword(cpu, cpu->registers[7]);
-            cpu->registers[7] += 4;
-            cpu->ip++;
-            break;
+static void op_jnz(CPU* cpu, const CpuInsn* in) {
+    if (!(cpu_get_flags(cpu) & 1)) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
 
-        // 0x70-0x7F: Advanced Flow Control
-        case 0x70: // LOOP imm32
-            addr = cpu_read_dword(cpu, cpu->ip + 1);
-            cpu->registers[2]--;  // Assume R2 is counter
-            if (cpu->registers[2] != 0)
-                        addr = cpu_read_dword(cpu, cpu->ip + 1);
-            cpu->registers[2]--;  // Assume R2 is counter
-            if (cpu->registers[2] != 0) cpu->ip = addr;
-            else cpu->ip += 5;
-            break;
+static void op_ja(CPU* cpu, const CpuInsn* in) {
+    if (!(cpu_get_flags(cpu) & 3)) cpu->ip = in->imm;  // !CF and !ZF
+    else cpu->ip += in->len;
+}
 
-        // 0x80-0x8F: Memory Operations
-        case 0x80: // LEA reg, [addr]
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            addr = cpu_read_dword(cpu, cpu->ip + 2);
-            if (reg1 < 8) cpu->registers[reg1] = addr;
-            cpu->ip += 6;
-            break;
+static void op_jb(CPU* cpu, const CpuInsn* in) {
+    if (cpu_get_flags(cpu) & 2) cpu->ip = in->imm;  // CF
+    else cpu->ip += in->len;
+}
 
-        case 0x81: // CMPSB
-            {
-                uint8_t val1 = cpu_read_byte(cpu, cpu->registers[4]);  // SI in R4
-                uint8_t val2 = cpu_read_byte(cpu, cpu->registers[5]);  // DI in R5
-                cpu->registers[4]++;
-                cpu->registers[5]++;
-                cpu->flags = (val1 == val2) ? 1 : 0;
-            }
-            cpu->ip++;
-            break;
+// 0x60-0x6F: Subroutines and Stack
+static void op_call(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] -= 4;
+    cpu_write_dword(cpu, cpu->registers[7], cpu->ip + in->len);
+    cpu->ip = in->imm;
+}
 
-        case 0x82: // MOVSB
-            {
-                uint8_t val = cpu_read_byte(cpu, cpu->registers[4]);  // SI in R4
-                cpu_write_byte(cpu, cpu->registers[5], val);          // DI in R5
-                cpu->registers[4]++;
-                cpu->registers[5]++;
-            }
-            cpu->ip++;
-            break;
+static void op_ret(CPU* cpu, const CpuInsn* in) {
+    (void)in;
+    uint32_t addr = cpu_read_dword(cpu, cpu->registers[7]);
+    cpu->registers[7] += 4;
+    cpu->ip = addr;
+}
 
-        // 0x90-0x9F: String Operations
-        case 0x90: // REP prefix
-            {
-                uint8_t next_op = cpu_read_byte(cpu, cpu->ip + 1);
-                while (cpu->registers[2] != 0) {  // CX in R2
-                    switch (next_op) {
-                        case 0x81: // REP CMPSB
-                            {
-                                uint8_t val1 = cpu_read_byte(cpu, cpu->registers[4]);
-                                uint8_t val2 = cpu_read_byte(cpu, cpu->registers[5]);
-                                cpu->registers[4]++;
-                                cpu->registers[5]++;
-                                cpu->flags = (val1 == val2) ? 1 : 0;
-                                if (val1 != val2) goto rep_done;
-                            }
-                            break;
-                        case 0x82: // REP MOVSB
-                            {
-                                uint8_t val = cpu_read_byte(cpu, cpu->registers[4]);
-                                cpu_write_byte(cpu, cpu->registers[5], val);
-                                cpu->registers[4]++;
-                                cpu->registers[5]++;
-                            }
-                            break;
-                    }
-                    cpu->registers[2]--;
-                }
-                rep_done:
-                cpu->ip += 2;
-            }
-            break;
+static void op_pushf(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] -= 4;
+    cpu_write_dword(cpu, cpu->registers[7], cpu_get_flags(cpu));
+    cpu->ip += in->len;
+}
 
-        // 0xA0-0xAF: I/O Operations
-        case 0xA0: // IN reg, port
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            value = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8) {
-                // Simulate I/O - in real VM would interface with devices
-                cpu->registers[reg1] = 0xFF;  // Dummy read
-            }
-            cpu->ip += 3;
-            break;
+static void op_popf(CPU* cpu, const CpuInsn* in) {
+    cpu_set_flags(cpu, cpu_read_dword(cpu, cpu->registers[7]));
+    cpu->registers[7] += 4;
+    cpu->ip += in->len;
+}
 
-        case 0xA1: // OUT port, reg
-            value = cpu_read_byte(cpu, cpu->ip + 1);
-            reg1 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8) {
-                // Simulate I/O - in real VM would interface with devices
-                // printf("Output %08X to port %02X\n", cpu->registers[reg1], value);
-            }
-            cpu->ip += 3;
-            break;
+// 0x70-0x7F: Advanced Flow Control
+static void op_loop(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[2]--;  // Assume R2 is counter
+    if (cpu->registers[2] != 0) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
 
-        // 0xB0-0xBF: System Operations
-        case 0xB0: // CLI - Clear Interrupt Flag
-            cpu->flags &= ~4;  // Bit 2 is IF
-            cpu->ip++;
-            break;
+// 0x80-0x8F: Memory Operations
+static void op_lea(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = in->imm;
+    cpu->ip += in->len;
+}
 
-        case 0xB1: // STI - Set Interrupt Flag
-            cpu->flags |= 4;   // Bit 2 is IF
-            cpu->ip++;
-            break;
+static void op_cmpsb(CPU* cpu, const CpuInsn* in) {
+    uint8_t val1 = cpu_read_byte(cpu, cpu->registers[4]);  // SI in R4
+    uint8_t val2 = cpu_read_byte(cpu, cpu->registers[5]);  // DI in R5
+    cpu->registers[4]++;
+    cpu->registers[5]++;
+    cpu_flags_result(cpu, val1 ^ val2);
+    cpu->ip += in->len;
+}
 
-        case 0xB2: // HLT
-            // In real implementation would signal VM to stop
-            printf("CPU HALT\n");
-            cpu->ip++;
-            break;
+static void op_movsb(CPU* cpu, const CpuInsn* in) {
+    uint8_t val = cpu_read_byte(cpu, cpu->registers[4]);  // SI in R4
+    cpu_write_byte(cpu, cpu->registers[5], val);          // DI in R5
+    cpu->registers[4]++;
+    cpu->registers[5]++;
+    cpu->ip += in->len;
+}
 
-        // 0xC0-0xCF: Extended Arithmetic
-        case 0xC0: // IMUL reg1, reg2
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                int64_t result = (int64_t)(int32_t)cpu->registers[reg1] * 
-                                (int64_t)(int32_t)cpu->registers[reg2];
-                cpu->registers[reg1] = (uint32_t)result;
-                cpu->registers[1] = (uint32_t)(result >> 32);  // High part in rdx
-            }
-            cpu->ip += 3;
-            break;
+// 0x90-0x9F: String Operations
 
-        case 0xC1: // IDIV reg
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8 && cpu->registers[reg1] != 0) {
-                int64_t dividend = ((int64_t)cpu->registers[1] << 32) | cpu->registers[0];
-                int32_t divisor = (int32_t)cpu->registers[reg1];
-                cpu->registers[0] = dividend / divisor;  // quotient
-                cpu->registers[1] = dividend % divisor;  // remainder
-            }
-            cpu->ip += 2;
-            break;
+// Both ranges fully inside guest memory
+static int cpu_range_ok(CPU* cpu, uint32_t address, uint32_t size) {
+    return address < cpu->memory_size && size <= cpu->memory_size - address;
+}
 
-        // 0xD0-0xDF: Extended Bit Operations
-        case 0xD0: // BSF reg1, reg2 (Bit Scan Forward)
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                uint32_t value = cpu->registers[reg2];
-                if (value == 0) {
-                    cpu->flags |= 1;  // ZF = 1
-                } else {
-                    cpu->flags &= ~1;  // ZF = 0
-                    cpu->registers[reg1] = __builtin_ctz(value);
-                }
-            }
-            cpu->ip += 3;
-            break;
+static int cpu_range_hooked(CPU* cpu, uint32_t address, uint32_t size) {
+    for (uint32_t page = address >> CPU_PAGE_SHIFT;
+         page <= ((address + size - 1) >> CPU_PAGE_SHIFT); page++) {
+        if (cpu->page_attr[page] & CPU_PAGE_HOOK) return 1;
+    }
+    return 0;
+}
+
+// REP MOVSB between RAM ranges as one memmove. A destination starting inside
+// the source replicates bytes when copied forward, so that stays per byte.
+static int cpu_rep_movsb_fast(CPU* cpu, uint32_t count) {
+    uint32_t src = cpu->registers[4], dst = cpu->registers[5];
+    if (!cpu_range_ok(cpu, src, count) || !cpu_range_ok(cpu, dst, count)) return 0;
+    if (dst > src && dst < src + count) return 0;
+    if (cpu_range_hooked(cpu, dst, count)) return 0;
+
+    memmove(&cpu->memory[dst], &cpu->memory[src], count);
+    cpu_note_write(cpu, dst, count);
+    cpu->registers[4] += count;
+    cpu->registers[5] += count;
+    cpu->registers[2] = 0;
+    return 1;
+}
+
+// Index of the first differing byte, or size; memcmp screens whole chunks
+static uint32_t cpu_mismatch(const uint8_t* a, const uint8_t* b, uint32_t size) {
+    uint32_t i = 0;
+    while (i + 64 <= size && memcmp(a + i, b + i, 64) == 0) {
+        i += 64;
+    }
+    while (i < size && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// REP CMPSB with the same register effects as the per-byte loop: the
+// mismatching step advances SI/DI but leaves CX alone
+static int cpu_rep_cmpsb_fast(CPU* cpu, uint32_t count) {
+    uint32_t src = cpu->registers[4], dst = cpu->registers[5];
+    if (!cpu_range_ok(cpu, src, count) || !cpu_range_ok(cpu, dst, count)) return 0;
+
+    uint32_t equal = cpu_mismatch(&cpu->memory[src], &cpu->memory[dst], count);
+    uint32_t steps = equal < count ? equal + 1 : count;
+    cpu->registers[4] += steps;
+    cpu->registers[5] += steps;
+    cpu->registers[2] -= equal;
+    cpu_set_flags(cpu, equal == count ? 1 : 0);
+    return 1;
+}
+
+static void op_rep(CPU* cpu, const CpuInsn* in) {
+    uint32_t count = cpu->registers[2];
+    if (count && ((in->opcode == 0x82 && cpu_rep_movsb_fast(cpu, count)) ||
+                  (in->opcode == 0x81 && cpu_rep_cmpsb_fast(cpu, count)))) {
+        cpu->ip += in->len;
+        return;
+    }
 
-        case 0xD1: // BSR reg1, reg2 (Bit Scan Reverse)
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                uint32_t value = cpu->registers[reg2];
-                if (value == 0) {
-                    cpu->flags |= 1;  // ZF = 1
-                } else {
-                    cpu->flags &= ~1;  // ZF = 0
-                    cpu->registers[reg1] = 31 - __builtin_clz(value);
+    while (cpu->registers[2] != 0) {  // CX in R2
+        switch (in->opcode) {
+            case 0x81: // REP CMPSB
+                {
+                    uint8_t val1 = cpu_read_byte(cpu, cpu->registers[4]);
+                    uint8_t val2 = cpu_read_byte(cpu, cpu->registers[5]);
+                    cpu->registers[4]++;
+                    cpu->registers[5]++;
+                    cpu_flags_result(cpu, val1 ^ val2);
+                    if (val1 != val2) goto rep_done;
                 }
-            }
-            cpu->ip += 3;
-            break;
+                break;
+            case 0x82: // REP MOVSB
+                {
+                    uint8_t val = cpu_read_byte(cpu, cpu->registers[4]);
+                    cpu_write_byte(cpu, cpu->registers[5], val);
+                    cpu->registers[4]++;
+                    cpu->registers[5]++;
+                }
+                break;
+        }
+        cpu->registers[2]--;
+    }
+    rep_done:
+    cpu->ip += in->len;
+}
 
-        case 0xD2: // POPCNT reg1, reg2 (Population Count)
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] = __builtin_popcount(cpu->registers[reg2]);
-            }
-            cpu->ip += 3;
-            break;
+// 0xA0-0xAF: I/O Operations
+static void op_in(CPU* cpu, const CpuInsn* in) {
+    // Simulate I/O - in real VM would interface with devices
+    cpu->registers[in->reg1] = 0xFF;  // Dummy read
+    cpu->ip += in->len;
+}
 
-        // 0xE0-0xEF: Extended Flow Control
-        case 0xE0: // SYSCALL
-            // Save return address
-            cpu->registers[7] -= 4;
-            cpu_write_dword(cpu, cpu->registers[7], cpu->ip + 1);
-            // Save flags
-            cpu->registers[7] -= 4;
-            cpu_write_dword(cpu, cpu->registers[7], cpu->flags);
-            // Jump to system call handler (fixed address for simplicity)
-            cpu->ip = 0x1000;  // System call table address
-            break;
+// 0xB0-0xBF: System Operations
+static void op_cli(CPU* cpu, const CpuInsn* in) {
+    cpu_set_flags(cpu, cpu_get_flags(cpu) & ~4);  // Bit 2 is IF
+    cpu->ip += in->len;
+}
 
-        case 0xE1: // SYSRET
-            // Restore flags
-            cpu->flags = cpu_read_dword(cpu, cpu->registers[7]);
-            cpu->registers[7] += 4;
-            // Restore return address
-            cpu->ip = cpu_read_dword(cpu, cpu->registers[7]);
-            cpu->registers[7] += 4;
-            break;
+static void op_sti(CPU* cpu, const CpuInsn* in) {
+    cpu_set_flags(cpu, cpu_get_flags(cpu) | 4);   // Bit 2 is IF
+    cpu->ip += in->len;
+}
 
-        // 0xF0-0xFF: Special Instructions
-        case 0xF0: // CPUID
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            switch (cpu->registers[0]) {  // EAX has function number
-                case 0:  // Maximum supported function
-                    cpu->registers[0] = 1;  // Only basic functions
-                    cpu->registers[1] = 0x756E694C;  // "Linu"
-                    cpu->registers[2] = 0x20782D78;  // "x-x "
-                    cpu->registers[3] = 0x20202020;  // "    "
-                    break;
-                case 1:  // Feature bits
-                    cpu->registers[0] = 0x000000F1;  // Some CPU features
-                    cpu->registers[1] = 0;           // No additional features
-                    cpu->registers[2] = 0x00000001;  // SSE3 only
-                    cpu->registers[3] = 0x00000001;  // FPU present
-                    break;
-            }
-            cpu->ip += 2;
-            break;
+static void op_hlt(CPU* cpu, const CpuInsn* in) {
+    printf("CPU HALT\n");
+    cpu->halted = 1;
+    cpu->ip += in->len;
+}
 
-        case 0xF1: // RDTSC - Read Time Stamp Counter
-            {
-                static uint64_t tsc = 0;
-                tsc++;
-                cpu->registers[0] = (uint32_t)tsc;          // Low 32 bits in EAX
-                cpu->registers[1] = (uint32_t)(tsc >> 32);  // High 32 bits in EDX
-            }
-            cpu->ip++;
-            break;
+// 0xC0-0xCF: Extended Arithmetic
+static void op_imul(CPU* cpu, const CpuInsn* in) {
+    int64_t result = (int64_t)(int32_t)cpu->registers[in->reg1] *
+                    (int64_t)(int32_t)cpu->registers[in->reg2];
+    cpu->registers[in->reg1] = (uint32_t)result;
+    cpu->registers[1] = (uint32_t)(result >> 32);  // High part in rdx
+    cpu->ip += in->len;
+}
 
-        case 0xF2: // PAUSE - Spin-loop hint
-            // In a real CPU this would delay execution slightly
-            cpu->ip++;
-            break;
+static void op_idiv(CPU* cpu, const CpuInsn* in) {
+    if (cpu->registers[in->reg1] != 0) {
+        int64_t dividend = ((int64_t)cpu->registers[1] << 32) | cpu->registers[0];
+        int32_t divisor = (int32_t)cpu->registers[in->reg1];
+        cpu->registers[0] = dividend / divisor;  // quotient
+        cpu->registers[1] = dividend % divisor;  // remainder
+    }
+    cpu->ip += in->len;
+}
 
-        case 0xFF: // UD2 - Undefined instruction (guaranteed invalid)
-            printf("Invalid instruction (UD2) at IP: 0x%08X\n", cpu->ip);
-            cpu->ip++;
-            break;
+// 0xD0-0xDF: Extended Bit Operations
+static void op_bsf(CPU* cpu, const CpuInsn* in) {
+    uint32_t value = cpu->registers[in->reg2];
+    if (value == 0) {
+        cpu_set_flags(cpu, cpu_get_flags(cpu) | 1);   // ZF = 1
+    } else {
+        cpu_set_flags(cpu, cpu_get_flags(cpu) & ~1);  // ZF = 0
+        cpu->registers[in->reg1] = __builtin_ctz(value);
+    }
+    cpu->ip += in->len;
+}
 
-                case 0x09: // OR r/m32, r32
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] |= cpu->registers[reg2];
-                cpu->flags = (cpu->registers[reg1] == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_bsr(CPU* cpu, const CpuInsn* in) {
+    uint32_t value = cpu->registers[in->reg2];
+    if (value == 0) {
+        cpu_set_flags(cpu, cpu_get_flags(cpu) | 1);   // ZF = 1
+    } else {
+        cpu_set_flags(cpu, cpu_get_flags(cpu) & ~1);  // ZF = 0
+        cpu->registers[in->reg1] = 31 - __builtin_clz(value);
+    }
+    cpu->ip += in->len;
+}
 
-        case 0x0F: // Two-byte opcode prefix
-            opcode = cpu_read_byte(cpu, cpu->ip + 1);
-            switch(opcode) {
-                case 0x84: // JNLE rel32 (Jump if not less or equal)
-                    addr = cpu_read_dword(cpu, cpu->ip + 2);
-                    if (!(cpu->flags & 1) && !(cpu->flags & 0x80)) { // !ZF && !SF
-                        cpu->ip = addr;
-                    } else {
-                        cpu->ip += 6;
-                    }
-                    break;
-                    
-                default:
-                    printf("Unknown two-byte opcode: 0x0F 0x%02X at IP: 0x%08X\n", opcode, cpu->ip);
-                    cpu->ip += 2;
-            }
-            break;
+static void op_popcnt(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = __builtin_popcount(cpu->registers[in->reg2]);
+    cpu->ip += in->len;
+}
 
-        case 0x49: // DEC ecx (Register 1)
-            cpu->registers[1]--;
-            cpu->flags = (cpu->registers[1] == 0) ? 1 : 0;
-            cpu->ip++;
-            break;
+// 0xE0-0xEF: Extended Flow Control
+static void op_syscall(CPU* cpu, const CpuInsn* in) {
+    // Save return address
+    cpu->registers[7] -= 4;
+    cpu_write_dword(cpu, cpu->registers[7], cpu->ip + in->len);
+    // Save flags
+    cpu->registers[7] -= 4;
+    cpu_write_dword(cpu, cpu->registers[7], cpu_get_flags(cpu));
+    // Jump to system call handler (fixed address for simplicity)
+    cpu->ip = 0x1000;  // System call table address
+}
 
-        case 0x6F: // OUTSD - Output doubleword to port
-            {
-                // Handle port output here
-                cpu->registers[4] += 4;  // Increment esi
-            }
-            cpu->ip++;
-            break;
+static void op_sysret(CPU* cpu, const CpuInsn* in) {
+    (void)in;
+    // Restore flags
+    cpu_set_flags(cpu, cpu_read_dword(cpu, cpu->registers[7]));
+    cpu->registers[7] += 4;
+    // Restore return address
+    cpu->ip = cpu_read_dword(cpu, cpu->registers[7]);
+    cpu->registers[7] += 4;
+}
 
-        case 0x75: // JNE/JNZ rel8 (Jump if not equal/zero)
-            offset = (int8_t)cpu_read_byte(cpu, cpu->ip + 1);
-            if (!(cpu->flags & 1)) { // If zero flag is not set
-                cpu->ip += offset + 2;
-            } else {
-                cpu->ip += 2;
-            }
+// 0xF0-0xFF: Special Instructions
+static void op_cpuid(CPU* cpu, const CpuInsn* in) {
+    switch (cpu->registers[0]) {  // EAX has function number
+        case 0:  // Maximum supported function
+            cpu->registers[0] = 1;  // Only basic functions
+            cpu->registers[1] = 0x756E694C;  // "Linu"
+            cpu->registers[2] = 0x20782D78;  // "x-x "
+            cpu->registers[3] = 0x20202020;  // "    "
+            break;
+        case 1:  // Feature bits
+            cpu->registers[0] = 0x000000F1;  // Some CPU features
+            cpu->registers[1] = 0;           // No additional features
+            cpu->registers[2] = 0x00000001;  // SSE3 only
+            cpu->registers[3] = 0x00000001;  // FPU present
             break;
+    }
+    cpu->ip += in->len;
+}
 
-        case 0x84: // TEST r/m8, r8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                uint32_t result = cpu->registers[reg1] & cpu->registers[reg2];
-                cpu->flags = (result == 0) ? 1 : 0;
-            }
-            cpu->ip += 3;
-            break;
+static void op_rdtsc(CPU* cpu, const CpuInsn* in) {
+    cpu->tsc++;
+    cpu->registers[0] = (uint32_t)cpu->tsc;          // Low 32 bits in EAX
+    cpu->registers[1] = (uint32_t)(cpu->tsc >> 32);  // High 32 bits in EDX
+    cpu->ip += in->len;
+}
 
-        case 0xC9: // LEAVE - Restore stack for procedure exit
-            cpu->registers[7] = cpu->registers[5];  // mov esp, ebp
-            cpu->registers[5] = cpu_read_dword(cpu, cpu->registers[7]);  // pop ebp
-            cpu->registers[7] += 4;
-            cpu->ip++;
-            break;
+static void op_ud2(CPU* cpu, const CpuInsn* in) {
+    printf("Invalid instruction (UD2) at IP: 0x%08X\n", cpu->ip);
+    cpu->ip += in->len;
+}
 
-        case 0xEB: // JMP rel8 (Short jump)
-            offset = (int8_t)cpu_read_byte(cpu, cpu->ip + 1);
-            cpu->ip += offset + 2;
-            break;
+// Legacy x86 encodings used by boot sectors
+static void op_jnle(CPU* cpu, const CpuInsn* in) {
+    uint32_t flags = cpu_get_flags(cpu);
+    if (!(flags & 1) && !(flags & 0x80)) { // !ZF && !SF
+        cpu->ip = in->imm;
+    } else {
+        cpu->ip += in->len;
+    }
+}
 
-        case 0xF6: // TEST/NOT/NEG/MUL/IMUL/DIV/IDIV r/m8
-            modrm = cpu_read_byte(cpu, cpu->ip + 1);
-            reg1 = modrm & 0x07;  // rm field
-            switch((modrm >> 3) & 0x07) {  // reg field determines operation
-                case 0: // TEST r/m8, imm8
-                    value = cpu_read_byte(cpu, cpu->ip + 2);
-                    if (reg1 < 8) {
-                        uint32_t result = (cpu->registers[reg1] & 0xFF) & value;
-                        cpu->flags = (result == 0) ? 1 : 0;
-                    }
-                    cpu->ip += 3;
-                    break;
-                    
-                case 2: // NOT r/m8
-                    if (reg1 < 8) {
-                        cpu->registers[reg1] = (~cpu->registers[reg1] & 0xFF) | 
-                                             (cpu->registers[reg1] & 0xFFFFFF00);
-                    }
-                    cpu->ip += 2;
-                    break;
-                    
-                case 3: // NEG r/m8
-                    if (reg1 < 8) {
-                        uint8_t val = cpu->registers[reg1] & 0xFF;
-                        uint8_t result = -val;
-                        cpu->registers[reg1] = (cpu->registers[reg1] & 0xFFFFFF00) | result;
-                        cpu->flags = (result == 0) ? 1 : 0;
-                        if (val != 0) cpu->flags |= 2;  // Set CF if value wasn't 0
-                    }
-                    cpu->ip += 2;
-                    break;
-                    
-                default:
-                    printf("Unknown F6 group operation: %d at IP: 0x%08X\n", 
-                           (modrm >> 3) & 0x07, cpu->ip);
-                    cpu->ip += 2;
-            }
-            break;
+static void op_unknown_0f(CPU* cpu, const CpuInsn* in) {
+    if (cpu->prof) prof_unknown(cpu->prof, 0x0F00 | in->opcode);
+    printf("Unknown two-byte opcode: 0x0F 0x%02X at IP: 0x%08X\n", in->opcode, cpu->ip);
+    cpu->ip += in->len;
+}
 
-        case 0xFA: // CLI - Clear Interrupt Flag
-            cpu->flags &= ~0x200;  // Clear IF (bit 9)
-            cpu->ip++;
-            break;
+static void op_dec_ecx(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[1]--;
+    cpu_flags_result(cpu, cpu->registers[1]);
+    cpu->ip += in->len;
+}
 
-        case 0xC2: // RET imm16 - Return and pop imm16 bytes
-            {
-                uint16_t pop_bytes = cpu_read_byte(cpu, cpu->ip + 1) | 
-                                   (cpu_read_byte(cpu, cpu->ip + 2) << 8);
-                addr = cpu_read_dword(cpu, cpu->registers[7]);  // Pop return address
-                cpu->registers[7] += 4;                         // Adjust for return address
-                cpu->registers[7] += pop_bytes;                 // Adjust stack by parameter
-                cpu->ip = addr;
-            }
-            break;
+static void op_outsd(CPU* cpu, const CpuInsn* in) {
+    // Handle port output here
+    cpu->registers[4] += 4;  // Increment esi
+    cpu->ip += in->len;
+}
 
-        case 0x08: // OR r/m8, r8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                cpu->registers[reg1] = (cpu->registers[reg1] & 0xFFFFFF00) |
-                    ((cpu->registers[reg1] | cpu->registers[reg2]) & 0xFF);
-            }
-            cpu->ip += 3;
-            break;
+static void op_test(CPU* cpu, const CpuInsn* in) {
+    uint32_t result = cpu->registers[in->reg1] & cpu->registers[in->reg2];
+    cpu_flags_result(cpu, result);
+    cpu->ip += in->len;
+}
 
-        case 0x0E: // PUSH CS
-            cpu->registers[7] -= 2;  // 16-bit push in real mode
-            cpu_write_word(cpu, cpu->registers[7], cpu->cs);
-            cpu->ip++;
-            break;
+static void op_leave(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] = cpu->registers[5];  // mov esp, ebp
+    cpu->registers[5] = cpu_read_dword(cpu, cpu->registers[7]);  // pop ebp
+    cpu->registers[7] += 4;
+    cpu->ip += in->len;
+}
 
-        case 0x2C: // SUB AL, imm8
-            value = cpu_read_byte(cpu, cpu->ip + 1);
-            cpu->registers[0] = (cpu->registers[0] & 0xFFFFFF00) |
-                ((cpu->registers[0] - value) & 0xFF);
-            cpu->ip += 2;
-            break;
+static void op_test8_imm(CPU* cpu, const CpuInsn* in) {
+    uint32_t result = (cpu->registers[in->reg1] & 0xFF) & in->imm;
+    cpu_flags_result(cpu, result);
+    cpu->ip += in->len;
+}
 
-        case 0x64: // FS segment prefix
-            // Handle FS segment override
-            cpu->ip++;
-            break;
+static void op_not8(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = (~cpu->registers[in->reg1] & 0xFF) |
+                               (cpu->registers[in->reg1] & 0xFFFFFF00);
+    cpu->ip += in->len;
+}
+
+static void op_neg8(CPU* cpu, const CpuInsn* in) {
+    uint8_t val = cpu->registers[in->reg1] & 0xFF;
+    uint8_t result = -val;
+    cpu->registers[in->reg1] = (cpu->registers[in->reg1] & 0xFFFFFF00) | result;
+    cpu_flags_compare(cpu, 0, val);  // ZF if val was 0, CF otherwise
+    cpu->ip += in->len;
+}
+
+static void op_unknown_f6(CPU* cpu, const CpuInsn* in) {
+    if (cpu->prof) prof_unknown(cpu->prof, 0xF600 | in->reg2);
+    printf("Unknown F6 group operation: %d at IP: 0x%08X\n", in->reg2, cpu->ip);
+    cpu->ip += in->len;
+}
+
+static void op_cli_if(CPU* cpu, const CpuInsn* in) {
+    cpu_set_flags(cpu, cpu_get_flags(cpu) & ~0x200);  // Clear IF (bit 9)
+    cpu->ip += in->len;
+}
+
+static void op_ret_imm(CPU* cpu, const CpuInsn* in) {
+    uint32_t addr = cpu_read_dword(cpu, cpu->registers[7]);  // Pop return address
+    cpu->registers[7] += 4;                                  // Adjust for return address
+    cpu->registers[7] += in->imm;                            // Adjust stack by parameter
+    cpu->ip = addr;
+}
+
+static void op_or8(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = (cpu->registers[in->reg1] & 0xFFFFFF00) |
+        ((cpu->registers[in->reg1] | cpu->registers[in->reg2]) & 0xFF);
+    cpu->ip += in->len;
+}
+
+static void op_push_cs(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] -= 2;  // 16-bit push in real mode
+    cpu_write_word(cpu, cpu->registers[7], cpu->cs);
+    cpu->ip += in->len;
+}
+
+static void op_sub_al_imm(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[0] = (cpu->registers[0] & 0xFFFFFF00) |
+        ((cpu->registers[0] - in->imm) & 0xFF);
+    cpu->ip += in->len;
+}
+
+static void op_jb_rel(CPU* cpu, const CpuInsn* in) {
+    if (cpu_get_flags(cpu) & 1) { // If carry flag is set
+        cpu->ip = in->imm;
+    } else {
+        cpu->ip += in->len;
+    }
+}
+
+static void op_jl_rel(CPU* cpu, const CpuInsn* in) {
+    if ((cpu_get_flags(cpu) & 0x80) != 0) { // If sign flag is set
+        cpu->ip = in->imm;
+    } else {
+        cpu->ip += in->len;
+    }
+}
+
+static void op_mov_sreg(CPU* cpu, const CpuInsn* in) {
+    uint16_t value = cpu->registers[in->reg1] & 0xFFFF;
+    switch (in->reg2) {
+        case 0: cpu->es = value; break;
+        case 1: cpu->cs = value; break;
+        case 2: cpu->ss = value; break;
+        case 3: cpu->ds = value; break;
+        case 4: cpu->fs = value; break;
+        case 5: cpu->gs = value; break;
+    }
+    cpu->ip += in->len;
+}
+
+static void op_mov_ah_imm(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[0] = (cpu->registers[0] & 0xFFFF00FF) | (in->imm << 8);
+    cpu->ip += in->len;
+}
+
+static void op_mov_bh_imm(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[3] = (cpu->registers[3] & 0xFFFF00FF) | (in->imm << 8);
+    cpu->ip += in->len;
+}
+
+static void op_mov_sp_imm(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] = (cpu->registers[7] & 0xFFFF0000) | in->imm;
+    cpu->ip += in->len;
+}
+
+static void op_mov_si_imm(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[4] = (cpu->registers[4] & 0xFFFF0000) | in->imm;
+    cpu->ip += in->len;
+}
+
+static void op_int(CPU* cpu, const CpuInsn* in) {
+    cpu->ip += in->len;
+    cpu_interrupt(cpu, (uint8_t)in->imm);
+}
+
+static void op_iret(CPU* cpu, const CpuInsn* in) {
+    (void)in;
+    cpu->ip = cpu_read_dword(cpu, cpu->registers[7]);
+    cpu->cs = (uint16_t)cpu_read_dword(cpu, cpu->registers[7] + 4);
+    cpu_set_flags(cpu, cpu_read_dword(cpu, cpu->registers[7] + 8));
+    cpu->registers[7] += 12;
+}
+
+static void op_call_rel(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] -= 2;
+    cpu_write_word(cpu, cpu->registers[7], cpu->ip + in->len);
+    cpu->ip = in->imm;
+}
+
+static void op_or_al(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[0] = (cpu->registers[0] & 0xFFFFFF00) |
+        ((cpu->registers[0] | cpu->registers[in->reg1]) & 0xFF);
+    cpu->ip += in->len;
+}
+
+static void op_adc_al_imm(CPU* cpu, const CpuInsn* in) {
+    uint32_t carry = (cpu_get_flags(cpu) & 2) ? 1 : 0;
+    uint32_t result = (cpu->registers[0] & 0xFF) + in->imm + carry;
+    cpu->registers[0] = (cpu->registers[0] & 0xFFFFFF00) | (result & 0xFF);
+    cpu_set_flags(cpu, ((result & 0xFF) ? 0 : 1) |  // ZF
+                       ((result > 0xFF) ? 2 : 0));  // CF
+    cpu->ip += in->len;
+}
+
+static void op_push_ss(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[7] -= 2;
+    cpu_write_word(cpu, cpu->registers[7], cpu->ss);
+    cpu->ip += in->len;
+}
+
+static void op_sbb(CPU* cpu, const CpuInsn* in) {
+    uint32_t carry = (cpu_get_flags(cpu) & 2) ? 1 : 0;
+    uint32_t result = cpu->registers[in->reg1] - cpu->registers[in->reg2] - carry;
+    cpu->registers[in->reg1] = result;
+    cpu_flags_result(cpu, result);  // ZF
+    cpu->ip += in->len;
+}
+
+static void op_dec_bx(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[3] = (cpu->registers[3] & 0xFFFF0000) |
+        ((cpu->registers[3] - 1) & 0xFFFF);
+    cpu_flags_result(cpu, cpu->registers[3] & 0xFFFF);
+    cpu->ip += in->len;
+}
+
+static void op_dec_bp(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[5] = (cpu->registers[5] & 0xFFFF0000) |
+        ((cpu->registers[5] - 1) & 0xFFFF);
+    cpu_flags_result(cpu, cpu->registers[5] & 0xFFFF);
+    cpu->ip += in->len;
+}
+
+static void op_pop_ax(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[0] = (cpu->registers[0] & 0xFFFF0000) |
+        cpu_read_word(cpu, cpu->registers[7]);
+    cpu->registers[7] += 2;
+    cpu->ip += in->len;
+}
+
+static void op_unknown(CPU* cpu, const CpuInsn* in) {
+    if (cpu->prof) prof_unknown(cpu->prof, in->opcode);
+    printf("Unknown opcode: 0x%02X at IP: 0x%08X\n", in->opcode, cpu->ip);
+    cpu->ip += in->len;
+}
+
+// Superinstructions built by cpu_fuse(); each leaves exactly the state the
+// two instructions would, and len covers both
+static void op_cmp_jz(CPU* cpu, const CpuInsn* in) {
+    uint32_t a = cpu->registers[in->reg1];
+    uint32_t b = cpu->registers[in->reg2];
+    cpu_flags_compare(cpu, a, b);
+    if (a == b) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
+
+static void op_cmp_jnz(CPU* cpu, const CpuInsn* in) {
+    uint32_t a = cpu->registers[in->reg1];
+    uint32_t b = cpu->registers[in->reg2];
+    cpu_flags_compare(cpu, a, b);
+    if (a != b) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
+
+static void op_cmp_ja(CPU* cpu, const CpuInsn* in) {
+    uint32_t a = cpu->registers[in->reg1];
+    uint32_t b = cpu->registers[in->reg2];
+    cpu_flags_compare(cpu, a, b);
+    if (a > b) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
+
+static void op_cmp_jb(CPU* cpu, const CpuInsn* in) {
+    uint32_t a = cpu->registers[in->reg1];
+    uint32_t b = cpu->registers[in->reg2];
+    cpu_flags_compare(cpu, a, b);
+    if (a < b) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
+
+static void op_dec_jz(CPU* cpu, const CpuInsn* in) {
+    uint32_t result = --cpu->registers[in->reg1];
+    cpu_flags_result(cpu, result);
+    if (result == 0) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
+
+static void op_dec_jnz(CPU* cpu, const CpuInsn* in) {
+    uint32_t result = --cpu->registers[in->reg1];
+    cpu_flags_result(cpu, result);
+    if (result != 0) cpu->ip = in->imm;
+    else cpu->ip += in->len;
+}
+
+// MOV reg1, imm followed by ADD reg2, reg1
+static void op_mov_add(CPU* cpu, const CpuInsn* in) {
+    cpu->registers[in->reg1] = in->imm;
+    cpu->registers[in->reg2] += cpu->registers[in->reg1];
+    cpu_flags_result(cpu, cpu->registers[in->reg2]);
+    cpu->ip += in->len;
+}
+
+// Operand layouts shared by many opcodes
+static void decode_r(CPU* cpu, CpuInsn* in, CpuOpFn fn, uint8_t len) {
+    in->reg1 = cpu_read_byte(cpu, in->addr + 1);
+    in->fn = in->reg1 < 8 ? fn : op_skip;
+    in->len = len;
+}
+
+static void decode_rr(CPU* cpu, CpuInsn* in, CpuOpFn fn) {
+    in->reg1 = cpu_read_byte(cpu, in->addr + 1);
+    in->reg2 = cpu_read_byte(cpu, in->addr + 2);
+    in->fn = (in->reg1 < 8 && in->reg2 < 8) ? fn : op_skip;
+    in->len = 3;
+}
+
+static void decode_r_imm32(CPU* cpu, CpuInsn* in, CpuOpFn fn) {
+    decode_r(cpu, in, fn, 6);
+    in->imm = cpu_read_dword(cpu, in->addr + 2);
+}
+
+static void decode_r_imm8(CPU* cpu, CpuInsn* in, CpuOpFn fn) {
+    decode_r(cpu, in, fn, 3);
+    in->imm = cpu_read_byte(cpu, in->addr + 2);
+}
+
+static void decode_imm32(CPU* cpu, CpuInsn* in, CpuOpFn fn) {
+    in->fn = fn;
+    in->imm = cpu_read_dword(cpu, in->addr + 1);
+    in->len = 5;
+}
+
+static void decode_imm8(CPU* cpu, CpuInsn* in, CpuOpFn fn) {
+    in->fn = fn;
+    in->imm = cpu_read_byte(cpu, in->addr + 1);
+    in->len = 2;
+}
+
+static void decode_imm16(CPU* cpu, CpuInsn* in, CpuOpFn fn) {
+    in->fn = fn;
+    in->imm = cpu_read_word(cpu, in->addr + 1);
+    in->len = 3;
+}
+
+// Relative branches are resolved to an absolute target at decode time
+static void decode_rel8(CPU* cpu, CpuInsn* in, CpuOpFn fn) {
+    int8_t offset = (int8_t)cpu_read_byte(cpu, in->addr + 1);
+    in->fn = fn;
+    in->len = 2;
+    in->imm = in->addr + in->len + offset;
+}
+
+static void decode_none(CpuInsn* in, CpuOpFn fn) {
+    in->fn = fn;
+    in->len = 1;
+}
+
+void cpu_decode(CPU* cpu, uint32_t address, CpuInsn* in) {
+    uint8_t opcode = cpu_read_byte(cpu, address);
+    uint8_t modrm;
+
+    memset(in, 0, sizeof(*in));
+    in->addr = address;
+    in->opcode = opcode;
+    in->count = 1;
 
-        case 0x65: // GS segment prefix
-            // Handle GS segment override
-            cpu->ip++;
+    switch(opcode) {
+        case 0x00: decode_none(in, op_skip); break;                 // NOP
+        case 0x01: decode_r_imm32(cpu, in, op_mov_reg_imm); break;  // MOV reg, imm32
+        case 0x02: decode_r_imm32(cpu, in, op_mov_mem_reg); break;  // MOV [addr], reg
+        case 0x03: decode_rr(cpu, in, op_mov_reg_reg); break;       // MOV reg1, reg2
+        case 0x04: decode_r_imm32(cpu, in, op_mov_reg_mem); break;  // MOV reg, [addr]
+        case 0x05: decode_rr(cpu, in, op_xchg); break;              // XCHG reg1, reg2
+        case 0x06: decode_r(cpu, in, op_push, 2); break;            // PUSH reg
+        case 0x07: decode_r(cpu, in, op_pop, 2); break;             // POP reg
+
+        case 0x10: decode_r_imm32(cpu, in, op_movzx); break;  // MOVZX reg1, byte[addr]
+        case 0x11: decode_r_imm32(cpu, in, op_movsx); break;  // MOVSX reg1, byte[addr]
+
+        case 0x20: decode_rr(cpu, in, op_add_reg_reg); break;       // ADD reg1, reg2
+        case 0x21: decode_r_imm32(cpu, in, op_add_reg_imm); break;  // ADD reg, imm32
+        case 0x22: decode_rr(cpu, in, op_sub_reg_reg); break;       // SUB reg1, reg2
+        case 0x23: decode_r(cpu, in, op_mul, 2); break;             // MUL reg
+        case 0x24: decode_r(cpu, in, op_div, 2); break;             // DIV reg
+
+        case 0x30: decode_r(cpu, in, op_inc, 2); break;  // INC reg
+        case 0x31: decode_r(cpu, in, op_dec, 2); break;  // DEC reg
+        case 0x32: decode_r(cpu, in, op_neg, 2); break;  // NEG reg
+
+        case 0x40: decode_rr(cpu, in, op_and); break;        // AND reg1, reg2
+        case 0x41: decode_rr(cpu, in, op_or); break;         // OR reg1, reg2
+        case 0x42: decode_rr(cpu, in, op_xor); break;        // XOR reg1, reg2
+        case 0x43: decode_r(cpu, in, op_not, 2); break;      // NOT reg
+        case 0x44: decode_r_imm8(cpu, in, op_shl); break;    // SHL reg, imm8
+        case 0x45: decode_r_imm8(cpu, in, op_shr); break;    // SHR reg, imm8
+        case 0x46: // ROL reg, imm8
+            decode_r_imm8(cpu, in, op_rol);
+            in->imm &= 0x1F;
+            break;
+        case 0x47: // ROR reg, imm8
+            decode_r_imm8(cpu, in, op_ror);
+            in->imm &= 0x1F;
             break;
 
-        case 0x6C: // INSB
-            // Input byte from port DX into ES:DI
-            cpu->ip++;
+        case 0x50: decode_rr(cpu, in, op_cmp); break;      // CMP reg1, reg2
+        case 0x51: decode_imm32(cpu, in, op_jmp); break;   // JMP imm32
+        case 0x52: decode_imm32(cpu, in, op_jz); break;    // JZ imm32
+        case 0x53: decode_imm32(cpu, in, op_jnz); break;   // JNZ imm32
+        case 0x54: decode_imm32(cpu, in, op_ja); break;    // JA imm32 (above - unsigned)
+        case 0x55: decode_imm32(cpu, in, op_jb); break;    // JB imm32 (below - unsigned)
+
+        case 0x60: decode_imm32(cpu, in, op_call); break;  // CALL imm32
+        case 0x61: decode_none(in, op_ret); break;         // RET
+        case 0x62: decode_none(in, op_pushf); break;       // PUSHF
+        case 0x63: decode_none(in, op_popf); break;        // POPF
+
+        case 0x70: decode_imm32(cpu, in, op_loop); break;  // LOOP imm32
+
+        case 0x80: decode_r_imm32(cpu, in, op_lea); break;  // LEA reg, [addr]
+        case 0x81: decode_none(in, op_cmpsb); break;        // CMPSB
+        case 0x82: decode_none(in, op_movsb); break;        // MOVSB
+
+        case 0x90: // REP prefix
+            in->fn = op_rep;
+            in->opcode = cpu_read_byte(cpu, address + 1);
+            in->len = 2;
             break;
 
-        case 0x72: // JB/JNAE/JC rel8 (Jump if below/not above or equal/carry)
-            offset = (int8_t)cpu_read_byte(cpu, cpu->ip + 1);
-            if (cpu->flags & 1) { // If carry flag is set
-                cpu->ip += offset + 2;
-            } else {
-                cpu->ip += 2;
-            }
+        case 0xA0: decode_r_imm8(cpu, in, op_in); break;  // IN reg, port
+        case 0xA1: // OUT port, reg
+            // Simulate I/O - in real VM would interface with devices
+            in->fn = op_skip;
+            in->len = 3;
             break;
 
-        case 0x7C: // JL/JNGE rel8 (Jump if less/not greater or equal)
-            offset = (int8_t)cpu_read_byte(cpu, cpu->ip + 1);
-            if ((cpu->flags & 0x80) != 0) { // If sign flag is set
-                cpu->ip += offset + 2;
-            } else {
-                cpu->ip += 2;
-            }
+        case 0xB0: decode_none(in, op_cli); break;  // CLI - Clear Interrupt Flag
+        case 0xB1: decode_none(in, op_sti); break;  // STI - Set Interrupt Flag
+        case 0xB2: decode_none(in, op_hlt); break;  // HLT
+
+        case 0xC0: decode_rr(cpu, in, op_imul); break;     // IMUL reg1, reg2
+        case 0xC1: decode_r(cpu, in, op_idiv, 2); break;   // IDIV reg
+
+        case 0xD0: decode_rr(cpu, in, op_bsf); break;     // BSF reg1, reg2 (Bit Scan Forward)
+        case 0xD1: decode_rr(cpu, in, op_bsr); break;     // BSR reg1, reg2 (Bit Scan Reverse)
+        case 0xD2: decode_rr(cpu, in, op_popcnt); break;  // POPCNT reg1, reg2 (Population Count)
+
+        case 0xE0: decode_none(in, op_syscall); break;  // SYSCALL
+        case 0xE1: decode_none(in, op_sysret); break;   // SYSRET
+
+        case 0xF0: // CPUID
+            in->fn = op_cpuid;
+            in->len = 2;
             break;
+        case 0xF1: decode_none(in, op_rdtsc); break;  // RDTSC - Read Time Stamp Counter
+        case 0xF2: decode_none(in, op_skip); break;   // PAUSE - Spin-loop hint
+        case 0xFF: decode_none(in, op_ud2); break;    // UD2 - Undefined instruction
 
-        case 0x8E: // MOV Sreg, r/m16
-            modrm = cpu_read_byte(cpu, cpu->ip + 1);
-            reg1 = modrm & 0x07;
-            switch((modrm >> 3) & 0x07) {
-                case 0: cpu->es = cpu->registers[reg1] & 0xFFFF; break;
-                case 1: cpu->cs = cpu->registers[reg1] & 0xFFFF; break;
-                case 2: cpu->ss = cpu->registers[reg1] & 0xFFFF; break;
-                case 3: cpu->ds = cpu->registers[reg1] & 0xFFFF; break;
-                case 4: cpu->fs = cpu->registers[reg1] & 0xFFFF; break;
-                case 5: cpu->gs = cpu->registers[reg1] & 0xFFFF; break;
+        case 0x09: decode_rr(cpu, in, op_or); break;  // OR r/m32, r32
+
+        case 0x0F: // Two-byte opcode prefix
+            in->opcode = cpu_read_byte(cpu, address + 1);
+            switch (in->opcode) {
+                case 0x84: // JNLE rel32 (Jump if not less or equal)
+                    in->fn = op_jnle;
+                    in->imm = cpu_read_dword(cpu, address + 2);
+                    in->len = 6;
+                    break;
+                default:
+                    in->fn = op_unknown_0f;
+                    in->len = 2;
             }
-            cpu->ip += 2;
             break;
 
-        case 0xB4: // MOV AH, imm8
-            value = cpu_read_byte(cpu, cpu->ip + 1);
-            cpu->registers[0] = (cpu->registers[0] & 0xFFFF00FF) | (value << 8);
-            cpu->ip += 2;
-            break;
+        case 0x49: decode_none(in, op_dec_ecx); break;      // DEC ecx (Register 1)
+        case 0x6F: decode_none(in, op_outsd); break;        // OUTSD - Output doubleword to port
+        case 0x75: decode_rel8(cpu, in, op_jnz); break;     // JNE/JNZ rel8
+        case 0x84: decode_rr(cpu, in, op_test); break;      // TEST r/m8, r8
+        case 0xC9: decode_none(in, op_leave); break;        // LEAVE
+        case 0xEB: decode_rel8(cpu, in, op_jmp); break;     // JMP rel8 (Short jump)
 
-        case 0xB7: // MOV BH, imm8
-            value = cpu_read_byte(cpu, cpu->ip + 1);
-            cpu->registers[3] = (cpu->registers[3] & 0xFFFF00FF) | (value << 8);
-            cpu->ip += 2;
+        case 0xF6: // TEST/NOT/NEG/MUL/IMUL/DIV/IDIV r/m8
+            modrm = cpu_read_byte(cpu, address + 1);
+            in->reg1 = modrm & 0x07;         // rm field
+            in->reg2 = (modrm >> 3) & 0x07;  // reg field determines operation
+            in->len = 2;
+            switch (in->reg2) {
+                case 0: // TEST r/m8, imm8
+                    in->fn = op_test8_imm;
+                    in->imm = cpu_read_byte(cpu, address + 2);
+                    in->len = 3;
+                    break;
+                case 2: in->fn = op_not8; break;  // NOT r/m8
+                case 3: in->fn = op_neg8; break;  // NEG r/m8
+                default: in->fn = op_unknown_f6;
+            }
             break;
 
-        case 0xBC: // MOV SP, imm16
-            value = cpu_read_byte(cpu, cpu->ip + 1) |
-                   (cpu_read_byte(cpu, cpu->ip + 2) << 8);
-            cpu->registers[7] = (cpu->registers[7] & 0xFFFF0000) | value;
-            cpu->ip += 3;
-            break;
+        case 0xFA: decode_none(in, op_cli_if); break;        // CLI - Clear Interrupt Flag
+        case 0xC2: decode_imm16(cpu, in, op_ret_imm); break; // RET imm16
+        case 0x08: decode_rr(cpu, in, op_or8); break;        // OR r/m8, r8
+        case 0x0E: decode_none(in, op_push_cs); break;       // PUSH CS
+        case 0x2C: decode_imm8(cpu, in, op_sub_al_imm); break;  // SUB AL, imm8
+        case 0x64: decode_none(in, op_skip); break;          // FS segment prefix
+        case 0x65: decode_none(in, op_skip); break;          // GS segment prefix
+        case 0x6C: decode_none(in, op_skip); break;          // INSB
+        case 0x72: decode_rel8(cpu, in, op_jb_rel); break;   // JB/JNAE/JC rel8
+        case 0x7C: decode_rel8(cpu, in, op_jl_rel); break;   // JL/JNGE rel8
 
-        case 0xBE: // MOV SI, imm16
-            value = cpu_read_byte(cpu, cpu->ip + 1) |
-                   (cpu_read_byte(cpu, cpu->ip + 2) << 8);
-            cpu->registers[4] = (cpu->registers[4] & 0xFFFF0000) | value;
-            cpu->ip += 3;
+        case 0x8E: // MOV Sreg, r/m16
+            modrm = cpu_read_byte(cpu, address + 1);
+            in->fn = op_mov_sreg;
+            in->reg1 = modrm & 0x07;
+            in->reg2 = (modrm >> 3) & 0x07;
+            in->len = 2;
             break;
 
-        case 0xCD: // INT imm8 - Software interrupt
-            value = cpu_read_byte(cpu, cpu->ip + 1);
-            // Handle interrupt (for bootloader, mainly INT 10h for video)
-            if (value == 0x10) {
-                // Handle video interrupt
-                if ((cpu->registers[0] >> 8) == 0x0E) {
-                    // Teletype output
-                    printf("%c", cpu->registers[0] & 0xFF);
-                }
-            }
-            cpu->ip += 2;
-            break;
+        case 0xB4: decode_imm8(cpu, in, op_mov_ah_imm); break;   // MOV AH, imm8
+        case 0xB7: decode_imm8(cpu, in, op_mov_bh_imm); break;   // MOV BH, imm8
+        case 0xBC: decode_imm16(cpu, in, op_mov_sp_imm); break;  // MOV SP, imm16
+        case 0xBE: decode_imm16(cpu, in, op_mov_si_imm); break;  // MOV SI, imm16
+        case 0xCD: decode_imm8(cpu, in, op_int); break;          // INT imm8
+        case 0xCF: decode_none(in, op_iret); break;              // IRET
 
         case 0xD8: // FXXX - Floating point instruction
             // For bootloader, we can ignore FPU instructions
-            cpu->ip += 2;
+            in->fn = op_skip;
+            in->len = 2;
             break;
 
         case 0xE8: // CALL rel16
-            offset = (int16_t)(cpu_read_byte(cpu, cpu->ip + 1) |
-                              (cpu_read_byte(cpu, cpu->ip + 2) << 8));
-            cpu->registers[7] -= 2;
-            cpu_write_word(cpu, cpu->registers[7], cpu->ip + 3);
-            cpu->ip += offset + 3;
+            in->fn = op_call_rel;
+            in->len = 3;
+            in->imm = address + in->len + (int16_t)cpu_read_word(cpu, address + 1);
             break;
 
-// Add these cases to the switch statement:
+        case 0x0A: decode_r(cpu, in, op_or_al, 2); break;      // OR AL, r/m8
+        case 0x14: decode_imm8(cpu, in, op_adc_al_imm); break; // ADC AL, imm8
+        case 0x16: decode_none(in, op_push_ss); break;         // PUSH SS
+        case 0x18: decode_rr(cpu, in, op_sbb); break;          // SBB r/m8, r8
+        case 0x4B: decode_none(in, op_dec_bx); break;          // DEC BX
+        case 0x4D: decode_none(in, op_dec_bp); break;          // DEC BP
+        case 0x58: decode_none(in, op_pop_ax); break;          // POP AX
 
-        case 0x0A: // OR AL, r/m8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            if (reg1 < 8) {
-                cpu->registers[0] = (cpu->registers[0] & 0xFFFFFF00) |
-                    ((cpu->registers[0] | cpu->registers[reg1]) & 0xFF);
-            }
-            cpu->ip += 2;
-            break;
+        default:
+            decode_none(in, op_unknown);
+    }
 
-        case 0x14: // ADC AL, imm8
-            value = cpu_read_byte(cpu, cpu->ip + 1);
-            uint32_t carry = (cpu->flags & 2) ? 1 : 0;
-            uint32_t result = (cpu->registers[0] & 0xFF) + value + carry;
-            cpu->registers[0] = (cpu->registers[0] & 0xFFFFFF00) | (result & 0xFF);
-            cpu->flags = (result & 0xFF) ? 0 : 1;  // Set ZF
-            cpu->flags |= (result > 0xFF) ? 2 : 0;  // Set CF
-            cpu->ip += 2;
+    switch (opcode) {
+        case 0x51: case 0x52: case 0x53: case 0x54: case 0x55:
+        case 0x61: case 0x70: case 0x0F: case 0x75: case 0x72:
+        case 0x7C: case 0xEB: case 0xC2: case 0xE1: case 0xB2: case 0xCF:
+            in->flags = CPU_INSN_BRANCH;
             break;
-
-        case 0x16: // PUSH SS
-            cpu->registers[7] -= 2;
-            cpu_write_word(cpu, cpu->registers[7], cpu->ss);
-            cpu->ip++;
+        case 0x60: case 0xE0: case 0xE8: case 0xCD:
+            in->flags = CPU_INSN_BRANCH | CPU_INSN_STORE;
+            break;
+        case 0x02: case 0x06: case 0x62: case 0x82: case 0x0E: case 0x16:
+            in->flags = CPU_INSN_STORE;
+            break;
+        case 0x90:
+            if (in->opcode == 0x82) in->flags = CPU_INSN_STORE;
             break;
+    }
+
+    // Remember which pages hold decoded code so stores elsewhere stay cheap
+    if (address < cpu->memory_size) {
+        uint32_t last = address + in->len - 1;
+        cpu->page_attr[address >> CPU_PAGE_SHIFT] |= CPU_PAGE_CODE;
+        if (last >= address && last < cpu->memory_size) cpu->page_attr[last >> CPU_PAGE_SHIFT] |= CPU_PAGE_CODE;
+    }
+}
 
-        case 0x18: // SBB r/m8, r8
-            reg1 = cpu_read_byte(cpu, cpu->ip + 1);
-            reg2 = cpu_read_byte(cpu, cpu->ip + 2);
-            if (reg1 < 8 && reg2 < 8) {
-                carry = (cpu->flags & 2) ? 1 : 0;
-                result = cpu->registers[reg1] - cpu->registers[reg2] - carry;
-                cpu->registers[reg1] = result;
-                cpu->flags = (result == 0) ? 1 : 0;  // ZF
-                cpu->flags |= (result < 0) ? 2 : 0;  // CF
+// Opcode pairs with a superinstruction, as they appear in a pair profile
+static const struct {
+    uint8_t first;
+    uint8_t second;
+    uint32_t fusion;
+} cpu_fusion_pairs[] = {
+    {0x50, 0x52, CPU_FUSE_CMP_JCC}, {0x50, 0x53, CPU_FUSE_CMP_JCC},
+    {0x50, 0x54, CPU_FUSE_CMP_JCC}, {0x50, 0x55, CPU_FUSE_CMP_JCC},
+    {0x50, 0x75, CPU_FUSE_CMP_JCC},
+    {0x31, 0x52, CPU_FUSE_DEC_JCC}, {0x31, 0x53, CPU_FUSE_DEC_JCC},
+    {0x31, 0x75, CPU_FUSE_DEC_JCC},
+    {0x01, 0x20, CPU_FUSE_MOV_ADD},
+};
+
+// Merge a freshly decoded entry with the instruction after it when the
+// pair has a superinstruction. Decoding the second half also marks its
+// page as code, so a store to either half drops the fused entry.
+static void cpu_fuse(CPU* cpu, CpuInsn* in) {
+    uint32_t fusion = in->fn == op_cmp ? CPU_FUSE_CMP_JCC :
+                      in->fn == op_dec ? CPU_FUSE_DEC_JCC :
+                      in->fn == op_mov_reg_imm ? CPU_FUSE_MOV_ADD : 0;
+    if (!(cpu->fusions & fusion)) return;
+
+    CpuInsn next;
+    cpu_decode(cpu, in->addr + in->len, &next);
+    CpuOpFn fn = NULL;
+    switch (fusion) {
+        case CPU_FUSE_CMP_JCC:
+            fn = next.fn == op_jz ? op_cmp_jz :
+                 next.fn == op_jnz ? op_cmp_jnz :
+                 next.fn == op_ja ? op_cmp_ja :
+                 next.fn == op_jb ? op_cmp_jb : NULL;
+            break;
+        case CPU_FUSE_DEC_JCC:
+            fn = next.fn == op_jz ? op_dec_jz :
+                 next.fn == op_jnz ? op_dec_jnz : NULL;
+            break;
+        case CPU_FUSE_MOV_ADD:
+            if (next.fn == op_add_reg_reg && next.reg2 == in->reg1) {
+                fn = op_mov_add;
+                in->reg2 = next.reg1;
             }
-            cpu->ip += 3;
             break;
+    }
+    if (!fn) return;
 
-        case 0x4B: // DEC BX
-            cpu->registers[3] = (cpu->registers[3] & 0xFFFF0000) |
-                ((cpu->registers[3] - 1) & 0xFFFF);
-            cpu->flags = ((cpu->registers[3] & 0xFFFF) == 0) ? 1 : 0;
-            cpu->ip++;
-            break;
+    if (fusion != CPU_FUSE_MOV_ADD) in->imm = next.imm;
+    in->fn = fn;
+    in->len += next.len;
+    in->flags |= next.flags;
+    in->count = 2;
+}
 
-        case 0x4D: // DEC BP
-            cpu->registers[5] = (cpu->registers[5] & 0xFFFF0000) |
-                ((cpu->registers[5] - 1) & 0xFFFF);
-            cpu->flags = ((cpu->registers[5] & 0xFFFF) == 0) ? 1 : 0;
-            cpu->ip++;
-            break;
+// Count back-to-back pairs: the second instruction starts where the
+// first one ended
+static void cpu_count_pair(CPU* cpu, const CpuInsn* in) {
+    uint8_t opcode = cpu_read_byte(cpu, in->addr);
+    if (in->addr == cpu->pair_next) {
+        cpu->pair_counts[cpu->pair_first << 8 | opcode]++;
+    }
+    cpu->pair_first = opcode;
+    cpu->pair_next = in->addr + in->len;
+}
 
-        case 0x58: // POP AX
-            cpu->registers[0] = (cpu->registers[0] & 0xFFFF0000) |
-                cpu_read_word(cpu, cpu->registers[7]);
-            cpu->registers[7] += 2;
-            cpu->ip++;
-            break;
+// Execute one icache entry; returns the number of instructions retired
+int cpu_emulate_cycle(CPU* cpu) {
+    CpuInsn* insn = &cpu->icache[cpu->ip & (ICACHE_SIZE - 1)];
+    if (!insn->fn || insn->addr != cpu->ip) {
+        cpu_decode(cpu, cpu->ip, insn);
+        if (cpu->fusions) cpu_fuse(cpu, insn);
+    }
+    if (cpu->pair_counts) cpu_count_pair(cpu, insn);
+    int count = insn->count;
+    insn->fn(cpu, insn);
+    return count;
+}
 
-        default:
-            printf("Unknown opcode: 0x%02X at IP: 0x%08X\n", opcode, cpu->ip);
-            cpu->ip++;
+// Run the selected engine once; returns the number of instructions retired
+int cpu_step(CPU* cpu) {
+    if (cpu->trace) {
+        return trace_step(cpu);
     }
+    if (cpu->prof) {
+        return prof_step(cpu);
+    }
+    if (cpu->engine != CPU_ENGINE_INTERP) {
+        return block_run(cpu);
+    }
+    return cpu_emulate_cycle(cpu);
 }
 
-void cpu_load_program(CPU* cpu, const char* filename) {
-    FILE* f = fopen(filename, "rb");
-    if (f) {
-        fread(cpu->memory, 1, MEMORY_SIZE, f);
-        fclose(f);
-    } else {
+void cpu_set_fusions(CPU* cpu, uint32_t fusions) {
+    cpu->fusions = fusions & CPU_FUSE_ALL;
+    cpu_flush_icache(cpu);
+}
+
+// Count executed opcode pairs from now on; fusion is switched off so every
+// pair is seen on its own
+int cpu_record_pairs(CPU* cpu) {
+    if (!cpu->pair_counts) {
+        cpu->pair_counts = calloc(256 * 256, sizeof(uint64_t));
+        if (!cpu->pair_counts) {
+            printf("Failed to allocate pair profile\n");
+            return 0;
+        }
+    }
+    cpu->pair_next = UINT32_MAX;
+    cpu_set_fusions(cpu, 0);
+    return 1;
+}
+
+typedef struct {
+    uint16_t pair;
+    uint64_t count;
+} CpuPairCount;
+
+static int cpu_pair_cmp(const void* a, const void* b) {
+    uint64_t ca = ((const CpuPairCount*)a)->count;
+    uint64_t cb = ((const CpuPairCount*)b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+// One "first second count" line per executed pair, most frequent first
+int cpu_save_pair_profile(CPU* cpu, const char* path) {
+    if (!cpu->pair_counts) return 0;
+    CpuPairCount* pairs = malloc(256 * 256 * sizeof(CpuPairCount));
+    if (!pairs) {
+        printf("Failed to allocate pair profile\n");
+        return 0;
+    }
+    int num_pairs = 0;
+    for (int i = 0; i < 256 * 256; i++) {
+        if (cpu->pair_counts[i]) {
+            pairs[num_pairs].pair = i;
+            pairs[num_pairs].count = cpu->pair_counts[i];
+            num_pairs++;
+        }
+    }
+    qsort(pairs, num_pairs, sizeof(CpuPairCount), cpu_pair_cmp);
+
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        printf("Failed to create pair profile: %s\n", path);
+        free(pairs);
+        return 0;
+    }
+    fprintf(f, "# first second count\n");
+    for (int i = 0; i < num_pairs; i++) {
+        fprintf(f, "%02X %02X %llu\n", pairs[i].pair >> 8, pairs[i].pair & 0xFF,
+                (unsigned long long)pairs[i].count);
+    }
+    free(pairs);
+    if (fclose(f) != 0) {
+        printf("Failed to write pair profile: %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Enable the superinstructions whose pairs make up at least
+// 1/CPU_FUSE_MIN_SHARE of the profiled pairs
+int cpu_load_fusion_profile(CPU* cpu, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("Failed to open pair profile: %s\n", path);
+        return 0;
+    }
+    uint64_t total = 0;
+    uint64_t fused[CPU_FUSE_ALL + 1] = {0};
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned first, second;
+        unsigned long long count;
+        if (line[0] == '#' || sscanf(line, "%x %x %llu", &first, &second, &count) != 3) {
+            continue;
+        }
+        total += count;
+        for (size_t i = 0; i < sizeof(cpu_fusion_pairs) / sizeof(cpu_fusion_pairs[0]); i++) {
+            if (cpu_fusion_pairs[i].first == first && cpu_fusion_pairs[i].second == second) {
+                fused[cpu_fusion_pairs[i].fusion] += count;
+            }
+        }
+    }
+    fclose(f);
+
+    uint32_t fusions = 0;
+    for (uint32_t fusion = 1; fusion <= CPU_FUSE_ALL; fusion <<= 1) {
+        if (total && fused[fusion] * CPU_FUSE_MIN_SHARE >= total) {
+            fusions |= fusion;
+        }
+    }
+    cpu_set_fusions(cpu, fusions);
+    return 1;
+}
+
+// Programs come from the process-wide image cache, so VMs loading the same
+// file copy from one mapping instead of each reading it again
+int cpu_load_program(CPU* cpu, const char* filename) {
+    size_t size = 0;
+    const uint8_t* data = imagecache_acquire(filename, &size);
+    if (!data) {
         printf("Failed to load program: %s\n", filename);
+        return 0;
     }
+    memcpy(cpu->memory, data, size < cpu->memory_size ? size : cpu->memory_size);
+    imagecache_release(data);
+    cpu_mark_dirty(cpu, 0, size < cpu->memory_size ? (uint32_t)size : cpu->memory_size);
+    cpu_flush_icache(cpu);
+    return 1;
+}
+
+// Zero guest RAM, handing untouched and shared pages back to the host
+void cpu_clear_memory(CPU* cpu) {
+    mem_reset(cpu->memory, cpu->memory_size, cpu->mem_flags);
+    mem_image_release(cpu->image);
+    cpu->image = NULL;
+    cpu_clean_pages(cpu);
+    cpu_flush_icache(cpu);
 }
\ No newline at end of file
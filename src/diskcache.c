@@ -0,0 +1,144 @@
+#include <diskcache.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DISKCACHE_NONE UINT32_MAX
+
+static uint32_t diskcache_bucket(const DiskCache* cache, uint64_t lba) {
+    return (uint32_t)((lba * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->num_buckets - 1);
+}
+
+DiskCache* diskcache_create(uint32_t sectors, uint32_t sector_size, uint32_t max_readahead) {
+    DiskCache* cache = calloc(1, sizeof(DiskCache));
+    if (!cache) {
+        printf("Failed to allocate disk cache\n");
+        return NULL;
+    }
+    cache->capacity = sectors;
+    cache->sector_size = sector_size;
+    cache->num_buckets = 1;
+    while (cache->num_buckets < sectors) cache->num_buckets <<= 1;
+
+    cache->data = malloc((size_t)sectors * sector_size);
+    cache->staging = malloc((size_t)sectors * sector_size);
+    cache->lbas = malloc(sizeof(uint64_t) * sectors);
+    cache->chain = malloc(sizeof(uint32_t) * sectors);
+    cache->prev = malloc(sizeof(uint32_t) * sectors);
+    cache->next = malloc(sizeof(uint32_t) * sectors);
+    cache->buckets = malloc(sizeof(uint32_t) * cache->num_buckets);
+    if (!cache->data || !cache->staging || !cache->lbas || !cache->chain ||
+        !cache->prev || !cache->next || !cache->buckets) {
+        printf("Failed to allocate a %u sector disk cache\n", sectors);
+        diskcache_destroy(cache);
+        return NULL;
+    }
+    memset(cache->buckets, 0xFF, sizeof(uint32_t) * cache->num_buckets);
+    cache->head = DISKCACHE_NONE;
+    cache->tail = DISKCACHE_NONE;
+    // Readahead past the staging buffer could never be kept
+    cache->max_readahead = max_readahead < sectors ? max_readahead : sectors - 1;
+    cache->next_lba = UINT64_MAX;
+    return cache;
+}
+
+void diskcache_destroy(DiskCache* cache) {
+    if (!cache) return;
+    free(cache->data);
+    free(cache->staging);
+    free(cache->lbas);
+    free(cache->chain);
+    free(cache->prev);
+    free(cache->next);
+    free(cache->buckets);
+    free(cache);
+}
+
+void diskcache_clear(DiskCache* cache) {
+    memset(cache->buckets, 0xFF, sizeof(uint32_t) * cache->num_buckets);
+    cache->used = 0;
+    cache->head = DISKCACHE_NONE;
+    cache->tail = DISKCACHE_NONE;
+    cache->window = 0;
+    cache->next_lba = UINT64_MAX;
+}
+
+static void diskcache_unlink(DiskCache* cache, uint32_t slot) {
+    if (cache->prev[slot] != DISKCACHE_NONE) {
+        cache->next[cache->prev[slot]] = cache->next[slot];
+    } else {
+        cache->head = cache->next[slot];
+    }
+    if (cache->next[slot] != DISKCACHE_NONE) {
+        cache->prev[cache->next[slot]] = cache->prev[slot];
+    } else {
+        cache->tail = cache->prev[slot];
+    }
+}
+
+static void diskcache_push_front(DiskCache* cache, uint32_t slot) {
+    cache->prev[slot] = DISKCACHE_NONE;
+    cache->next[slot] = cache->head;
+    if (cache->head != DISKCACHE_NONE) {
+        cache->prev[cache->head] = slot;
+    } else {
+        cache->tail = slot;
+    }
+    cache->head = slot;
+}
+
+static uint32_t diskcache_find(const DiskCache* cache, uint64_t lba) {
+    uint32_t slot = cache->buckets[diskcache_bucket(cache, lba)];
+    while (slot != DISKCACHE_NONE && cache->lbas[slot] != lba) {
+        slot = cache->chain[slot];
+    }
+    return slot;
+}
+
+const uint8_t* diskcache_lookup(DiskCache* cache, uint64_t lba) {
+    uint32_t slot = diskcache_find(cache, lba);
+    if (slot == DISKCACHE_NONE) return NULL;
+    if (slot != cache->head) {
+        diskcache_unlink(cache, slot);
+        diskcache_push_front(cache, slot);
+    }
+    return &cache->data[(size_t)slot * cache->sector_size];
+}
+
+uint8_t* diskcache_insert(DiskCache* cache, uint64_t lba) {
+    uint32_t slot = diskcache_find(cache, lba);
+    if (slot != DISKCACHE_NONE) {
+        diskcache_unlink(cache, slot);
+    } else if (cache->used < cache->capacity) {
+        slot = cache->used++;
+        uint32_t bucket = diskcache_bucket(cache, lba);
+        cache->lbas[slot] = lba;
+        cache->chain[slot] = cache->buckets[bucket];
+        cache->buckets[bucket] = slot;
+    } else {
+        // Recycle the least recent slot under its new sector number
+        slot = cache->tail;
+        diskcache_unlink(cache, slot);
+        uint32_t* link = &cache->buckets[diskcache_bucket(cache, cache->lbas[slot])];
+        while (*link != slot) link = &cache->chain[*link];
+        *link = cache->chain[slot];
+
+        uint32_t bucket = diskcache_bucket(cache, lba);
+        cache->lbas[slot] = lba;
+        cache->chain[slot] = cache->buckets[bucket];
+        cache->buckets[bucket] = slot;
+    }
+    diskcache_push_front(cache, slot);
+    return &cache->data[(size_t)slot * cache->sector_size];
+}
+
+uint32_t diskcache_readahead(DiskCache* cache, uint64_t lba, uint32_t count) {
+    if (lba == cache->next_lba) {
+        uint32_t window = cache->window ? cache->window * 2 : DISKCACHE_READAHEAD_MIN;
+        cache->window = window < cache->max_readahead ? window : cache->max_readahead;
+    } else {
+        cache->window = 0;
+    }
+    cache->next_lba = lba + count;
+    return cache->window;
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include <diskio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// A single queue for the whole process, so many VMs waiting on a slow disk
+// tie up DISKIO_THREADS threads rather than the threads that run guests
+static pthread_mutex_t diskio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diskio_work = PTHREAD_COND_INITIALIZER;  // Queue became non-empty
+static pthread_cond_t diskio_idle = PTHREAD_COND_INITIALIZER;  // A request completed
+static DiskRequest* diskio_head;
+static DiskRequest* diskio_tail;
+static int diskio_threads;
+
+size_t diskio_read(int fd, uint8_t* buffer, size_t size, uint64_t offset) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = pread(fd, buffer + total, size - total, (off_t)(offset + total));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        total += (size_t)n;
+    }
+    return total;
+}
+
+static void* diskio_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&diskio_lock);
+    for (;;) {
+        while (!diskio_head) {
+            pthread_cond_wait(&diskio_work, &diskio_lock);
+        }
+        DiskRequest* req = diskio_head;
+        diskio_head = req->next;
+        if (!diskio_head) diskio_tail = NULL;
+        pthread_mutex_unlock(&diskio_lock);
+
+        size_t total = diskio_read(req->fd, req->buffer, req->size, req->offset);
+
+        pthread_mutex_lock(&diskio_lock);
+        req->result = total;
+        atomic_store_explicit(&req->done, 1, memory_order_release);
+        pthread_cond_broadcast(&diskio_idle);
+    }
+    return NULL;
+}
+
+// Reader threads start with the first request and live as long as the process
+static int diskio_start(void) {
+    for (int i = diskio_threads; i < DISKIO_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, diskio_worker, NULL) != 0) break;
+        pthread_detach(thread);
+        diskio_threads++;
+    }
+    return diskio_threads > 0;
+}
+
+int diskio_submit(DiskRequest* req) {
+    pthread_mutex_lock(&diskio_lock);
+    if (!diskio_threads && !diskio_start()) {
+        pthread_mutex_unlock(&diskio_lock);
+        printf("Failed to start disk I/O thread\n");
+        return 0;
+    }
+    req->next = NULL;
+    req->result = 0;
+    atomic_store_explicit(&req->done, 0, memory_order_relaxed);
+    if (diskio_tail) {
+        diskio_tail->next = req;
+    } else {
+        diskio_head = req;
+    }
+    diskio_tail = req;
+    pthread_cond_signal(&diskio_work);
+    pthread_mutex_unlock(&diskio_lock);
+    return 1;
+}
+
+int diskio_done(DiskRequest* req) {
+    return atomic_load_explicit(&req->done, memory_order_acquire);
+}
+
+int diskio_wait(DiskRequest* req, uint64_t timeout_ns) {
+    if (diskio_done(req)) return 1;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t ns = (uint64_t)deadline.tv_nsec + timeout_ns;
+    deadline.tv_sec += (time_t)(ns / 1000000000ULL);
+    deadline.tv_nsec = (long)(ns % 1000000000ULL);
+
+    pthread_mutex_lock(&diskio_lock);
+    while (!diskio_done(req)) {
+        if (pthread_cond_timedwait(&diskio_idle, &diskio_lock, &deadline) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&diskio_lock);
+    return diskio_done(req);
+}
\ No newline at end of file
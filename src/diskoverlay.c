@@ -0,0 +1,249 @@
+#include <diskoverlay.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Overlay layout:
+//   header   "XVMO", version, sector size, disk size in sectors (little-endian)
+//   map      one bit per sector, lowest bit first
+//   data     page aligned; sector n at data_offset + n * sector size
+#define DISKOVERLAY_MAGIC "XVMO"
+#define DISKOVERLAY_VERSION 1
+#define DISKOVERLAY_HEADER_SIZE 20
+#define DISKOVERLAY_ALIGN 4096
+#define DISKOVERLAY_COPY_SECTORS 64  // Sectors moved per read when cloning
+
+static int diskoverlay_has(const DiskOverlay* overlay, uint64_t lba) {
+    return (overlay->map[lba >> 3] >> (lba & 7)) & 1;
+}
+
+// Length of the run of sectors from lba, up to end, that are all present
+// (or all absent when present is 0)
+static uint64_t diskoverlay_run(const DiskOverlay* overlay, uint64_t lba, uint64_t end,
+                                int present) {
+    uint64_t n = lba;
+    while (n < end && diskoverlay_has(overlay, n) == present) n++;
+    return n - lba;
+}
+
+static int diskoverlay_write_header(DiskOverlay* overlay) {
+    uint8_t header[DISKOVERLAY_HEADER_SIZE];
+    memcpy(header, DISKOVERLAY_MAGIC, 4);
+    for (int i = 0; i < 4; i++) {
+        header[4 + i] = (uint8_t)(DISKOVERLAY_VERSION >> (i * 8));
+        header[8 + i] = (uint8_t)(overlay->sector_size >> (i * 8));
+    }
+    for (int i = 0; i < 8; i++) {
+        header[12 + i] = (uint8_t)(overlay->sectors >> (i * 8));
+    }
+    return pwrite(overlay->fd, header, sizeof(header), 0) == sizeof(header);
+}
+
+// Check an existing overlay against the disk and load its map
+static int diskoverlay_load(DiskOverlay* overlay, const char* path) {
+    uint8_t header[DISKOVERLAY_HEADER_SIZE];
+    if (pread(overlay->fd, header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header, DISKOVERLAY_MAGIC, 4) != 0) {
+        printf("Not a disk overlay: %s\n", path);
+        return 0;
+    }
+    uint32_t version = 0, sector_size = 0;
+    uint64_t sectors = 0;
+    for (int i = 0; i < 4; i++) {
+        version |= (uint32_t)header[4 + i] << (i * 8);
+        sector_size |= (uint32_t)header[8 + i] << (i * 8);
+    }
+    for (int i = 0; i < 8; i++) {
+        sectors |= (uint64_t)header[12 + i] << (i * 8);
+    }
+    if (version != DISKOVERLAY_VERSION) {
+        printf("Unsupported disk overlay version %u\n", version);
+        return 0;
+    }
+    if (sector_size != overlay->sector_size || sectors != overlay->sectors) {
+        printf("Disk overlay %s is for a %llu sector disk, not %llu\n", path,
+               (unsigned long long)sectors, (unsigned long long)overlay->sectors);
+        return 0;
+    }
+    if (pread(overlay->fd, overlay->map, overlay->map_size, DISKOVERLAY_HEADER_SIZE) !=
+        (ssize_t)overlay->map_size) {
+        printf("Failed to read disk overlay map: %s\n", path);
+        return 0;
+    }
+    for (uint64_t lba = 0; lba < overlay->sectors; lba++) {
+        overlay->written += diskoverlay_has(overlay, lba);
+    }
+    return 1;
+}
+
+DiskOverlay* diskoverlay_open(const char* path, uint64_t sectors, uint32_t sector_size) {
+    DiskOverlay* overlay = calloc(1, sizeof(DiskOverlay));
+    if (!overlay) {
+        printf("Failed to allocate disk overlay\n");
+        return NULL;
+    }
+    overlay->sector_size = sector_size;
+    overlay->sectors = sectors;
+    overlay->map_size = (size_t)((sectors + 7) / 8);
+    overlay->data_offset = (DISKOVERLAY_HEADER_SIZE + overlay->map_size + DISKOVERLAY_ALIGN - 1) &
+                           ~(uint64_t)(DISKOVERLAY_ALIGN - 1);
+    overlay->map = calloc(overlay->map_size ? overlay->map_size : 1, 1);
+    if (!overlay->map) {
+        printf("Failed to allocate disk overlay\n");
+        free(overlay);
+        return NULL;
+    }
+
+    // A temporary overlay is unlinked at once and dies with its descriptor
+    char temp[] = "/tmp/xvm-overlay-XXXXXX";
+    if (path) {
+        overlay->fd = open(path, O_RDWR | O_CREAT, 0644);
+    } else {
+        overlay->fd = mkstemp(temp);
+        if (overlay->fd >= 0) unlink(temp);
+    }
+    if (overlay->fd < 0) {
+        printf("Failed to open disk overlay: %s\n", path ? path : temp);
+        diskoverlay_close(overlay);
+        return NULL;
+    }
+
+    struct stat st;
+    int ok = fstat(overlay->fd, &st) == 0;
+    if (ok && st.st_size > 0) {
+        ok = diskoverlay_load(overlay, path);
+    } else if (ok) {
+        ok = ftruncate(overlay->fd, (off_t)overlay->data_offset) == 0 &&
+             diskoverlay_write_header(overlay);
+        if (!ok) printf("Failed to create disk overlay: %s\n", path ? path : temp);
+    }
+    if (!ok) {
+        diskoverlay_close(overlay);
+        return NULL;
+    }
+    return overlay;
+}
+
+void diskoverlay_close(DiskOverlay* overlay) {
+    if (!overlay) return;
+    if (overlay->fd >= 0) close(overlay->fd);
+    free(overlay->map);
+    free(overlay);
+}
+
+DiskOverlay* diskoverlay_clone(const DiskOverlay* overlay) {
+    DiskOverlay* clone = diskoverlay_open(NULL, overlay->sectors, overlay->sector_size);
+    if (!clone) return NULL;
+
+    size_t chunk = (size_t)DISKOVERLAY_COPY_SECTORS * overlay->sector_size;
+    uint8_t* buffer = malloc(chunk);
+    int ok = buffer != NULL;
+    for (uint64_t lba = 0; lba < overlay->sectors && ok; ) {
+        uint64_t run = diskoverlay_run(overlay, lba, overlay->sectors, 1);
+        if (run > DISKOVERLAY_COPY_SECTORS) run = DISKOVERLAY_COPY_SECTORS;
+        if (run == 0) {
+            lba += diskoverlay_run(overlay, lba, overlay->sectors, 0);
+            continue;
+        }
+        size_t size = (size_t)run * overlay->sector_size;
+        off_t offset = (off_t)(overlay->data_offset + lba * overlay->sector_size);
+        ok = pread(overlay->fd, buffer, size, offset) == (ssize_t)size &&
+             pwrite(clone->fd, buffer, size, offset) == (ssize_t)size;
+        lba += run;
+    }
+    free(buffer);
+
+    if (ok) {
+        memcpy(clone->map, overlay->map, overlay->map_size);
+        clone->written = overlay->written;
+        ok = pwrite(clone->fd, clone->map, clone->map_size, DISKOVERLAY_HEADER_SIZE) ==
+             (ssize_t)clone->map_size;
+    }
+    if (!ok) {
+        printf("Failed to copy disk overlay\n");
+        diskoverlay_close(clone);
+        return NULL;
+    }
+    return clone;
+}
+
+uint32_t diskoverlay_next_run(const DiskOverlay* overlay, uint64_t* lba, uint32_t max) {
+    if (*lba >= overlay->sectors) return 0;
+    *lba += diskoverlay_run(overlay, *lba, overlay->sectors, 0);
+    uint64_t run = diskoverlay_run(overlay, *lba, overlay->sectors, 1);
+    return (uint32_t)(run < max ? run : max);
+}
+
+int diskoverlay_read(DiskOverlay* overlay, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    if (!overlay->written) return 1;
+    uint64_t end = lba + count < overlay->sectors ? lba + count : overlay->sectors;
+    for (uint64_t n = lba; n < end; ) {
+        uint64_t run = diskoverlay_run(overlay, n, end, 1);
+        if (run == 0) {
+            n += diskoverlay_run(overlay, n, end, 0);
+            continue;
+        }
+        size_t size = (size_t)run * overlay->sector_size;
+        if (pread(overlay->fd, buffer + (n - lba) * overlay->sector_size, size,
+                  (off_t)(overlay->data_offset + n * overlay->sector_size)) != (ssize_t)size) {
+            printf("Failed to read disk overlay\n");
+            return 0;
+        }
+        n += run;
+    }
+    return 1;
+}
+
+uint32_t diskoverlay_write(DiskOverlay* overlay, uint64_t lba, uint32_t count,
+                           const uint8_t* buffer) {
+    if (lba >= overlay->sectors) return 0;
+    if (count > overlay->sectors - lba) count = (uint32_t)(overlay->sectors - lba);
+    if (count == 0) return 0;
+
+    ssize_t n = pwrite(overlay->fd, buffer, (size_t)count * overlay->sector_size,
+                       (off_t)(overlay->data_offset + lba * overlay->sector_size));
+    uint32_t done = n > 0 ? (uint32_t)(n / overlay->sector_size) : 0;
+    if (done == 0) return 0;
+
+    // The map bytes go out with the data, so the file is always usable; the
+    // in-memory map only changes once they are on disk
+    size_t first = (size_t)(lba >> 3);
+    size_t size = (size_t)((lba + done - 1) >> 3) - first + 1;
+    uint8_t* bytes = malloc(size);
+    if (!bytes) {
+        printf("Failed to update disk overlay map\n");
+        return 0;
+    }
+    memcpy(bytes, &overlay->map[first], size);
+    for (uint64_t i = lba; i < lba + done; i++) {
+        bytes[(i >> 3) - first] |= (uint8_t)(1 << (i & 7));
+    }
+    if (pwrite(overlay->fd, bytes, size, (off_t)(DISKOVERLAY_HEADER_SIZE + first)) !=
+        (ssize_t)size) {
+        printf("Failed to update disk overlay map\n");
+        free(bytes);
+        return 0;
+    }
+    for (uint64_t i = lba; i < lba + done; i++) {
+        overlay->written += !diskoverlay_has(overlay, i);
+    }
+    memcpy(&overlay->map[first], bytes, size);
+    free(bytes);
+    return done;
+}
+
+int diskoverlay_discard(DiskOverlay* overlay) {
+    memset(overlay->map, 0, overlay->map_size);
+    overlay->written = 0;
+    // Cutting the file back to the map frees every data block at once
+    if (pwrite(overlay->fd, overlay->map, overlay->map_size, DISKOVERLAY_HEADER_SIZE) !=
+            (ssize_t)overlay->map_size ||
+        ftruncate(overlay->fd, (off_t)overlay->data_offset) != 0) {
+        printf("Failed to discard disk overlay\n");
+        return 0;
+    }
+    return 1;
+}
\ No newline at end of file
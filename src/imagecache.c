@@ -0,0 +1,161 @@
+#include <imagecache.h>
+#include <mem.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// One mapped file, shared by every load that opened the same inode while
+// it kept the size and mtime it was mapped with
+typedef struct ImageMapping {
+    const uint8_t* data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    int fd;
+    int refs;
+    uint64_t last_used;          // Release order, for dropping idle mappings
+    struct ImageMapping* next;
+} ImageMapping;
+
+static pthread_mutex_t imagecache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ImageMapping* imagecache_mappings;
+static uint64_t imagecache_clock;
+static ImageCacheStats imagecache_counts;
+
+static ImageMapping* imagecache_find(const uint8_t* data) {
+    ImageMapping* mapping = imagecache_mappings;
+    while (mapping && mapping->data != data) mapping = mapping->next;
+    return mapping;
+}
+
+static ImageMapping* imagecache_find_file(const struct stat* st) {
+    ImageMapping* mapping = imagecache_mappings;
+    while (mapping && !(mapping->dev == st->st_dev && mapping->ino == st->st_ino &&
+                        mapping->size == (size_t)st->st_size &&
+                        mapping->mtime == st->st_mtime)) {
+        mapping = mapping->next;
+    }
+    return mapping;
+}
+
+static void imagecache_unmap(ImageMapping* mapping) {
+    ImageMapping** m = &imagecache_mappings;
+    while (*m != mapping) m = &(*m)->next;
+    *m = mapping->next;
+
+    mem_unmap_file(mapping->data, mapping->size);
+    close(mapping->fd);
+    free(mapping);
+}
+
+// Drop the least recently released mappings nobody holds beyond the limit
+static void imagecache_trim(void) {
+    for (;;) {
+        int idle = 0;
+        ImageMapping* oldest = NULL;
+        for (ImageMapping* m = imagecache_mappings; m; m = m->next) {
+            if (m->refs) continue;
+            idle++;
+            if (!oldest || m->last_used < oldest->last_used) oldest = m;
+        }
+        if (idle <= IMAGECACHE_IDLE_MAX) return;
+        imagecache_unmap(oldest);
+    }
+}
+
+static ImageMapping* imagecache_add(const uint8_t* data, size_t size, int fd,
+                                    const struct stat* st) {
+    ImageMapping* mapping = calloc(1, sizeof(ImageMapping));
+    if (!mapping) return NULL;
+    mapping->data = data;
+    mapping->size = size;
+    mapping->dev = st->st_dev;
+    mapping->ino = st->st_ino;
+    mapping->mtime = st->st_mtime;
+    mapping->fd = fd;
+    mapping->next = imagecache_mappings;
+    imagecache_mappings = mapping;
+    imagecache_counts.mapped++;
+    return mapping;
+}
+
+const uint8_t* imagecache_acquire(const char* path, size_t* size) {
+    // One descriptor for the checks and the mapping, so the file cannot be
+    // swapped between them
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&imagecache_lock);
+    ImageMapping* mapping = imagecache_find_file(&st);
+    if (mapping) {
+        imagecache_counts.hits++;
+    } else {
+        // Mapped without the lock so other loads go on meanwhile; when a
+        // load of the same file finishes first, its mapping is used
+        pthread_mutex_unlock(&imagecache_lock);
+        size_t length = 0;
+        const uint8_t* data = mem_map_fd(fd, &length);
+        pthread_mutex_lock(&imagecache_lock);
+        mapping = imagecache_find_file(&st);
+        if (mapping) {
+            imagecache_counts.hits++;
+        } else if (data) {
+            mapping = imagecache_add(data, length, fd, &st);
+            if (mapping) fd = -1;  // Owned by the mapping now
+        }
+        if (fd >= 0) mem_unmap_file(data, length);
+    }
+    if (fd >= 0) close(fd);
+
+    const uint8_t* data = NULL;
+    if (mapping) {
+        mapping->refs++;
+        imagecache_counts.loads++;
+        data = mapping->data;
+        *size = mapping->size;
+    }
+    imagecache_trim();
+    pthread_mutex_unlock(&imagecache_lock);
+    return data;
+}
+
+const uint8_t* imagecache_retain(const uint8_t* data) {
+    pthread_mutex_lock(&imagecache_lock);
+    ImageMapping* mapping = imagecache_find(data);
+    if (mapping) mapping->refs++;
+    pthread_mutex_unlock(&imagecache_lock);
+    return mapping ? data : NULL;
+}
+
+void imagecache_release(const uint8_t* data) {
+    if (!data) return;
+    pthread_mutex_lock(&imagecache_lock);
+    ImageMapping* mapping = imagecache_find(data);
+    if (mapping && --mapping->refs == 0) {
+        mapping->last_used = ++imagecache_clock;
+        imagecache_trim();
+    }
+    pthread_mutex_unlock(&imagecache_lock);
+}
+
+int imagecache_fd(const uint8_t* data) {
+    pthread_mutex_lock(&imagecache_lock);
+    ImageMapping* mapping = imagecache_find(data);
+    int fd = mapping ? mapping->fd : -1;
+    pthread_mutex_unlock(&imagecache_lock);
+    return fd;
+}
+
+void imagecache_stats(ImageCacheStats* stats) {
+    pthread_mutex_lock(&imagecache_lock);
+    *stats = imagecache_counts;
+    pthread_mutex_unlock(&imagecache_lock);
+}
\ No newline at end of file
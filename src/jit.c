@@ -0,0 +1,349 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jit.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#define JIT_SUPPORTED 1
+#endif
+
+#ifdef JIT_SUPPORTED
+
+// Guest registers live in r8d-r15d for the whole block. rbx holds the CPU
+// pointer, eax the guest flags, ecx the retired count, esi the loop budget
+// and edx the exit ip.
+#define HOST_REG(g) (8 + (g))
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+
+typedef struct {
+    uint8_t* p;
+    uint8_t* end;
+    int overflow;
+} Emitter;
+
+static void emit8(Emitter* e, uint8_t b) {
+    if (e->p < e->end) {
+        *e->p++ = b;
+    } else {
+        e->overflow = 1;
+    }
+}
+
+static void emit32(Emitter* e, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emit8(e, (v >> (i * 8)) & 0xFF);
+    }
+}
+
+static void emit_rex(Emitter* e, int reg, int rm) {
+    uint8_t rex = 0x40 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (rex != 0x40) emit8(e, rex);
+}
+
+// op r/m32, r32 with register operands
+static void emit_rr(Emitter* e, uint8_t opcode, int dst, int src) {
+    emit_rex(e, src, dst);
+    emit8(e, opcode);
+    emit8(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// Opcode-extension forms (FF /0, F7 /2, C1 /4, ...)
+static void emit_ext(Emitter* e, uint8_t opcode, int ext, int dst) {
+    emit_rex(e, 0, dst);
+    emit8(e, opcode);
+    emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+}
+
+// mov r32, [rbx + disp32] (0x8B) / mov [rbx + disp32], r32 (0x89)
+static void emit_mem(Emitter* e, uint8_t opcode, int reg, uint32_t disp) {
+    emit_rex(e, reg, RBX);
+    emit8(e, opcode);
+    emit8(e, 0x80 | ((reg & 7) << 3) | RBX);
+    emit32(e, disp);
+}
+
+static void emit_mov_imm(Emitter* e, int reg, uint32_t imm) {
+    emit_rex(e, 0, reg);
+    emit8(e, 0xB8 | (reg & 7));
+    emit32(e, imm);
+}
+
+// eax = host ZF, matching the interpreter's flags = (result == 0)
+static void emit_zf_flags(Emitter* e) {
+    emit8(e, 0x0F); emit8(e, 0x94); emit8(e, 0xC0);  // setz al
+    emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xC0);  // movzx eax, al
+}
+
+static void emit_test_self(Emitter* e, int reg) {
+    emit_rr(e, 0x85, reg, reg);
+}
+
+// Emits a rel32 jump (opcode 0 = jmp) and returns the field to patch
+static uint8_t* emit_jump(Emitter* e, uint8_t cc) {
+    if (cc) {
+        emit8(e, 0x0F);
+        emit8(e, cc);
+    } else {
+        emit8(e, 0xE9);
+    }
+    uint8_t* field = e->p;
+    emit32(e, 0);
+    return field;
+}
+
+static void patch_jump(Emitter* e, uint8_t* field, const uint8_t* target) {
+    if (e->overflow) return;
+    int32_t rel = (int32_t)(target - (field + 4));
+    memcpy(field, &rel, 4);
+}
+
+static int jit_supports(const Block* block) {
+    for (uint32_t i = 0; i < block->count; i++) {
+        switch (block->insns[i].kind) {
+            case BOP_CALL:
+            case BOP_CALL_END:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static void emit_insn(Emitter* e, const CpuInsn* in, int kind) {
+    int r1 = HOST_REG(in->reg1);
+    int r2 = HOST_REG(in->reg2);
+
+    switch (kind) {
+        case BOP_MOV_RI: emit_mov_imm(e, r1, in->imm); break;
+        case BOP_MOV_RR: emit_rr(e, 0x89, r1, r2); break;
+        case BOP_ADD_RR: emit_rr(e, 0x01, r1, r2); emit_zf_flags(e); break;
+        case BOP_SUB_RR: emit_rr(e, 0x29, r1, r2); emit_zf_flags(e); break;
+        case BOP_AND: emit_rr(e, 0x21, r1, r2); emit_zf_flags(e); break;
+        case BOP_OR: emit_rr(e, 0x09, r1, r2); emit_zf_flags(e); break;
+        case BOP_XOR: emit_rr(e, 0x31, r1, r2); emit_zf_flags(e); break;
+        case BOP_INC: emit_ext(e, 0xFF, 0, r1); emit_zf_flags(e); break;
+        case BOP_DEC: emit_ext(e, 0xFF, 1, r1); emit_zf_flags(e); break;
+        case BOP_NEG: emit_ext(e, 0xF7, 3, r1); emit_zf_flags(e); break;
+        case BOP_ADD_RI:
+            emit_ext(e, 0x81, 0, r1);
+            emit32(e, in->imm);
+            emit_zf_flags(e);
+            break;
+        case BOP_NOT:
+            emit_ext(e, 0xF7, 2, r1);
+            emit_test_self(e, r1);
+            emit_zf_flags(e);
+            break;
+        case BOP_SHL:
+        case BOP_SHR:
+            // A zero count leaves host flags alone, so test the result
+            emit_ext(e, 0xC1, kind == BOP_SHL ? 4 : 5, r1);
+            emit8(e, in->imm);
+            emit_test_self(e, r1);
+            emit_zf_flags(e);
+            break;
+        case BOP_CMP:
+            emit_rr(e, 0x39, r1, r2);
+            emit8(e, 0x0F); emit8(e, 0x94); emit8(e, 0xC0);  // setz al
+            emit8(e, 0x0F); emit8(e, 0x92); emit8(e, 0xC2);  // setb dl
+            emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xC0);  // movzx eax, al
+            emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xD2);  // movzx edx, dl
+            emit8(e, 0x8D); emit8(e, 0x04); emit8(e, 0x50);  // lea eax, [rax + rdx*2]
+            break;
+    }
+}
+
+Jit* jit_create(void) {
+    Jit* jit = calloc(1, sizeof(Jit));
+    if (!jit) return NULL;
+
+    void* code = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->code = code;
+    jit->size = JIT_BUFFER_SIZE;
+    jit->page = (size_t)sysconf(_SC_PAGESIZE);
+    return jit;
+}
+
+// Make [from, sealed) writable again, for emitting into a partly used page
+static int jit_unseal(Jit* jit, size_t from) {
+    from &= ~(jit->page - 1);
+    if (from >= jit->sealed) return 1;
+    if (mprotect(jit->code + from, jit->sealed - from, PROT_READ | PROT_WRITE) != 0) {
+        return 0;
+    }
+    jit->sealed = from;
+    return 1;
+}
+
+// Make everything emitted so far read+execute
+static int jit_seal(Jit* jit) {
+    size_t end = (jit->used + jit->page - 1) & ~(jit->page - 1);
+    if (end <= jit->sealed) return 1;
+    if (mprotect(jit->code + jit->sealed, end - jit->sealed, PROT_READ | PROT_EXEC) != 0) {
+        return 0;
+    }
+    jit->sealed = end;
+    return 1;
+}
+
+void jit_destroy(Jit* jit) {
+    munmap(jit->code, jit->size);
+    free(jit);
+}
+
+void jit_reset(Jit* jit) {
+    // Nothing may run from the buffer until blocks are compiled again
+    if (!jit_unseal(jit, 0)) {
+        printf("Failed to unprotect JIT buffer\n");
+    }
+    jit->used = 0;
+    jit->full = 0;
+}
+
+JitFn jit_compile(Jit* jit, const Block* block) {
+    if (!jit_supports(block)) return NULL;
+    if (!jit_unseal(jit, jit->used)) {
+        printf("Failed to unprotect JIT buffer\n");
+        jit->full = 1;
+        return NULL;
+    }
+
+    const BlockInsn* last = &block->insns[block->count - 1];
+    int kind = last->kind;
+    // Blocks cut short by an INT or the length limit fall through to the exit
+    if (kind < BOP_JMP) kind = BOP_EXIT;
+    uint32_t fallthrough = block->insns[block->count].insn.addr;
+    uint8_t* exits[2];
+    int num_exits = 0;
+
+    Emitter e = { jit->code + jit->used, jit->code + jit->size, 0 };
+    uint8_t* entry = e.p;
+
+    // Prologue: save callee-saved registers and load guest state
+    emit8(&e, 0x53);                                  // push rbx
+    for (int reg = 12; reg <= 15; reg++) {
+        emit8(&e, 0x41); emit8(&e, 0x50 | (reg & 7)); // push r12-r15
+    }
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xFB);  // mov rbx, rdi
+    for (int g = 0; g < 8; g++) {
+        emit_mem(&e, 0x8B, HOST_REG(g), offsetof(CPU, registers) + g * 4);
+    }
+    emit_mem(&e, 0x8B, RAX, offsetof(CPU, flags));
+    emit_rr(&e, 0x31, RCX, RCX);                      // xor ecx, ecx
+
+    uint8_t* loop_top = e.p;
+    uint32_t body = (kind == BOP_EXIT) ? block->count : block->count - 1;
+    for (uint32_t i = 0; i < body; i++) {
+        emit_insn(&e, &block->insns[i].insn, block->insns[i].kind);
+    }
+    if (kind == BOP_EXIT) {
+        last = &block->insns[block->count];
+    }
+
+    // Retire the whole block before any flag-clobbering branch setup
+    emit_ext(&e, 0x81, 0, RCX);
+    emit32(&e, block->count);
+
+    if (kind != BOP_EXIT) {
+        uint8_t* taken = NULL;
+        switch (kind) {
+            case BOP_JZ:
+                emit8(&e, 0xA8); emit8(&e, 1);              // test al, ZF
+                taken = emit_jump(&e, 0x85);
+                break;
+            case BOP_JNZ:
+                emit8(&e, 0xA8); emit8(&e, 1);
+                taken = emit_jump(&e, 0x84);
+                break;
+            case BOP_JA:
+                emit8(&e, 0xA8); emit8(&e, 3);              // test al, ZF|CF
+                taken = emit_jump(&e, 0x84);
+                break;
+            case BOP_JB:
+                emit8(&e, 0xA8); emit8(&e, 2);              // test al, CF
+                taken = emit_jump(&e, 0x85);
+                break;
+            case BOP_LOOP:
+                emit_ext(&e, 0xFF, 1, HOST_REG(2));         // dec r10d
+                taken = emit_jump(&e, 0x85);
+                break;
+        }
+        if (taken) {
+            emit_mov_imm(&e, RDX, fallthrough);
+            exits[num_exits++] = emit_jump(&e, 0);
+            patch_jump(&e, taken, e.p);
+        }
+
+        // Branches back to the block start loop natively within the budget
+        if (last->insn.imm == block->start) {
+            emit_rr(&e, 0x39, RCX, RSI);                    // cmp ecx, esi
+            patch_jump(&e, emit_jump(&e, 0x8C), loop_top);  // jl loop_top
+        }
+        emit_mov_imm(&e, RDX, last->insn.imm);
+    } else {
+        emit_mov_imm(&e, RDX, fallthrough);
+    }
+
+    // Epilogue: write guest state back and return the retired count
+    for (int i = 0; i < num_exits; i++) {
+        patch_jump(&e, exits[i], e.p);
+    }
+    for (int g = 0; g < 8; g++) {
+        emit_mem(&e, 0x89, HOST_REG(g), offsetof(CPU, registers) + g * 4);
+    }
+    emit_mem(&e, 0x89, RDX, offsetof(CPU, ip));
+    emit_mem(&e, 0x89, RAX, offsetof(CPU, flags));
+    emit_rr(&e, 0x89, RAX, RCX);                      // mov eax, ecx
+    for (int reg = 15; reg >= 12; reg--) {
+        emit8(&e, 0x41); emit8(&e, 0x58 | (reg & 7)); // pop r15-r12
+    }
+    emit8(&e, 0x5B);                                  // pop rbx
+    emit8(&e, 0xC3);                                  // ret
+
+    if (e.overflow) {
+        jit->full = 1;
+        jit_seal(jit);
+        return NULL;
+    }
+    jit->used = ((size_t)(e.p - jit->code) + 15) & ~(size_t)15;
+    if (!jit_seal(jit)) {
+        // Blocks sharing the page cannot run either; start over
+        printf("Failed to protect JIT buffer\n");
+        jit->full = 1;
+        return NULL;
+    }
+    return (JitFn)(uintptr_t)entry;
+}
+
+#else
+
+Jit* jit_create(void) {
+    return NULL;
+}
+
+void jit_destroy(Jit* jit) {
+    (void)jit;
+}
+
+void jit_reset(Jit* jit) {
+    (void)jit;
+}
+
+JitFn jit_compile(Jit* jit, const Block* block) {
+    (void)jit;
+    (void)block;
+    return NULL;
+}
+
+#endif
\ No newline at end of file
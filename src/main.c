@@ -1,20 +1,337 @@
 #include <vm.h>
+#include <pool.h>
+#include <prof.h>
+#include <trace.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static VM vm;
+static volatile sig_atomic_t pool_stop;
+
+static void usage(const char* prog) {
+    printf("Usage: %s [-e interp|threaded|jit] [-u] [-H] [-m size] [-P] [-o dump|-] "
+           "[-s shm-name] [-R snapshot] [-S snapshot] [-p pairs|-F pairs] "
+           "[-r report] [-g folded] [-t trace] "
+           "[-b [-A] [-C sectors] [-W sectors] [-O overlay [-D]]] <program.bin|disk.iso>\n",
+           prog);
+    printf("       %s -j threads [-e engine] [-m size] [-P] [-n max-insns] [-o dump-dir] "
+           "[-b [-A] [-C sectors] [-W sectors]] <program.bin|disk.iso>...\n", prog);
+    printf("       %s -T trace\n", prog);
+}
+
+// Guest memory size with an optional K, M or G suffix, rounded up to a page
+static int parse_memory_size(const char* text, uint32_t* size) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 0);
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end || value == 0 || value > (CPU_MAX_MEMORY >> shift) + 1) return 0;
+    value <<= shift;
+    if (value > CPU_MAX_MEMORY) value = CPU_MAX_MEMORY;
+    value = (value + CPU_PAGE_SIZE - 1) & ~(unsigned long long)(CPU_PAGE_SIZE - 1);
+    if (value < CPU_MIN_MEMORY) return 0;
+    *size = (uint32_t)value;
+    return 1;
+}
+
+static void on_stop(int sig) {
+    (void)sig;
+    vm.stop_requested = 1;
+    pool_stop = 1;
+}
+
+#ifdef SIGUSR1
+static void on_dump(int sig) {
+    (void)sig;
+    vm.dump_requested = 1;
+}
+#endif
+
+// Batch mode: every image gets its own headless VM on a shared worker pool
+static int run_pool(char** images, int count, int threads, CpuEngine engine,
+                    uint64_t max_instructions, int boot, const VMConfig* vm_config) {
+    PoolTask* tasks = calloc(count, sizeof(PoolTask));
+    if (!tasks) {
+        printf("Failed to allocate %d tasks\n", count);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        tasks[i].image = images[i];
+    }
+
+    PoolConfig config = {0};
+    config.threads = threads;
+    config.engine = engine;
+    config.max_instructions = max_instructions;
+    config.dump_dir = vm_config->dump_path;
+    config.memory_size = vm_config->memory_size;
+    config.huge_pages = vm_config->huge_pages;
+    config.async_disk = vm_config->async_disk;
+    config.disk_cache = vm_config->disk_cache;
+    config.disk_readahead = vm_config->disk_readahead;
+    config.boot = boot;
+    config.stop = &pool_stop;
+    signal(SIGINT, on_stop);
+    signal(SIGTERM, on_stop);
+
+    PoolStats stats;
+    int ok = pool_run(tasks, count, &config, &stats);
+    int failed = 0;
+    for (int i = 0; i < count && ok; i++) {
+        printf("%s: %s after %llu instructions\n", tasks[i].image,
+               pool_result_name(tasks[i].result),
+               (unsigned long long)tasks[i].instructions);
+        if (tasks[i].result == POOL_FAILED || tasks[i].result == POOL_STOPPED) {
+            failed++;
+        }
+    }
+    if (ok) {
+        double seconds = stats.elapsed_ns / 1e9;
+        printf("%d VMs on %d threads: %llu instructions in %.3f s, %.1f MIPS, "
+               "%llu steals\n", count, threads,
+               (unsigned long long)stats.instructions, seconds,
+               seconds > 0 ? stats.instructions / seconds / 1e6 : 0.0,
+               (unsigned long long)stats.steals);
+
+        // Guests booting the same image share one mapping of it
+        ImageCacheStats images;
+        imagecache_stats(&images);
+        printf("%llu image loads from %llu mapped files (%llu shared)\n",
+               (unsigned long long)images.loads, (unsigned long long)images.mapped,
+               (unsigned long long)images.hits);
+    }
+
+    free(tasks);
+    return ok && !failed ? 0 : 1;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <program.bin>\n", argv[0]);
+    CpuEngine engine = CPU_ENGINE_INTERP;
+    VMConfig config = {0};
+    int threads = 0;
+    uint64_t max_instructions = 0;
+    const char* restore_path = NULL;
+    const char* snapshot_path = NULL;
+    const char* pairs_out = NULL;
+    const char* pairs_in = NULL;
+    const char* report_path = NULL;
+    const char* folded_path = NULL;
+    const char* trace_path = NULL;
+    const char* replay_path = NULL;
+    int boot = 0;
+    int discard = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:uHm:Po:s:j:n:R:S:p:F:r:g:t:T:bAC:W:O:D")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (strcmp(optarg, "interp") == 0) {
+                    engine = CPU_ENGINE_INTERP;
+                } else if (strcmp(optarg, "threaded") == 0) {
+                    engine = CPU_ENGINE_THREADED;
+                } else if (strcmp(optarg, "jit") == 0) {
+                    engine = CPU_ENGINE_JIT;
+                } else {
+                    printf("Unknown engine: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                config.unthrottled = 1;
+                break;
+            case 'H':
+                config.headless = 1;
+                break;
+            case 'm':
+                if (!parse_memory_size(optarg, &config.memory_size)) {
+                    printf("Invalid memory size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                config.huge_pages = 1;
+                break;
+            case 'o':
+                config.dump_path = optarg;
+                break;
+            case 's':
+                config.shm_name = optarg;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1) {
+                    printf("Invalid thread count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                max_instructions = strtoull(optarg, NULL, 0);
+                break;
+            case 'R':
+                restore_path = optarg;
+                break;
+            case 'S':
+                snapshot_path = optarg;
+                break;
+            case 'p':
+                pairs_out = optarg;
+                break;
+            case 'F':
+                pairs_in = optarg;
+                break;
+            case 'r':
+                report_path = optarg;
+                break;
+            case 'g':
+                folded_path = optarg;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'T':
+                replay_path = optarg;
+                break;
+            case 'b':
+                boot = 1;
+                break;
+            case 'A':
+                config.async_disk = 1;
+                break;
+            case 'C':
+                config.disk_cache = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'W':
+                config.disk_readahead = (uint32_t)strtoul(optarg, NULL, 0);
+                if (config.disk_readahead == 0) {
+                    printf("Invalid readahead: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                config.disk_overlay = optarg;
+                break;
+            case 'D':
+                discard = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // A trace starts from a snapshot and names its disk image, so replay
+    // needs nothing else
+    if (replay_path) {
+        return trace_replay(replay_path, &config) ? 0 : 1;
+    }
+
+    // A restored snapshot carries its own memory image
+    if (optind >= argc && (threads || !restore_path)) {
+        usage(argv[0]);
         return 1;
     }
 
-    VM vm;
-    if (!vm_init(&vm)) {
+    // Restoring replaces the overlay's writes with the snapshot's, so a
+    // kept -O file is only given up when -D asks for it
+    if (restore_path && config.disk_overlay && !discard) {
+        printf("-R would replace the disk writes in %s; add -D to discard them\n",
+               config.disk_overlay);
+        return 1;
+    }
+
+    if (threads) {
+        return run_pool(&argv[optind], argc - optind, threads, engine,
+                        max_instructions, boot, &config);
+    }
+
+    if (!vm_init(&vm, &config)) {
         printf("Failed to initialize VM\n");
         return 1;
     }
 
-    cpu_load_program(&vm.cpu, argv[1]);
+    if (!cpu_set_engine(&vm.cpu, engine)) {
+        vm_cleanup(&vm);
+        return 1;
+    }
+
+    // Superinstructions are an interpreter feature: -p records which opcode
+    // pairs run back to back, -F fuses only the pairs such a profile favours
+    if ((pairs_out || pairs_in) && engine != CPU_ENGINE_INTERP) {
+        printf("Pair profiles need -e interp\n");
+        vm_cleanup(&vm);
+        return 1;
+    }
+    if ((pairs_out && !cpu_record_pairs(&vm.cpu)) ||
+        (pairs_in && !cpu_load_fusion_profile(&vm.cpu, pairs_in))) {
+        vm_cleanup(&vm);
+        return 1;
+    }
+
+    // -r writes a hot-spot report and -g folded call stacks for flame graphs
+    if ((report_path || folded_path) && !cpu_enable_profiler(&vm.cpu)) {
+        vm_cleanup(&vm);
+        return 1;
+    }
+
+    // SIGUSR1 dumps the screen to -o on demand; SIGINT/SIGTERM stop cleanly
+    signal(SIGINT, on_stop);
+    signal(SIGTERM, on_stop);
+#ifdef SIGUSR1
+    signal(SIGUSR1, on_dump);
+#endif
+
+    // Disk writes go to -O, or to a temporary overlay dropped on exit; -D
+    // starts over from the base image
+    if (discard && config.disk_overlay && remove(config.disk_overlay) != 0 && errno != ENOENT) {
+        printf("Failed to discard disk overlay: %s\n", config.disk_overlay);
+        vm_cleanup(&vm);
+        return 1;
+    }
+    // -b boots a disk image through INT 13h; -A serves its reads on I/O threads
+    if (optind < argc && !(boot ? vm_load_iso(&vm, argv[optind]) :
+                                  cpu_load_program(&vm.cpu, argv[optind]))) {
+        vm_cleanup(&vm);
+        return 1;
+    }
+    if (restore_path && !vm_restore(&vm, restore_path)) {
+        vm_cleanup(&vm);
+        return 1;
+    }
+    // -t logs every instruction for replay with -T
+    if (trace_path && !trace_start(&vm, trace_path)) {
+        vm_cleanup(&vm);
+        return 1;
+    }
     vm_run(&vm);
+    // -C keeps that many disk sectors in memory, -W caps their readahead
+    if (vm.disk_cache) {
+        const DiskCacheStats* stats = &vm.disk_cache->stats;
+        printf("Disk cache: %llu hits, %llu misses, %llu reads, %llu sectors read ahead\n",
+               (unsigned long long)stats->hits, (unsigned long long)stats->misses,
+               (unsigned long long)stats->reads, (unsigned long long)stats->readahead);
+    }
+    if (trace_path && !trace_stop(&vm)) {
+        vm_cleanup(&vm);
+        return 1;
+    }
+    if ((pairs_out && !cpu_save_pair_profile(&vm.cpu, pairs_out)) ||
+        (report_path && !prof_write_report(vm.cpu.prof, report_path)) ||
+        (folded_path && !prof_write_folded(vm.cpu.prof, folded_path))) {
+        vm_cleanup(&vm);
+        return 1;
+    }
+    if (snapshot_path && !vm_snapshot(&vm, snapshot_path)) {
+        vm_cleanup(&vm);
+        return 1;
+    }
     vm_cleanup(&vm);
 
     return 0;
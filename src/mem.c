@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <mem.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+// memfd-backed images need Linux; other hosts fall back to copying
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+#define MEM_USE_MEMFD 1
+#endif
+
+#ifndef _WIN32
+// Transparent huge pages only need a hint and keep zero-fill lazy
+static void mem_advise(uint8_t* mem, size_t size, int flags) {
+#ifdef MADV_HUGEPAGE
+    if (flags & MEM_HUGE_PAGES) madvise(mem, size, MADV_HUGEPAGE);
+#else
+    (void)mem;
+    (void)size;
+    (void)flags;
+#endif
+}
+#endif
+
+uint8_t* mem_alloc(size_t size, int* flags) {
+#ifndef _WIN32
+    // Large guests reserve address space, not RAM
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    map_flags |= MAP_NORESERVE;
+#endif
+    void* mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Explicit huge pages come from the host's hugetlb pool. They must be
+    // reserved up front, or a short pool turns into SIGBUS on first touch;
+    // when the pool is too small fall back to transparent huge pages.
+    if ((*flags & MEM_HUGE_PAGES) && size % MEM_HUGE_PAGE_SIZE == 0) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            *flags |= MEM_HUGETLB;
+            return mem;
+        }
+    }
+#endif
+    *flags &= ~MEM_HUGETLB;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    mem_advise(mem, size, *flags);
+    return mem;
+#else
+    *flags &= ~MEM_HUGETLB;
+    return calloc(1, size);
+#endif
+}
+
+void mem_reset(uint8_t* mem, size_t size, int flags) {
+#ifndef _WIN32
+    // Replacing a hugetlb mapping would give up the pool's pages; dropping
+    // them keeps the mapping and zero-fills on the next touch
+    if (flags & MEM_HUGETLB) {
+        if (madvise(mem, size, MADV_DONTNEED) != 0) memset(mem, 0, size);
+        return;
+    }
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#ifdef MAP_NORESERVE
+    map_flags |= MAP_NORESERVE;
+#endif
+    if (mmap(mem, size, PROT_READ | PROT_WRITE, map_flags, -1, 0) != MAP_FAILED) {
+        mem_advise(mem, size, flags);
+        return;
+    }
+#else
+    (void)flags;
+#endif
+    memset(mem, 0, size);
+}
+
+void mem_free(uint8_t* mem, size_t size) {
+    if (!mem) return;
+#ifndef _WIN32
+    munmap(mem, size);
+#else
+    (void)size;
+    free(mem);
+#endif
+}
+
+const uint8_t* mem_map_fd(int fd, size_t* size) {
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) return NULL;
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return NULL;
+    *size = st.st_size;
+    return data;
+#else
+    long end = _lseek(fd, 0, SEEK_END);
+    uint8_t* data = end > 0 ? malloc(end) : NULL;
+    if (!data || _lseek(fd, 0, SEEK_SET) != 0 || _read(fd, data, end) != end) {
+        free(data);
+        return NULL;
+    }
+    *size = end;
+    return data;
+#endif
+}
+
+void mem_unmap_file(const uint8_t* data, size_t size) {
+    if (!data) return;
+#ifndef _WIN32
+    munmap((void*)data, size);
+#else
+    (void)size;
+    free((void*)data);
+#endif
+}
+
+MemImage* mem_image_retain(MemImage* image) {
+    atomic_fetch_add(&image->refs, 1);
+    return image;
+}
+
+void mem_image_release(MemImage* image) {
+    if (!image || atomic_fetch_sub(&image->refs, 1) != 1) return;
+#ifdef MEM_USE_MEMFD
+    if (image->fd >= 0) close(image->fd);
+#endif
+    free(image->copy);
+    free(image);
+}
+
+#ifdef MEM_USE_MEMFD
+
+static int mem_page_is_zero(const uint8_t* page) {
+    const uint64_t* words = (const uint64_t*)page;
+    for (size_t i = 0; i < MEM_PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i]) return 0;
+    }
+    return 1;
+}
+
+// Find the next data extent of fd at or after off, [*data, *hole). Filesystems
+// without SEEK_DATA report everything past off as data.
+static int mem_next_extent(int fd, off_t off, off_t size, off_t* data, off_t* hole) {
+    *data = lseek(fd, off, SEEK_DATA);
+    if (*data < 0) {
+        if (errno == ENXIO) return 0;  // No data past off
+        *data = off;
+        *hole = size;
+        return off < size;
+    }
+    *hole = lseek(fd, *data, SEEK_HOLE);
+    if (*hole < 0 || *hole > size) *hole = size;
+    return *data < size;
+}
+
+// Copy [off, end) of one image file into another at the same offset
+static int mem_copy_range(int from, int to, off_t off, off_t end) {
+    while (off < end) {
+        loff_t in = off, out = off;
+        ssize_t n = copy_file_range(from, &in, to, &out, (size_t)(end - off), 0);
+        if (n <= 0) {
+            uint8_t buffer[64 * 1024];
+            size_t chunk = (size_t)(end - off) < sizeof(buffer) ? (size_t)(end - off) : sizeof(buffer);
+            n = pread(from, buffer, chunk, off);
+            if (n <= 0 || pwrite(to, buffer, (size_t)n, off) != n) return 0;
+        }
+        off += n;
+    }
+    return 1;
+}
+
+// Return page to a hole, or write zeros where holes cannot be punched
+static int mem_clear_page(int fd, off_t off) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, MEM_PAGE_SIZE) == 0) {
+        return 1;
+    }
+#endif
+    static const uint8_t zero[MEM_PAGE_SIZE];
+    return pwrite(fd, zero, MEM_PAGE_SIZE, off) == MEM_PAGE_SIZE;
+}
+
+MemImage* mem_freeze(uint8_t* mem, size_t size, MemImage* current,
+                     const uint32_t* dirty, uint32_t num_dirty, int flags) {
+    // Unchanged since the last freeze: every clone can share the same pages
+    if (current && num_dirty == 0) {
+        return current;
+    }
+
+    MemImage* image = calloc(1, sizeof(MemImage));
+    if (!image) return NULL;
+    image->size = size;
+    atomic_init(&image->refs, 1);
+    image->fd = memfd_create("xvm-memory", MFD_CLOEXEC);
+    if (image->fd < 0 || ftruncate(image->fd, size) != 0) {
+        printf("Failed to create memory image\n");
+        mem_image_release(image);
+        return NULL;
+    }
+
+    // Clones still map the previous image, so it is copied rather than
+    // written over; only its data extents, the holes stay holes
+    if (current) {
+        off_t off = 0, data, hole;
+        while (mem_next_extent(current->fd, off, (off_t)size, &data, &hole)) {
+            if (!mem_copy_range(current->fd, image->fd, data, hole)) {
+                printf("Failed to copy memory image\n");
+                mem_image_release(image);
+                return NULL;
+            }
+            off = hole;
+        }
+    }
+
+    // Then the pages written since; zero pages stay holes and cost nothing
+    for (uint32_t i = 0; i < num_dirty; i++) {
+        off_t off = (off_t)dirty[i] * MEM_PAGE_SIZE;
+        int ok;
+        if (mem_page_is_zero(mem + off)) {
+            ok = !current || mem_clear_page(image->fd, off);
+        } else {
+            ok = pwrite(image->fd, mem + off, MEM_PAGE_SIZE, off) == MEM_PAGE_SIZE;
+        }
+        if (!ok) {
+            printf("Failed to write memory image\n");
+            mem_image_release(image);
+            return NULL;
+        }
+    }
+
+    // Same contents, now backed by the image so later clones are free
+    if (!(flags & MEM_HUGETLB) && !mem_map_image(mem, image, flags)) {
+        mem_image_release(image);
+        return NULL;
+    }
+    mem_image_release(current);
+    return image;
+}
+
+// Read the image's data extents into mem; its holes are zero already
+static int mem_copy_image(uint8_t* mem, MemImage* image) {
+    mem_reset(mem, image->size, MEM_HUGETLB);
+    off_t off = 0, data, hole;
+    while (mem_next_extent(image->fd, off, (off_t)image->size, &data, &hole)) {
+        while (data < hole) {
+            ssize_t n = pread(image->fd, mem + data, (size_t)(hole - data), data);
+            if (n <= 0) {
+                printf("Failed to read memory image\n");
+                return 0;
+            }
+            data += n;
+        }
+        off = hole;
+    }
+    return 1;
+}
+
+int mem_map_image(uint8_t* mem, MemImage* image, int flags) {
+    if (flags & MEM_HUGETLB) return mem_copy_image(mem, image);
+    void* view = mmap(mem, image->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, image->fd, 0);
+    if (view == MAP_FAILED) {
+        printf("Failed to map memory image\n");
+        return 0;
+    }
+    return 1;
+}
+
+#else
+
+MemImage* mem_freeze(uint8_t* mem, size_t size, MemImage* current,
+                     const uint32_t* dirty, uint32_t num_dirty, int flags) {
+    (void)dirty;
+    (void)flags;
+    if (current && num_dirty == 0) {
+        return current;
+    }
+    MemImage* image = calloc(1, sizeof(MemImage));
+    if (!image) return NULL;
+    image->fd = -1;
+    image->size = size;
+    atomic_init(&image->refs, 1);
+    image->copy = malloc(size);
+    if (!image->copy) {
+        free(image);
+        return NULL;
+    }
+    memcpy(image->copy, mem, size);
+    mem_image_release(current);
+    return image;
+}
+
+int mem_map_image(uint8_t* mem, MemImage* image, int flags) {
+    (void)flags;
+    memcpy(mem, image->copy, image->size);
+    return 1;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,307 @@
+#include <pool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Per-worker deque: the owner pushes and pops at the tail, thieves take
+// from the head. Tasks are coarse (a whole slice), so a mutex is cheap.
+typedef struct {
+    pthread_mutex_t lock;
+    PoolTask** items;
+    int capacity;
+    int head;
+    int size;
+} PoolDeque;
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool* pool;
+    int index;
+    PoolDeque deque;
+    uint64_t instructions;
+    uint64_t steals;
+    pthread_t thread;
+} PoolWorker;
+
+struct Pool {
+    const PoolConfig* config;
+    PoolTask* tasks;
+    PoolWorker* workers;
+    int num_workers;
+    atomic_int remaining;        // Tasks not yet finished
+};
+
+static int deque_init(PoolDeque* d, int capacity) {
+    d->items = malloc(sizeof(PoolTask*) * capacity);
+    if (!d->items) return 0;
+    pthread_mutex_init(&d->lock, NULL);
+    d->capacity = capacity;
+    d->head = 0;
+    d->size = 0;
+    return 1;
+}
+
+static void deque_destroy(PoolDeque* d) {
+    pthread_mutex_destroy(&d->lock);
+    free(d->items);
+}
+
+static void deque_push(PoolDeque* d, PoolTask* task) {
+    pthread_mutex_lock(&d->lock);
+    d->items[(d->head + d->size) % d->capacity] = task;
+    d->size++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+// Put a task back where the owner reaches it last
+static void deque_push_head(PoolDeque* d, PoolTask* task) {
+    pthread_mutex_lock(&d->lock);
+    d->head = (d->head + d->capacity - 1) % d->capacity;
+    d->items[d->head] = task;
+    d->size++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static PoolTask* deque_pop(PoolDeque* d) {
+    PoolTask* task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->size > 0) {
+        d->size--;
+        task = d->items[(d->head + d->size) % d->capacity];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static PoolTask* deque_steal(PoolDeque* d) {
+    PoolTask* task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->size > 0) {
+        task = d->items[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        d->size--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static int pool_start_task(Pool* pool, PoolTask* task) {
+    VMConfig vm_config = {0};
+    vm_config.headless = 1;
+    vm_config.unthrottled = 1;
+    vm_config.memory_size = pool->config->memory_size;
+    vm_config.huge_pages = pool->config->huge_pages;
+    vm_config.async_disk = pool->config->async_disk;
+    vm_config.disk_cache = pool->config->disk_cache;
+    vm_config.disk_readahead = pool->config->disk_readahead;
+
+    task->vm = malloc(sizeof(VM));
+    if (!task->vm) {
+        printf("Failed to allocate VM for %s\n", task->image);
+        return 0;
+    }
+    if (!vm_init(task->vm, &vm_config)) {
+        printf("Failed to initialize VM for %s\n", task->image);
+        free(task->vm);
+        task->vm = NULL;
+        return 0;
+    }
+    if (!cpu_set_engine(&task->vm->cpu, pool->config->engine) ||
+        !(pool->config->boot ? vm_load_iso(task->vm, task->image) :
+                               cpu_load_program(&task->vm->cpu, task->image))) {
+        vm_cleanup(task->vm);
+        free(task->vm);
+        task->vm = NULL;
+        return 0;
+    }
+    task->vm->running = 1;
+    return 1;
+}
+
+static void pool_finish_task(Pool* pool, PoolTask* task, PoolResult result) {
+    const PoolConfig* config = pool->config;
+    task->result = result;
+    if (task->vm) {
+        if (config->dump_dir) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%d.txt", config->dump_dir,
+                     (int)(task - pool->tasks));
+            vga_dump(&task->vm->vga, path);
+        }
+        vm_cleanup(task->vm);
+        free(task->vm);
+        task->vm = NULL;
+    }
+    atomic_fetch_sub(&pool->remaining, 1);
+}
+
+// Run one slice of a task; returns 1 while the guest has more to do
+static int pool_run_task(PoolWorker* worker, PoolTask* task) {
+    Pool* pool = worker->pool;
+    const PoolConfig* config = pool->config;
+
+    if (config->stop && *config->stop) {
+        pool_finish_task(pool, task, POOL_STOPPED);
+        return 0;
+    }
+    if (!task->vm && !pool_start_task(pool, task)) {
+        pool_finish_task(pool, task, POOL_FAILED);
+        return 0;
+    }
+
+    // A guest blocked on a disk read gets a short wait, then yields the worker
+    VM* vm = task->vm;
+    if (vm_disk_waiting(vm) && !vm_disk_wait(vm, POOL_IDLE_NS)) {
+        return 1;
+    }
+
+    uint64_t budget = POOL_SLICE;
+    if (config->max_instructions) {
+        budget = config->max_instructions - task->instructions;
+        if (budget > POOL_SLICE) budget = POOL_SLICE;
+    }
+
+    uint64_t retired = vm_run_slice(vm, budget);
+    task->instructions += retired;
+    worker->instructions += retired;
+
+    PoolResult result = POOL_PENDING;
+    if (vm->cpu.halted) {
+        result = POOL_HALTED;
+    } else if (vm->idle) {
+        result = POOL_IDLE;
+    } else if (!vm->running) {
+        result = POOL_STOPPED;
+    } else if (config->max_instructions && task->instructions >= config->max_instructions) {
+        result = POOL_LIMIT;
+    }
+
+    if (result != POOL_PENDING) {
+        pool_finish_task(pool, task, result);
+        return 0;
+    }
+    return 1;
+}
+
+static PoolTask* pool_steal(PoolWorker* worker) {
+    Pool* pool = worker->pool;
+    for (int i = 1; i < pool->num_workers; i++) {
+        PoolWorker* victim = &pool->workers[(worker->index + i) % pool->num_workers];
+        PoolTask* task = deque_steal(&victim->deque);
+        if (task) {
+            worker->steals++;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void* pool_worker(void* data) {
+    PoolWorker* worker = data;
+    Pool* pool = worker->pool;
+
+    while (atomic_load(&pool->remaining) > 0) {
+        PoolTask* task = deque_pop(&worker->deque);
+        if (!task) task = pool_steal(worker);
+        if (!task) {
+            // Everything left is being run by other workers right now
+            struct timespec ts = {0, POOL_IDLE_NS};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        // Keep running the same guest while it stays local; it goes back
+        // on the tail, where thieves look last. One waiting for the disk
+        // goes to the head so the worker runs the others meanwhile.
+        if (pool_run_task(worker, task)) {
+            if (vm_disk_waiting(task->vm)) {
+                deque_push_head(&worker->deque, task);
+            } else {
+                deque_push(&worker->deque, task);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Run every task to completion on a pool of worker threads
+int pool_run(PoolTask* tasks, int count, const PoolConfig* config, PoolStats* stats) {
+    Pool pool;
+    int threads = config->threads;
+    if (threads < 1) threads = 1;
+    if (threads > count) threads = count;
+
+    memset(stats, 0, sizeof(PoolStats));
+    if (count <= 0) return 1;
+
+    pool.config = config;
+    pool.tasks = tasks;
+    pool.num_workers = threads;
+    atomic_init(&pool.remaining, count);
+    pool.workers = calloc(threads, sizeof(PoolWorker));
+    if (!pool.workers) {
+        printf("Failed to allocate worker pool\n");
+        return 0;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].index = i;
+        if (!deque_init(&pool.workers[i].deque, count)) {
+            printf("Failed to allocate worker deque\n");
+            for (int j = 0; j < i; j++) deque_destroy(&pool.workers[j].deque);
+            free(pool.workers);
+            return 0;
+        }
+    }
+
+    // Deal the images out round-robin; stealing evens out the rest
+    for (int i = 0; i < count; i++) {
+        tasks[i].vm = NULL;
+        tasks[i].instructions = 0;
+        tasks[i].result = POOL_PENDING;
+        deque_push(&pool.workers[i % threads].deque, &tasks[i]);
+    }
+
+    uint64_t start = vm_now_ns();
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&pool.workers[started].thread, NULL, pool_worker,
+                           &pool.workers[started]) != 0) {
+            printf("Failed to start worker thread %d\n", started);
+            break;
+        }
+    }
+    // Whatever was started still drains every deque by stealing
+    if (started == 0) {
+        pool_worker(&pool.workers[0]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    stats->elapsed_ns = vm_now_ns() - start;
+
+    for (int i = 0; i < threads; i++) {
+        stats->instructions += pool.workers[i].instructions;
+        stats->steals += pool.workers[i].steals;
+        deque_destroy(&pool.workers[i].deque);
+    }
+    free(pool.workers);
+    return 1;
+}
+
+const char* pool_result_name(PoolResult result) {
+    switch (result) {
+        case POOL_PENDING: return "pending";
+        case POOL_HALTED:  return "halted";
+        case POOL_IDLE:    return "idle";
+        case POOL_LIMIT:   return "limit";
+        case POOL_STOPPED: return "stopped";
+        case POOL_FAILED:  return "failed";
+    }
+    return "unknown";
+}
\ No newline at end of file
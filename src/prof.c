@@ -0,0 +1,301 @@
+#include <prof.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t prof_hash(uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(key >> 32);
+}
+
+static int prof_table_grow(ProfTable* t) {
+    uint32_t capacity = t->capacity ? t->capacity * 2 : 1024;
+    uint64_t* keys = calloc(capacity, sizeof(uint64_t));
+    uint64_t* values = calloc(capacity, sizeof(uint64_t));
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return 0;
+    }
+    for (uint32_t i = 0; i < t->capacity; i++) {
+        if (!t->keys[i]) continue;
+        uint32_t j = prof_hash(t->keys[i]) & (capacity - 1);
+        while (keys[j]) j = (j + 1) & (capacity - 1);
+        keys[j] = t->keys[i];
+        values[j] = t->values[i];
+    }
+    free(t->keys);
+    free(t->values);
+    t->keys = keys;
+    t->values = values;
+    t->capacity = capacity;
+    return 1;
+}
+
+// Counter for key, created at zero; NULL when out of memory
+static uint64_t* prof_table_get(ProfTable* t, uint64_t key) {
+    if (t->used * 2 >= t->capacity && !prof_table_grow(t)) return NULL;
+    uint64_t stored = key + 1;
+    uint32_t i = prof_hash(stored) & (t->capacity - 1);
+    while (t->keys[i] != stored) {
+        if (!t->keys[i]) {
+            t->keys[i] = stored;
+            t->used++;
+            break;
+        }
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return &t->values[i];
+}
+
+static void prof_table_free(ProfTable* t) {
+    free(t->keys);
+    free(t->values);
+}
+
+static void prof_fail(Prof* prof) {
+    if (!prof->failed) printf("Profiler out of memory, stopping collection\n");
+    prof->failed = 1;
+}
+
+Prof* prof_create(void) {
+    Prof* prof = calloc(1, sizeof(Prof));
+    if (!prof) return NULL;
+    prof->max_nodes = 64;
+    prof->nodes = calloc(prof->max_nodes, sizeof(ProfNode));
+    if (!prof->nodes) {
+        free(prof);
+        return NULL;
+    }
+    prof->num_nodes = 1;
+    return prof;
+}
+
+void prof_destroy(Prof* prof) {
+    if (!prof) return;
+    prof_table_free(&prof->ips);
+    prof_table_free(&prof->unknown);
+    prof_table_free(&prof->contexts);
+    free(prof->nodes);
+    free(prof);
+}
+
+static void prof_enter(Prof* prof, uint32_t target) {
+    if (prof->depth >= PROF_MAX_DEPTH) {
+        prof->overflow++;
+        return;
+    }
+    uint64_t* slot = prof_table_get(&prof->contexts,
+                                    (uint64_t)prof->current << 32 | target);
+    if (!slot) {
+        prof_fail(prof);
+        return;
+    }
+    if (!*slot) {
+        if (prof->num_nodes == prof->max_nodes) {
+            ProfNode* nodes = realloc(prof->nodes, prof->max_nodes * 2 * sizeof(ProfNode));
+            if (!nodes) {
+                prof_fail(prof);
+                return;
+            }
+            prof->nodes = nodes;
+            prof->max_nodes *= 2;
+        }
+        ProfNode* node = &prof->nodes[prof->num_nodes];
+        node->parent = prof->current;
+        node->addr = target;
+        node->count = 0;
+        *slot = ++prof->num_nodes;
+    }
+    prof->current = (uint32_t)(*slot - 1);
+    prof->depth++;
+}
+
+static void prof_leave(Prof* prof) {
+    if (prof->overflow) {
+        prof->overflow--;
+        return;
+    }
+    // A return past the first context (stack switching, boot code) stays put
+    if (prof->depth == 0) return;
+    prof->current = prof->nodes[prof->current].parent;
+    prof->depth--;
+}
+
+int prof_step(CPU* cpu) {
+    Prof* prof = cpu->prof;
+    uint32_t ip = cpu->ip;
+    uint8_t opcode = cpu_read_byte(cpu, ip);
+    int retired = cpu_emulate_cycle(cpu);
+    if (prof->failed) return retired;
+
+    uint64_t* count = prof_table_get(&prof->ips, ip);
+    if (!count) {
+        prof_fail(prof);
+        return retired;
+    }
+    *count += retired;
+    prof->instructions += retired;
+    prof->opcodes[opcode] += retired;
+    prof->nodes[prof->current].count += retired;
+
+    // Calling contexts follow the control transfers that use the stack
+    switch (opcode) {
+        case 0x60: case 0xE8: case 0xE0:  // CALL imm32, CALL rel16, SYSCALL
+            prof_enter(prof, cpu->ip);
+            break;
+        case 0xCD:                        // INT, when it vectored into guest code
+            if (cpu->ip != ip + 2) prof_enter(prof, cpu->ip);
+            break;
+        case 0x61: case 0xC2: case 0xE1: case 0xCF:  // RET, RET imm16, SYSRET, IRET
+            prof_leave(prof);
+            break;
+    }
+    return retired;
+}
+
+// opcode is the first byte, or first << 8 | second byte for group encodings
+void prof_unknown(Prof* prof, uint32_t opcode) {
+    if (prof->failed) return;
+    uint64_t* count = prof_table_get(&prof->unknown, opcode);
+    if (!count) {
+        prof_fail(prof);
+        return;
+    }
+    (*count)++;
+}
+
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+} ProfEntry;
+
+static int prof_entry_cmp(const void* a, const void* b) {
+    const ProfEntry* ea = a;
+    const ProfEntry* eb = b;
+    if (ea->count != eb->count) return ea->count < eb->count ? 1 : -1;
+    return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
+
+// Table contents, most frequent first
+static ProfEntry* prof_sorted(const ProfTable* t, uint32_t* count) {
+    ProfEntry* entries = malloc((t->used ? t->used : 1) * sizeof(ProfEntry));
+    if (!entries) return NULL;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < t->capacity; i++) {
+        if (!t->keys[i]) continue;
+        entries[n].key = t->keys[i] - 1;
+        entries[n].count = t->values[i];
+        n++;
+    }
+    qsort(entries, n, sizeof(ProfEntry), prof_entry_cmp);
+    *count = n;
+    return entries;
+}
+
+static double prof_percent(const Prof* prof, uint64_t count) {
+    return prof->instructions ? 100.0 * count / prof->instructions : 0.0;
+}
+
+static int prof_report(const Prof* prof, FILE* f) {
+    uint32_t num_ips, num_unknown;
+    ProfEntry* ips = prof_sorted(&prof->ips, &num_ips);
+    ProfEntry* unknown = prof_sorted(&prof->unknown, &num_unknown);
+    if (!ips || !unknown) {
+        free(ips);
+        free(unknown);
+        return 0;
+    }
+
+    fprintf(f, "%llu instructions at %u addresses in %u calling contexts%s\n",
+            (unsigned long long)prof->instructions, num_ips, prof->num_nodes,
+            prof->failed ? " (incomplete, out of memory)" : "");
+
+    fprintf(f, "\nHot spots\n%14s %7s %7s  %-10s\n", "count", "self", "total", "address");
+    double total = 0;
+    for (uint32_t i = 0; i < num_ips && i < PROF_TOP_IPS; i++) {
+        double percent = prof_percent(prof, ips[i].count);
+        total += percent;
+        fprintf(f, "%14llu %6.2f%% %6.2f%%  0x%08llX\n", (unsigned long long)ips[i].count,
+                percent, total, (unsigned long long)ips[i].key);
+    }
+
+    ProfEntry opcodes[256];
+    uint32_t num_opcodes = 0;
+    for (int op = 0; op < 256; op++) {
+        if (!prof->opcodes[op]) continue;
+        opcodes[num_opcodes].key = op;
+        opcodes[num_opcodes].count = prof->opcodes[op];
+        num_opcodes++;
+    }
+    qsort(opcodes, num_opcodes, sizeof(ProfEntry), prof_entry_cmp);
+    fprintf(f, "\nOpcodes\n%14s %7s  %s\n", "count", "share", "opcode");
+    for (uint32_t i = 0; i < num_opcodes; i++) {
+        fprintf(f, "%14llu %6.2f%%  %02llX\n", (unsigned long long)opcodes[i].count,
+                prof_percent(prof, opcodes[i].count), (unsigned long long)opcodes[i].key);
+    }
+
+    if (num_unknown) {
+        fprintf(f, "\nUnknown opcodes\n%14s  %s\n", "count", "opcode");
+        for (uint32_t i = 0; i < num_unknown; i++) {
+            uint64_t op = unknown[i].key;
+            if (op > 0xFF) {
+                fprintf(f, "%14llu  %02llX %02llX\n", (unsigned long long)unknown[i].count,
+                        (unsigned long long)(op >> 8), (unsigned long long)(op & 0xFF));
+            } else {
+                fprintf(f, "%14llu  %02llX\n", (unsigned long long)unknown[i].count,
+                        (unsigned long long)op);
+            }
+        }
+    }
+
+    free(ips);
+    free(unknown);
+    return !ferror(f);
+}
+
+// One line per calling context, "root;0x00001000;0x00002000 count", as
+// consumed by flamegraph.pl and compatible tools
+static int prof_folded(const Prof* prof, FILE* f) {
+    uint32_t path[PROF_MAX_DEPTH + 1];
+    for (uint32_t n = 0; n < prof->num_nodes; n++) {
+        if (!prof->nodes[n].count) continue;
+        uint32_t depth = 0;
+        for (uint32_t node = n; node != 0 && depth < PROF_MAX_DEPTH; node = prof->nodes[node].parent) {
+            path[depth++] = prof->nodes[node].addr;
+        }
+        fputs("root", f);
+        while (depth > 0) {
+            fprintf(f, ";0x%08X", path[--depth]);
+        }
+        fprintf(f, " %llu\n", (unsigned long long)prof->nodes[n].count);
+    }
+    return !ferror(f);
+}
+
+static int prof_write(const Prof* prof, const char* path,
+                      int (*write)(const Prof* prof, FILE* f)) {
+    if (strcmp(path, "-") == 0) {
+        int ok = write(prof, stdout);
+        fflush(stdout);
+        return ok;
+    }
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        printf("Failed to create profile: %s\n", path);
+        return 0;
+    }
+    int ok = write(prof, f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        printf("Failed to write profile: %s\n", path);
+    }
+    return ok;
+}
+
+int prof_write_report(const Prof* prof, const char* path) {
+    return prof_write(prof, path, prof_report);
+}
+
+int prof_write_folded(const Prof* prof, const char* path) {
+    return prof_write(prof, path, prof_folded);
+}
\ No newline at end of file
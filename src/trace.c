@@ -0,0 +1,383 @@
+#include <trace.h>
+#include <prof.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Trace layout:
+//   header   "XVMT", version, memory size (little-endian)
+//   disk     path length and absolute path of the disk image, length 0 when
+//            none is attached
+//   state    a complete snapshot of the guest when recording started,
+//            including what it wrote to the disk
+//   records  one per instruction until end of file:
+//              opcode byte
+//              varint mask of what changed, bit n for register n, bit 8 flags
+//              zigzag varint ip after - ip before
+//              zigzag varint new - old for each changed register, lowest first
+//              varint new ^ old flags, when they changed
+// A straight-line instruction touching one register takes four bytes.
+#define TRACE_MAGIC "XVMT"
+#define TRACE_VERSION 2
+#define TRACE_FLAGS_CHANGED (1 << 8)
+
+static uint8_t* trace_put_varint(uint8_t* p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// Small differences of either sign encode in one byte
+static uint32_t trace_zigzag(uint32_t delta) {
+    return (delta << 1) ^ (uint32_t)-(int32_t)(delta >> 31);
+}
+
+static uint32_t trace_unzigzag(uint32_t v) {
+    return (v >> 1) ^ (uint32_t)-(int32_t)(v & 1);
+}
+
+static int trace_get_varint(FILE* f, uint32_t* v) {
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = getc(f);
+        if (c == EOF) return 0;
+        value |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *v = value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int trace_put_u32(FILE* f, uint32_t v) {
+    uint8_t b[4] = {v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24};
+    return fwrite(b, 1, 4, f) == 4;
+}
+
+static int trace_get_u32(FILE* f, uint32_t* v) {
+    uint8_t b[4];
+    if (fread(b, 1, 4, f) != 4) return 0;
+    *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    return 1;
+}
+
+// The image path resolved now, so replay works from another directory
+static int trace_put_disk(FILE* f, const VM* vm) {
+    if (!vm->disk_data) return trace_put_u32(f, 0);
+    char* path = realpath(vm->disk_path, NULL);
+    const char* name = path ? path : vm->disk_path;
+    size_t length = strlen(name);
+    int ok = trace_put_u32(f, (uint32_t)length) && fwrite(name, 1, length, f) == length;
+    free(path);
+    return ok;
+}
+
+// Boot the disk the trace was recorded with, so its snapshot can restore
+static int trace_get_disk(VM* vm, FILE* f) {
+    uint32_t length;
+    if (!trace_get_u32(f, &length) || length >= PATH_MAX) {
+        printf("Corrupt trace header\n");
+        return 0;
+    }
+    if (length == 0) return 1;
+    char path[PATH_MAX];
+    if (fread(path, 1, length, f) != length) {
+        printf("Corrupt trace header\n");
+        return 0;
+    }
+    path[length] = '\0';
+    return vm_load_iso(vm, path);
+}
+
+static void* trace_writer(void* arg) {
+    Trace* trace = arg;
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        while (!trace->pending && !trace->stop) {
+            pthread_cond_wait(&trace->cond, &trace->lock);
+        }
+        if (!trace->pending) break;
+
+        // The recorder only touches the other buffer meanwhile
+        uint8_t* data = trace->pending;
+        size_t size = trace->pending_size;
+        pthread_mutex_unlock(&trace->lock);
+        int ok = fwrite(data, 1, size, trace->file) == size;
+        pthread_mutex_lock(&trace->lock);
+
+        if (!ok) trace->failed = 1;
+        trace->pending = NULL;
+        pthread_cond_broadcast(&trace->cond);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+// Hand the current buffer to the writer and continue in the other one
+static void trace_flush(Trace* trace) {
+    pthread_mutex_lock(&trace->lock);
+    while (trace->pending) {
+        pthread_cond_wait(&trace->cond, &trace->lock);
+    }
+    trace->pending = trace->buffers[trace->current];
+    trace->pending_size = trace->used;
+    pthread_cond_broadcast(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+    trace->current ^= 1;
+    trace->used = 0;
+}
+
+static void trace_free(Trace* trace) {
+    if (trace->file) fclose(trace->file);
+    free(trace->buffers[0]);
+    free(trace->buffers[1]);
+    free(trace);
+}
+
+int trace_start(VM* vm, const char* path) {
+    if (vm->cpu.trace) {
+        printf("Already tracing\n");
+        return 0;
+    }
+    Trace* trace = calloc(1, sizeof(Trace));
+    if (!trace) {
+        printf("Failed to allocate trace\n");
+        return 0;
+    }
+    trace->buffers[0] = malloc(TRACE_BUFFER_SIZE);
+    trace->buffers[1] = malloc(TRACE_BUFFER_SIZE);
+    if (!trace->buffers[0] || !trace->buffers[1]) {
+        printf("Failed to allocate trace\n");
+        trace_free(trace);
+        return 0;
+    }
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        printf("Failed to create trace: %s\n", path);
+        trace_free(trace);
+        return 0;
+    }
+
+    // The writer thread has not started, so the header can go straight out
+    if (fwrite(TRACE_MAGIC, 1, 4, trace->file) != 4 ||
+        !trace_put_u32(trace->file, TRACE_VERSION) ||
+        !trace_put_u32(trace->file, vm->cpu.memory_size) ||
+        !trace_put_disk(trace->file, vm) ||
+        !vm_snapshot_write(vm, trace->file)) {
+        printf("Failed to write trace: %s\n", path);
+        trace_free(trace);
+        remove(path);
+        return 0;
+    }
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->cond, NULL);
+    if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+        printf("Failed to start trace writer\n");
+        pthread_cond_destroy(&trace->cond);
+        pthread_mutex_destroy(&trace->lock);
+        trace_free(trace);
+        remove(path);
+        return 0;
+    }
+
+    // One record per instruction, so superinstructions are split up again;
+    // disk reads complete inside their INT, as they will on replay
+    cpu_set_fusions(&vm->cpu, 0);
+    trace->async_disk = vm->async_disk;
+    vm->async_disk = 0;
+    vm->cpu.trace = trace;
+    return 1;
+}
+
+// Detach the recorder and write out everything buffered
+int trace_stop(VM* vm) {
+    Trace* trace = vm->cpu.trace;
+    if (!trace) return 1;
+    vm->cpu.trace = NULL;
+    vm->async_disk = trace->async_disk;
+
+    if (trace->used) trace_flush(trace);
+    pthread_mutex_lock(&trace->lock);
+    trace->stop = 1;
+    pthread_cond_broadcast(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+    pthread_cond_destroy(&trace->cond);
+    pthread_mutex_destroy(&trace->lock);
+
+    int ok = !trace->failed && fflush(trace->file) == 0;
+    ok = fclose(trace->file) == 0 && ok;
+    trace->file = NULL;
+    if (!ok) {
+        printf("Failed to write trace, %llu instructions recorded\n",
+               (unsigned long long)trace->records);
+    }
+    trace_free(trace);
+    return ok;
+}
+
+int trace_step(CPU* cpu) {
+    Trace* trace = cpu->trace;
+    uint32_t regs[8];
+    memcpy(regs, cpu->registers, sizeof(regs));
+    uint32_t ip = cpu->ip;
+    uint32_t flags = cpu_get_flags(cpu);
+    uint8_t opcode = cpu_read_byte(cpu, ip);
+
+    int retired = cpu->prof ? prof_step(cpu) : cpu_emulate_cycle(cpu);
+
+    if (trace->used > TRACE_BUFFER_SIZE - TRACE_MAX_RECORD) trace_flush(trace);
+    uint8_t* start = trace->buffers[trace->current] + trace->used;
+    uint8_t* p = start;
+    *p++ = opcode;
+
+    uint32_t mask = 0;
+    for (int i = 0; i < 8; i++) {
+        if (cpu->registers[i] != regs[i]) mask |= 1u << i;
+    }
+    uint32_t new_flags = cpu_get_flags(cpu);
+    if (new_flags != flags) mask |= TRACE_FLAGS_CHANGED;
+
+    p = trace_put_varint(p, mask);
+    p = trace_put_varint(p, trace_zigzag(cpu->ip - ip));
+    for (int i = 0; i < 8; i++) {
+        if (mask & (1u << i)) {
+            p = trace_put_varint(p, trace_zigzag(cpu->registers[i] - regs[i]));
+        }
+    }
+    if (mask & TRACE_FLAGS_CHANGED) {
+        p = trace_put_varint(p, new_flags ^ flags);
+    }
+
+    trace->used += p - start;
+    trace->records++;
+    return retired;
+}
+
+static void trace_diverged(uint64_t index, uint32_t ip, const char* what,
+                           uint32_t traced, uint32_t replayed) {
+    printf("Divergence at instruction %llu (ip 0x%08X): %s traced 0x%08X, "
+           "replayed 0x%08X\n", (unsigned long long)index, ip, what, traced, replayed);
+}
+
+// Returns 1 when the replay matched the trace
+static int trace_run(VM* vm, FILE* f) {
+    CPU* cpu = &vm->cpu;
+    char name[16];
+    uint64_t index = 0;
+
+    for (;; index++) {
+        int opcode = getc(f);
+        if (opcode == EOF) break;
+        uint32_t mask, ip_delta;
+        if (!trace_get_varint(f, &mask) || !trace_get_varint(f, &ip_delta)) {
+            printf("Truncated trace at instruction %llu\n", (unsigned long long)index);
+            return 0;
+        }
+
+        if (cpu->halted) {
+            printf("Divergence at instruction %llu (ip 0x%08X): replay halted\n",
+                   (unsigned long long)index, cpu->ip);
+            return 0;
+        }
+        uint32_t regs[8];
+        memcpy(regs, cpu->registers, sizeof(regs));
+        uint32_t ip = cpu->ip;
+        uint32_t flags = cpu_get_flags(cpu);
+        uint8_t replayed_opcode = cpu_read_byte(cpu, ip);
+        if (replayed_opcode != opcode) {
+            trace_diverged(index, ip, "opcode", opcode, replayed_opcode);
+            return 0;
+        }
+
+        cpu_emulate_cycle(cpu);
+
+        uint32_t expected_ip = ip + trace_unzigzag(ip_delta);
+        if (cpu->ip != expected_ip) {
+            trace_diverged(index, ip, "next ip", expected_ip, cpu->ip);
+            return 0;
+        }
+        for (int i = 0; i < 8; i++) {
+            uint32_t expected = regs[i];
+            if (mask & (1u << i)) {
+                uint32_t delta;
+                if (!trace_get_varint(f, &delta)) {
+                    printf("Truncated trace at instruction %llu\n", (unsigned long long)index);
+                    return 0;
+                }
+                expected += trace_unzigzag(delta);
+            }
+            if (cpu->registers[i] != expected) {
+                snprintf(name, sizeof(name), "register %d", i);
+                trace_diverged(index, ip, name, expected, cpu->registers[i]);
+                return 0;
+            }
+        }
+        uint32_t expected_flags = flags;
+        if (mask & TRACE_FLAGS_CHANGED) {
+            uint32_t change;
+            if (!trace_get_varint(f, &change)) {
+                printf("Truncated trace at instruction %llu\n", (unsigned long long)index);
+                return 0;
+            }
+            expected_flags ^= change;
+        }
+        if (cpu_get_flags(cpu) != expected_flags) {
+            trace_diverged(index, ip, "flags", expected_flags, cpu_get_flags(cpu));
+            return 0;
+        }
+    }
+
+    printf("Replayed %llu instructions without divergence\n", (unsigned long long)index);
+    return 1;
+}
+
+int trace_replay(const char* path, const VMConfig* config) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        printf("Failed to open trace: %s\n", path);
+        return 0;
+    }
+    setvbuf(f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    char magic[4];
+    uint32_t version, memory_size;
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+        !trace_get_u32(f, &version) || !trace_get_u32(f, &memory_size)) {
+        printf("Not a trace file: %s\n", path);
+        fclose(f);
+        return 0;
+    }
+    if (version != TRACE_VERSION) {
+        printf("Unsupported trace version %u\n", version);
+        fclose(f);
+        return 0;
+    }
+
+    // The replay VM matches the recorded one; it never shows a display
+    VMConfig replay_config = *config;
+    replay_config.memory_size = memory_size;
+    replay_config.headless = 1;
+    replay_config.shm_name = NULL;
+    replay_config.async_disk = 0;
+    replay_config.disk_overlay = NULL;  // The snapshot brings the guest's writes
+    VM* vm = calloc(1, sizeof(VM));
+    if (!vm || !vm_init(vm, &replay_config)) {
+        printf("Failed to initialize VM\n");
+        free(vm);
+        fclose(f);
+        return 0;
+    }
+    cpu_set_fusions(&vm->cpu, 0);
+
+    int ok = trace_get_disk(vm, f) && vm_snapshot_read(vm, f) && trace_run(vm, f);
+    vm_cleanup(vm);
+    free(vm);
+    fclose(f);
+    return ok;
+}
\ No newline at end of file
@@ -1,62 +1,66 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <vga.h>
 
-// Standard VGA color palette (16 colors)
-static const SDL_Color vga_palette[16] = {
-    {0,   0,   0,   255},  // 0: Black
-    {0,   0,   170, 255},  // 1: Blue
-    {0,   170, 0,   255},  // 2: Green
-    {0,   170, 170, 255},  // 3: Cyan
-    {170, 0,   0,   255},  // 4: Red
-    {170, 0,   170, 255},  // 5: Magenta
-    {170, 85,  0,   255},  // 6: Brown
-    {170, 170, 170, 255},  // 7: Light Gray
-    {85,  85,  85,  255},  // 8: Dark Gray
-    {85,  85,  255, 255},  // 9: Light Blue
-    {85,  255, 85,  255},  // 10: Light Green
-    {85,  255, 255, 255},  // 11: Light Cyan
-    {255, 85,  85,  255},  // 12: Light Red
-    {255, 85,  255, 255},  // 13: Light Magenta
-    {255, 255, 85,  255},  // 14: Yellow
-    {255, 255, 255, 255}   // 15: White
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Code page 437 to Unicode
+const uint16_t vga_cp437[256] = {
+    0x0000, 0x263A, 0x263B, 0x2665, 0x2666, 0x2663, 0x2660, 0x2022,
+    0x25D8, 0x25CB, 0x25D9, 0x2642, 0x2640, 0x266A, 0x266B, 0x263C,
+    0x25BA, 0x25C4, 0x2195, 0x203C, 0x00B6, 0x00A7, 0x25AC, 0x21A8,
+    0x2191, 0x2193, 0x2192, 0x2190, 0x221F, 0x2194, 0x25B2, 0x25BC,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x005F,
+    0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x007B, 0x007C, 0x007D, 0x007E, 0x2302,
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+    0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+    0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+    0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+    0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F,
+    0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B,
+    0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4,
+    0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248,
+    0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0
 };
 
-int vga_init(VGA* vga) {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        printf("SDL initialization failed: %s\n", SDL_GetError());
-        return 0;
-    }
-
-    if (TTF_Init() < 0) {
-        printf("TTF initialization failed: %s\n", TTF_GetError());
-        return 0;
-    }
-
-    vga->window = SDL_CreateWindow("VM VGA Display",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        WINDOW_WIDTH, WINDOW_HEIGHT,
-        SDL_WINDOW_SHOWN);
-
-    if (!vga->window) {
-        printf("Window creation failed: %s\n", SDL_GetError());
-        return 0;
-    }
-
-    vga->renderer = SDL_CreateRenderer(vga->window, -1,
-        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-
-    if (!vga->renderer) {
-        printf("Renderer creation failed: %s\n", SDL_GetError());
-        return 0;
-    }
-
-    vga->font = TTF_OpenFont("fonts/Perfect_DOS_VGA.ttf", CHAR_HEIGHT);
-
+int vga_init(VGA* vga, int headless) {
     memset(vga->screen, 0, sizeof(vga->screen));
+    vga->dirty_rows = 0;
     vga->cursor_x = 0;
     vga->cursor_y = 0;
-
+    vga->display = NULL;
+    vga->shm = NULL;
+    vga->shm_name = NULL;
+
+    // Headless guests never touch SDL at all
+    if (!headless) {
+        vga->display = vga_display_open();
+        if (!vga->display) {
+            return 0;
+        }
+    }
     return 1;
 }
 
@@ -67,43 +71,36 @@ void vga_scroll_up(VGA* vga) {
     }
     // Clear bottom line
     memset(&vga->screen[VGA_HEIGHT - 1], 0, sizeof(VGACell) * VGA_WIDTH);
+    vga->dirty_rows = VGA_ALL_ROWS;
 }
 
-void vga_update(VGA* vga) {
-    SDL_SetRenderDrawColor(vga->renderer, 0, 0, 0, 255);
-    SDL_RenderClear(vga->renderer);
+static void vga_publish_shm(VGA* vga) {
+    VGAShm* shm = vga->shm;
+    unsigned seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+    atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(shm->cells, vga->screen, sizeof(vga->screen));
+    shm->cursor_x = vga->cursor_x;
+    shm->cursor_y = vga->cursor_y;
+    atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
 
-    char text[2] = {0, 0};
-    SDL_Surface* surface;
-    SDL_Texture* texture;
-    SDL_Rect destRect = {0, 0, CHAR_WIDTH, CHAR_HEIGHT};
+// Publish changed rows to the display and the shared-memory export
+void vga_update(VGA* vga) {
+    if (!vga->dirty_rows) return;
 
-    for (int y = 0; y < VGA_HEIGHT; y++) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            VGACell* cell = &vga->screen[y][x];
-            text[0] = cell->character;
-
-            if (text[0] != 0) {
-                uint8_t fg = cell->attribute & 0x0F;
-                uint8_t bg = (cell->attribute >> 4) & 0x0F;
-                
-                SDL_Color fgColor = vga_palette[fg];
-                SDL_Color bgColor = vga_palette[bg];
-
-                surface = TTF_RenderText_Shaded(vga->font, text, fgColor, bgColor);
-                if (surface) {
-                    texture = SDL_CreateTextureFromSurface(vga->renderer, surface);
-                    destRect.x = x * CHAR_WIDTH;
-                    destRect.y = y * CHAR_HEIGHT;
-                    SDL_RenderCopy(vga->renderer, texture, NULL, &destRect);
-                    SDL_DestroyTexture(texture);
-                    SDL_FreeSurface(surface);
-                }
-            }
-        }
+    if (vga->shm) {
+        vga_publish_shm(vga);
     }
+    if (vga->display) {
+        vga_display_publish(vga->display, vga->screen, vga->dirty_rows);
+    }
+    vga->dirty_rows = 0;
+}
 
-    SDL_RenderPresent(vga->renderer);
+// Returns 0 once the user asked to close the display
+int vga_poll_events(VGA* vga) {
+    return vga->display ? vga_display_poll(vga->display) : 1;
 }
 
 void vga_write_memory(VGA* vga, uint32_t address, uint8_t value) {
@@ -113,18 +110,125 @@ void vga_write_memory(VGA* vga, uint32_t address, uint8_t value) {
         int y = cell_index / VGA_WIDTH;
         int x = cell_index % VGA_WIDTH;
         
-        if (offset % 2 == 0) {
-            vga->screen[y][x].character = value;
-        } else {
-            vga->screen[y][x].attribute = value;
+        uint8_t* byte = (offset % 2 == 0) ?
+            &vga->screen[y][x].character : &vga->screen[y][x].attribute;
+        if (*byte != value) {
+            *byte = value;
+            vga->dirty_rows |= 1u << y;
+        }
+    }
+}
+
+static int vga_put_utf8(uint16_t c, FILE* out) {
+    if (c < 0x80) {
+        return fputc(c, out) != EOF;
+    }
+    if (c < 0x800) {
+        return fputc(0xC0 | (c >> 6), out) != EOF &&
+               fputc(0x80 | (c & 0x3F), out) != EOF;
+    }
+    return fputc(0xE0 | (c >> 12), out) != EOF &&
+           fputc(0x80 | ((c >> 6) & 0x3F), out) != EOF &&
+           fputc(0x80 | (c & 0x3F), out) != EOF;
+}
+
+// Write the text screen as UTF-8, one line per row, trailing blanks trimmed
+int vga_dump_text(VGA* vga, FILE* out) {
+    for (int y = 0; y < VGA_HEIGHT; y++) {
+        int end = VGA_WIDTH;
+        while (end > 0 && (vga->screen[y][end - 1].character == 0 ||
+                           vga->screen[y][end - 1].character == ' ')) {
+            end--;
+        }
+        for (int x = 0; x < end; x++) {
+            uint8_t c = vga->screen[y][x].character;
+            if (!vga_put_utf8(c ? vga_cp437[c] : ' ', out)) return 0;
         }
+        if (fputc('\n', out) == EOF) return 0;
+    }
+    return 1;
+}
+
+// Dump the screen to a file, or to stdout when path is "-"
+int vga_dump(VGA* vga, const char* path) {
+    if (strcmp(path, "-") == 0) {
+        int ok = vga_dump_text(vga, stdout);
+        fflush(stdout);
+        return ok;
+    }
+
+    // Write beside the target and rename, so readers never see a partial dump
+    size_t len = strlen(path) + 5;
+    char* tmp = malloc(len);
+    if (!tmp) return 0;
+    snprintf(tmp, len, "%s.tmp", path);
+
+    FILE* file = fopen(tmp, "w");
+    if (!file) {
+        printf("Failed to open screen dump: %s\n", tmp);
+        free(tmp);
+        return 0;
+    }
+    int ok = vga_dump_text(vga, file);
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        printf("Failed to write screen dump: %s\n", path);
+        remove(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+// Mirror the screen into a POSIX shared-memory object on every update
+int vga_export_shm(VGA* vga, const char* name) {
+#ifndef _WIN32
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("Failed to open shared memory: %s\n", name);
+        return 0;
+    }
+    if (ftruncate(fd, sizeof(VGAShm)) != 0) {
+        printf("Failed to size shared memory: %s\n", name);
+        close(fd);
+        shm_unlink(name);
+        return 0;
+    }
+    VGAShm* shm = mmap(NULL, sizeof(VGAShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        printf("Failed to map shared memory: %s\n", name);
+        shm_unlink(name);
+        return 0;
     }
+
+    shm->magic = VGA_SHM_MAGIC;
+    shm->width = VGA_WIDTH;
+    shm->height = VGA_HEIGHT;
+    atomic_init(&shm->seq, 0);
+    vga->shm = shm;
+    vga->shm_name = strdup(name);
+    vga_publish_shm(vga);
+    return 1;
+#else
+    (void)vga;
+    printf("Shared-memory export is not supported on this platform: %s\n", name);
+    return 0;
+#endif
 }
 
 void vga_cleanup(VGA* vga) {
-    if (vga->font) TTF_CloseFont(vga->font);
-    if (vga->renderer) SDL_DestroyRenderer(vga->renderer);
-    if (vga->window) SDL_DestroyWindow(vga->window);
-    TTF_Quit();
-    SDL_Quit();
+    if (vga->display) {
+        vga_display_close(vga->display);
+        vga->display = NULL;
+    }
+#ifndef _WIN32
+    if (vga->shm) {
+        munmap(vga->shm, sizeof(VGAShm));
+        shm_unlink(vga->shm_name);
+        vga->shm = NULL;
+    }
+#endif
+    free(vga->shm_name);
+    vga->shm_name = NULL;
 }
\ No newline at end of file
@@ -0,0 +1,344 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vga.h>
+
+#ifndef XVM_NO_SDL
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+
+// Glyph atlas: 16x16 code-page glyphs plus one row holding a solid cell
+#define ATLAS_COLUMNS 16
+#define ATLAS_WIDTH (ATLAS_COLUMNS * CHAR_WIDTH)
+#define ATLAS_HEIGHT ((256 / ATLAS_COLUMNS + 1) * CHAR_HEIGHT)
+#define ATLAS_SOLID_Y (256 / ATLAS_COLUMNS * CHAR_HEIGHT)
+
+struct VGADisplay {
+    // Snapshot handed to the render thread, guarded by a seqlock
+    VGACell snapshot[VGA_HEIGHT][VGA_WIDTH];
+    atomic_uint snapshot_seq; // Odd while the CPU thread is copying
+    atomic_uint snapshot_dirty;  // Rows published but not yet rendered
+    SDL_sem* wake;
+    SDL_sem* started;
+    SDL_Thread* render_thread;
+    atomic_int quit;
+    int render_ok;
+
+    SDL_Window* window;
+    SDL_Renderer* renderer;   // Owned by the render thread
+    SDL_Surface* atlas_surface;  // Rasterized at open, uploaded by the render thread
+    SDL_Texture* atlas;
+    SDL_Texture* frame;       // Persistent framebuffer, only dirty rows are redrawn
+    SDL_Vertex* vertices;     // Two quads per cell, one batch per frame
+    int* indices;
+    TTF_Font* font;
+};
+
+// Standard VGA color palette (16 colors)
+static const SDL_Color vga_palette[16] = {
+    {0,   0,   0,   255},  // 0: Black
+    {0,   0,   170, 255},  // 1: Blue
+    {0,   170, 0,   255},  // 2: Green
+    {0,   170, 170, 255},  // 3: Cyan
+    {170, 0,   0,   255},  // 4: Red
+    {170, 0,   170, 255},  // 5: Magenta
+    {170, 85,  0,   255},  // 6: Brown
+    {170, 170, 170, 255},  // 7: Light Gray
+    {85,  85,  85,  255},  // 8: Dark Gray
+    {85,  85,  255, 255},  // 9: Light Blue
+    {85,  255, 85,  255},  // 10: Light Green
+    {85,  255, 255, 255},  // 11: Light Cyan
+    {255, 85,  85,  255},  // 12: Light Red
+    {255, 85,  255, 255},  // 13: Light Magenta
+    {255, 255, 85,  255},  // 14: Yellow
+    {255, 255, 255, 255}   // 15: White
+};
+
+// Rasterize every glyph once, white on transparent, for color modulation
+static SDL_Surface* vga_build_atlas(TTF_Font* font) {
+    SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH, ATLAS_HEIGHT,
+        32, SDL_PIXELFORMAT_RGBA32);
+    if (!atlas) return NULL;
+
+    SDL_FillRect(atlas, NULL, SDL_MapRGBA(atlas->format, 255, 255, 255, 0));
+    SDL_Rect solid = {0, ATLAS_SOLID_Y, CHAR_WIDTH, CHAR_HEIGHT};
+    SDL_FillRect(atlas, &solid, SDL_MapRGBA(atlas->format, 255, 255, 255, 255));
+
+    SDL_Color white = {255, 255, 255, 255};
+    for (int c = 1; c < 256 && font; c++) {
+        SDL_Surface* glyph = TTF_RenderGlyph_Blended(font, vga_cp437[c], white);
+        if (!glyph) continue;
+
+        SDL_Rect src = {0, 0, glyph->w < CHAR_WIDTH ? glyph->w : CHAR_WIDTH,
+                        glyph->h < CHAR_HEIGHT ? glyph->h : CHAR_HEIGHT};
+        SDL_Rect dst = {(c % ATLAS_COLUMNS) * CHAR_WIDTH,
+                        (c / ATLAS_COLUMNS) * CHAR_HEIGHT, 0, 0};
+        SDL_SetSurfaceBlendMode(glyph, SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(glyph, &src, atlas, &dst);
+        SDL_FreeSurface(glyph);
+    }
+    return atlas;
+}
+
+static SDL_Vertex* vga_push_quad(SDL_Vertex* v, float x, float y, SDL_Color color,
+                                 float u0, float v0, float u1, float v1) {
+    const float w = CHAR_WIDTH, h = CHAR_HEIGHT;
+    v[0] = (SDL_Vertex){{x, y}, color, {u0, v0}};
+    v[1] = (SDL_Vertex){{x + w, y}, color, {u1, v0}};
+    v[2] = (SDL_Vertex){{x + w, y + h}, color, {u1, v1}};
+    v[3] = (SDL_Vertex){{x, y + h}, color, {u0, v1}};
+    return v + 4;
+}
+
+// Redraw the dirty rows into the framebuffer texture, then present it
+static void vga_draw(VGADisplay* d, VGACell screen[VGA_HEIGHT][VGA_WIDTH], uint32_t dirty) {
+    // Backgrounds sample the solid cell so everything goes out in one batch
+    const float su = (CHAR_WIDTH / 2.0f) / ATLAS_WIDTH;
+    const float sv = (ATLAS_SOLID_Y + CHAR_HEIGHT / 2.0f) / ATLAS_HEIGHT;
+    const float gw = (float)CHAR_WIDTH / ATLAS_WIDTH;
+    const float gh = (float)CHAR_HEIGHT / ATLAS_HEIGHT;
+    SDL_Vertex* v = d->vertices;
+
+    SDL_SetRenderTarget(d->renderer, d->frame);
+    SDL_SetRenderDrawColor(d->renderer, 0, 0, 0, 255);
+
+    for (int y = 0; y < VGA_HEIGHT; y++) {
+        if (!(dirty & (1u << y))) continue;
+
+        SDL_Rect row = {0, y * CHAR_HEIGHT, WINDOW_WIDTH, CHAR_HEIGHT};
+        SDL_RenderFillRect(d->renderer, &row);
+
+        for (int x = 0; x < VGA_WIDTH; x++) {
+            VGACell* cell = &screen[y][x];
+            if (cell->character == 0) continue;
+
+            float px = x * CHAR_WIDTH, py = y * CHAR_HEIGHT;
+            float u = (cell->character % ATLAS_COLUMNS) * gw;
+            float t = (cell->character / ATLAS_COLUMNS) * gh;
+            v = vga_push_quad(v, px, py, vga_palette[(cell->attribute >> 4) & 0x0F],
+                              su, sv, su, sv);
+            v = vga_push_quad(v, px, py, vga_palette[cell->attribute & 0x0F],
+                              u, t, u + gw, t + gh);
+        }
+    }
+
+    int quads = (int)(v - d->vertices) / 4;
+    if (quads > 0) {
+        SDL_RenderGeometry(d->renderer, d->atlas, d->vertices, quads * 4,
+                           d->indices, quads * 6);
+    }
+
+    SDL_SetRenderTarget(d->renderer, NULL);
+    SDL_RenderCopy(d->renderer, d->frame, NULL, NULL);
+
+    // Only this thread ever waits on vsync
+    SDL_RenderPresent(d->renderer);
+}
+
+// Copy the latest published snapshot; retries while the CPU thread writes
+static unsigned vga_read_snapshot(VGADisplay* d, VGACell out[VGA_HEIGHT][VGA_WIDTH]) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&d->snapshot_seq, memory_order_acquire);
+        if (before & 1) continue;
+        memcpy(out, d->snapshot, sizeof(d->snapshot));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&d->snapshot_seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return before;
+}
+
+static int vga_render_thread(void* data) {
+    VGADisplay* d = data;
+    VGACell frame[VGA_HEIGHT][VGA_WIDTH];
+
+    // The renderer belongs to the thread that uses it
+    d->renderer = SDL_CreateRenderer(d->window, -1,
+        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC |
+        SDL_RENDERER_TARGETTEXTURE);
+    if (!d->renderer) {
+        printf("Renderer creation failed: %s\n", SDL_GetError());
+    }
+    if (d->renderer) {
+        d->atlas = SDL_CreateTextureFromSurface(d->renderer, d->atlas_surface);
+        if (!d->atlas) {
+            printf("Glyph atlas upload failed: %s\n", SDL_GetError());
+        } else {
+            SDL_SetTextureBlendMode(d->atlas, SDL_BLENDMODE_BLEND);
+        }
+    }
+    if (d->renderer) {
+        d->frame = SDL_CreateTexture(d->renderer, SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_TARGET, WINDOW_WIDTH, WINDOW_HEIGHT);
+        if (!d->frame) {
+            printf("Framebuffer texture creation failed: %s\n", SDL_GetError());
+        }
+    }
+    d->render_ok = d->renderer && d->atlas && d->frame;
+    SDL_SemPost(d->started);
+    if (!d->render_ok) return 0;
+
+    memset(frame, 0, sizeof(frame));
+    vga_draw(d, frame, VGA_ALL_ROWS);
+
+    while (!atomic_load(&d->quit)) {
+        SDL_SemWaitTimeout(d->wake, 100);
+
+        // Claim the dirty rows before copying, so rows published meanwhile
+        // are picked up on the next pass at the latest
+        uint32_t dirty = atomic_exchange(&d->snapshot_dirty, 0);
+        if (!dirty) continue;
+        vga_read_snapshot(d, frame);
+        vga_draw(d, frame, dirty);
+    }
+
+    SDL_DestroyTexture(d->frame);
+    SDL_DestroyTexture(d->atlas);
+    SDL_DestroyRenderer(d->renderer);
+    d->frame = NULL;
+    d->atlas = NULL;
+    d->renderer = NULL;
+    return 0;
+}
+
+VGADisplay* vga_display_open(void) {
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        printf("SDL initialization failed: %s\n", SDL_GetError());
+        return NULL;
+    }
+
+    if (TTF_Init() < 0) {
+        printf("TTF initialization failed: %s\n", TTF_GetError());
+        SDL_Quit();
+        return NULL;
+    }
+
+    VGADisplay* d = calloc(1, sizeof(VGADisplay));
+    if (!d) {
+        printf("Failed to allocate display\n");
+        vga_display_close(d);
+        return NULL;
+    }
+
+    d->window = SDL_CreateWindow("VM VGA Display",
+        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        WINDOW_WIDTH, WINDOW_HEIGHT,
+        SDL_WINDOW_SHOWN);
+
+    if (!d->window) {
+        printf("Window creation failed: %s\n", SDL_GetError());
+        vga_display_close(d);
+        return NULL;
+    }
+
+    d->font = TTF_OpenFont("fonts/vga.ttf", CHAR_HEIGHT);
+    if (!d->font) {
+        printf("Font loading failed: %s\n", TTF_GetError());
+    }
+
+    d->atlas_surface = vga_build_atlas(d->font);
+    d->vertices = malloc(sizeof(SDL_Vertex) * VGA_WIDTH * VGA_HEIGHT * 8);
+    d->indices = malloc(sizeof(int) * VGA_WIDTH * VGA_HEIGHT * 12);
+    if (!d->atlas_surface || !d->vertices || !d->indices) {
+        printf("Glyph atlas creation failed: %s\n", SDL_GetError());
+        vga_display_close(d);
+        return NULL;
+    }
+    for (int q = 0; q < VGA_WIDTH * VGA_HEIGHT * 2; q++) {
+        static const int corners[6] = {0, 1, 2, 0, 2, 3};
+        for (int i = 0; i < 6; i++) {
+            d->indices[q * 6 + i] = q * 4 + corners[i];
+        }
+    }
+
+    atomic_init(&d->snapshot_seq, 0);
+    atomic_init(&d->snapshot_dirty, 0);
+    atomic_init(&d->quit, 0);
+    d->wake = SDL_CreateSemaphore(0);
+    d->started = SDL_CreateSemaphore(0);
+    d->render_thread = SDL_CreateThread(vga_render_thread, "vga-render", d);
+    if (!d->render_thread) {
+        printf("Render thread creation failed: %s\n", SDL_GetError());
+        vga_display_close(d);
+        return NULL;
+    }
+
+    SDL_SemWait(d->started);
+    if (!d->render_ok) {
+        vga_display_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+// Publish the screen to the render thread; never blocks the CPU thread
+void vga_display_publish(VGADisplay* d, VGACell screen[VGA_HEIGHT][VGA_WIDTH],
+                         uint32_t dirty) {
+    unsigned seq = atomic_load_explicit(&d->snapshot_seq, memory_order_relaxed);
+    atomic_store_explicit(&d->snapshot_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(d->snapshot, screen, sizeof(d->snapshot));
+    atomic_store_explicit(&d->snapshot_seq, seq + 2, memory_order_release);
+
+    atomic_fetch_or(&d->snapshot_dirty, dirty);
+    SDL_SemPost(d->wake);
+}
+
+// Returns 0 once the window has been closed
+int vga_display_poll(VGADisplay* d) {
+    SDL_Event event;
+    int open = 1;
+    (void)d;
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT) {
+            open = 0;
+        }
+    }
+    return open;
+}
+
+void vga_display_close(VGADisplay* d) {
+    if (d) {
+        if (d->render_thread) {
+            atomic_store(&d->quit, 1);
+            SDL_SemPost(d->wake);
+            SDL_WaitThread(d->render_thread, NULL);
+        }
+        if (d->wake) SDL_DestroySemaphore(d->wake);
+        if (d->started) SDL_DestroySemaphore(d->started);
+        if (d->atlas_surface) SDL_FreeSurface(d->atlas_surface);
+        free(d->vertices);
+        free(d->indices);
+        if (d->font) TTF_CloseFont(d->font);
+        if (d->window) SDL_DestroyWindow(d->window);
+        free(d);
+    }
+    TTF_Quit();
+    SDL_Quit();
+}
+
+#else
+
+VGADisplay* vga_display_open(void) {
+    printf("Built without SDL, only headless mode is available\n");
+    return NULL;
+}
+
+void vga_display_publish(VGADisplay* display, VGACell screen[VGA_HEIGHT][VGA_WIDTH],
+                         uint32_t dirty) {
+    (void)display;
+    (void)screen;
+    (void)dirty;
+}
+
+int vga_display_poll(VGADisplay* display) {
+    (void)display;
+    return 1;
+}
+
+void vga_display_close(VGADisplay* display) {
+    (void)display;
+}
+
+#endif
\ No newline at end of file
@@ -1,64 +1,161 @@
 #include <vm.h>
+#include <mem.h>
+#include <trace.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define ISO_SECTOR_SIZE 2048
-#define FLOPPY_SECTOR_SIZE 512
 
-// Read ISO file into memory
+// Map the ISO and boot from its first sector
 static int load_iso(VM* vm, const char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
+    size_t size = 0;
+    const uint8_t* data = imagecache_acquire(filename, &size);
+    if (!data) {
         printf("Failed to open ISO file: %s\n", filename);
         return 0;
     }
-
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Load first sector (boot sector) at 0x7C00
-    uint8_t sector[ISO_SECTOR_SIZE];
-    if (fread(sector, 1, ISO_SECTOR_SIZE, file) != ISO_SECTOR_SIZE) {
+    if (size < ISO_SECTOR_SIZE) {
         printf("Failed to read boot sector\n");
-        fclose(file);
+        imagecache_release(data);
         return 0;
     }
 
-    // Copy boot sector to memory at 0x7C00 (standard boot location)
-    memcpy(&vm->cpu.memory[0x7C00], sector, FLOPPY_SECTOR_SIZE);
+    // Keep the image mapped for later disk operations; nothing read or
+    // written through the previous one carries over
+    vm_disk_close(vm);
+    if (vm->disk_cache) diskcache_clear(vm->disk_cache);
+    imagecache_release(vm->disk_data);
+    free(vm->disk_path);
+    vm->disk_data = data;
+    vm->disk_path = strdup(filename);
+    vm->disk_size = size;
+
+    // A persistent overlay brings back what earlier runs wrote
+    if (vm->overlay_path) {
+        vm->disk_overlay = diskoverlay_open(vm->overlay_path, size / VM_SECTOR_SIZE,
+                                            VM_SECTOR_SIZE);
+        if (!vm->disk_overlay) return 0;
+    }
+
+    // Copy boot sector to memory at 0x7C00 (standard boot location), as the
+    // guest last wrote it
+    uint8_t boot[VM_SECTOR_SIZE];
+    memcpy(boot, data, VM_SECTOR_SIZE);
+    if (vm->disk_overlay && !diskoverlay_read(vm->disk_overlay, 0, 1, boot)) return 0;
+    vm_write_range(vm, 0x7C00, boot, VM_SECTOR_SIZE);
 
     // Set initial CPU state for booting
+    vm_install_ivt(vm);
     vm->cpu.ip = 0x7C00;             // Start execution at boot sector
     vm->cpu.registers[7] = 0x7C00;   // Stack starts at boot sector
     vm->cpu.cs = 0;                  // Code segment
     vm->cpu.ds = 0;                  // Data segment
     vm->cpu.es = 0;                  // Extra segment
     vm->cpu.ss = 0;                  // Stack segment
-
-    // Store ISO information for later disk operations
-    vm->disk_file = file;
-    vm->disk_size = size;
     
     return 1;
 }
 
-int vm_init(VM* vm) {
+// Native BIOS services run unless the guest pointed the vector elsewhere;
+// with no handler registered the INT is a no-op
+static int vm_bios_interrupt(void* data, uint8_t vector) {
+    VM* vm = data;
+    if (vm->cpu.ivt && cpu_read_dword(&vm->cpu, (uint32_t)vector * 4) != VM_BIOS_VECTOR) {
+        return 0;
+    }
+    if (vm->bios[vector]) {
+        vm->bios[vector](vm);
+    }
+    return 1;
+}
+
+void vm_set_bios_handler(VM* vm, uint8_t vector, BiosHandlerFn handler) {
+    vm->bios[vector] = handler;
+}
+
+// Point every vector at the native BIOS, as firmware does before booting.
+// Flat binaries load over address 0, so only booted images get a table.
+void vm_install_ivt(VM* vm) {
+    uint8_t entry[4] = {VM_BIOS_VECTOR & 0xFF, (VM_BIOS_VECTOR >> 8) & 0xFF,
+                        (VM_BIOS_VECTOR >> 16) & 0xFF, VM_BIOS_VECTOR >> 24};
+    for (uint32_t vector = 0; vector < CPU_IVT_VECTORS; vector++) {
+        vm_write_range(vm, vector * 4, entry, sizeof(entry));
+    }
+    vm->cpu.ivt = 1;
+}
+
+// Forward a store on a hooked page to every hook its bytes fall into
+static void vm_dispatch_write(void* data, uint32_t addr, uint32_t size) {
+    VM* vm = data;
+    uint32_t end = addr + size;
+    for (int i = 0; i < vm->num_write_hooks; i++) {
+        WriteHook* hook = &vm->write_hooks[i];
+        uint32_t lo = addr > hook->start ? addr : hook->start;
+        uint32_t hi = end < hook->end ? end : hook->end;
+        for (uint32_t a = lo; a < hi; a++) {
+            hook->hook(hook->data, a, vm->cpu.memory[a]);
+        }
+    }
+}
+
+int vm_init(VM* vm, const VMConfig* config) {
     // Initialize CPU and VGA
-    cpu_init(&vm->cpu);
-    if (!vga_init(&vm->vga)) {
+    uint32_t memory_size = config->memory_size ? config->memory_size : CPU_DEFAULT_MEMORY;
+    if (!cpu_init(&vm->cpu, memory_size, config->huge_pages ? MEM_HUGE_PAGES : 0)) {
         return 0;
     }
+    if (!vga_init(&vm->vga, config->headless)) {
+        cpu_cleanup(&vm->cpu);
+        return 0;
+    }
+    if (config->shm_name && !vga_export_shm(&vm->vga, config->shm_name)) {
+        vga_cleanup(&vm->vga);
+        cpu_cleanup(&vm->cpu);
+        return 0;
+    }
+
+    // Initialize scheduler state
+    vm->running = 0;
+    vm->idle = 0;
+    vm->unthrottled = config->unthrottled;
+    vm->headless = config->headless;
+    vm->dump_path = config->dump_path;
+    vm->dump_requested = 0;
+    vm->stop_requested = 0;
+    vm->instructions = 0;
 
     // Initialize disk state
-    vm->disk_file = NULL;
+    vm->disk_data = NULL;
+    vm->disk_path = NULL;
     vm->disk_size = 0;
+    vm->disk_fd = -1;
+    vm->async_disk = config->async_disk;
+    memset(&vm->disk_read, 0, sizeof(vm->disk_read));
+    vm->disk_overlay = NULL;
+    vm->overlay_path = config->disk_overlay;
+    vm->disk_cache = NULL;
+    if (config->disk_cache) {
+        vm->disk_cache = diskcache_create(config->disk_cache, VM_SECTOR_SIZE,
+            config->disk_readahead ? config->disk_readahead : DISKCACHE_READAHEAD_MAX);
+        if (!vm->disk_cache) {
+            vga_cleanup(&vm->vga);
+            cpu_cleanup(&vm->cpu);
+            return 0;
+        }
+    }
 
-    // Create memory write hook table
+    // Create memory write hook table; the CPU reports stores to hooked pages
     vm->write_hooks = NULL;
     vm->num_write_hooks = 0;
+    cpu_set_write_hook(&vm->cpu, vm_dispatch_write, vm);
+
+    // BIOS services the guest reaches through INT
+    memset(vm->bios, 0, sizeof(vm->bios));
+    vm_set_bios_handler(vm, 0x10, vm_handle_int10);
+    vm_set_bios_handler(vm, 0x13, vm_handle_disk_interrupt);
+    cpu_set_int_hook(&vm->cpu, vm_bios_interrupt, vm);
 
     // Add VGA memory hook
     vm_add_write_hook(vm, VGA_MEMORY_START, VGA_MEMORY_SIZE, 
@@ -79,22 +176,22 @@ void vm_add_write_hook(VM* vm, uint32_t start, uint32_t size,
     new_hook->end = start + size;
     new_hook->hook = hook;
     new_hook->data = data;
+    cpu_hook_range(&vm->cpu, start, size);
+}
+
+// Bulk copy into guest memory; hooks see each byte that lands in their range
+void vm_write_range(VM* vm, uint32_t addr, const uint8_t* data, uint32_t size) {
+    if (addr >= vm->cpu.memory_size) return;
+    if (size > vm->cpu.memory_size - addr) size = vm->cpu.memory_size - addr;
+    if (size == 0) return;
+
+    memcpy(&vm->cpu.memory[addr], data, size);
+    cpu_note_write(&vm->cpu, addr, size);
 }
 
 // Handle memory writes with hooks
 void vm_write_memory(VM* vm, uint32_t addr, uint8_t value) {
-    // First write to actual memory
-    if (addr < MEMORY_SIZE) {
-        vm->cpu.memory[addr] = value;
-    }
-
-    // Then check hooks
-    for (int i = 0; i < vm->num_write_hooks; i++) {
-        WriteHook* hook = &vm->write_hooks[i];
-        if (addr >= hook->start && addr < hook->end) {
-            hook->hook(hook->data, addr, value);
-        }
-    }
+    cpu_write_byte(&vm->cpu, addr, value);
 }
 
 void vm_handle_int10(VM* vm) {
@@ -107,6 +204,9 @@ void vm_handle_int10(VM* vm) {
                 uint32_t offset = ((vm->vga.cursor_y * VGA_WIDTH) + vm->vga.cursor_x) * 2;
                 vm_write_memory(vm, VGA_MEMORY_START + offset, al);
                 vm_write_memory(vm, VGA_MEMORY_START + offset + 1, 0x07); // Light gray on black
+                if (vm->headless) {
+                    putchar(al);  // Without a window the console is the screen
+                }
                 
                 vm->vga.cursor_x++;
                 if (vm->vga.cursor_x >= VGA_WIDTH) {
@@ -122,112 +222,181 @@ void vm_handle_int10(VM* vm) {
     }
 }
 
+uint64_t vm_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vm_sleep_until(uint64_t deadline_ns) {
+    uint64_t now = vm_now_ns();
+    if (deadline_ns > now) {
+        uint64_t ns = deadline_ns - now;
+        struct timespec ts = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Guest parked on an unconditional jump to itself (JMP $)
+static int vm_is_idle_loop(VM* vm) {
+    uint32_t ip = vm->cpu.ip;
+    uint8_t opcode = cpu_read_byte(&vm->cpu, ip);
+    if (opcode == 0x51) return cpu_read_dword(&vm->cpu, ip + 1) == ip;
+    if (opcode == 0xEB) return cpu_read_byte(&vm->cpu, ip + 1) == 0xFE;
+    return 0;
+}
+
+uint64_t vm_run_slice(VM* vm, uint64_t budget) {
+    uint64_t retired = 0;
+    vm->idle = 0;
+
+    while (retired < budget && vm->running && !vm->cpu.halted) {
+        // A guest inside an asynchronous INT 13h read waits for its data
+        if (vm->disk_read.pending && !vm_disk_poll(vm)) {
+            break;
+        }
+
+        // Execute instruction
+        uint32_t ip = vm->cpu.ip;
+        retired += cpu_step(&vm->cpu);
+
+        // Check if IP is still valid
+        if (vm->cpu.ip >= vm->cpu.memory_size) {
+            printf("CPU IP out of bounds: 0x%08X\n", vm->cpu.ip);
+            vm->running = 0;
+            break;
+        }
+
+        if (vm->cpu.ip == ip && vm_is_idle_loop(vm)) {
+            vm->idle = 1;
+            break;
+        }
+    }
+
+    vm->instructions += retired;
+    return retired;
+}
+
 void vm_run(VM* vm) {
-    SDL_Event event;
-    int running = 1;
+    uint64_t slice = VM_SLICE_MIN;
+    uint64_t next_frame = vm_now_ns() + VM_FRAME_NS;
 
-    while (running) {
-        while (SDL_PollEvent(&event)) {
-            if (event.type == SDL_QUIT) {
-                running = 0;
-            }
+    vm->running = 1;
+    while (vm->running) {
+        if (!vga_poll_events(&vm->vga) || vm->stop_requested) {
+            vm->running = 0;
         }
 
-        // Emulate several cycles per frame
-        for (int i = 0; i < 1000 && running; i++) {
-            // Safely check for interrupts
-            if (vm->cpu.ip < MEMORY_SIZE - 1) {  // Ensure we can read two bytes
-                uint8_t opcode = vm->cpu.memory[vm->cpu.ip];
-                if (opcode == 0xCD && vm->cpu.ip < MEMORY_SIZE - 2) {
-                    uint8_t int_num = vm->cpu.memory[vm->cpu.ip + 1];
-                    switch (int_num) {
-                        case 0x10:
-                            vm_handle_int10(vm);
-                            break;
-                        case 0x13:
-                            vm_handle_disk_interrupt(vm);
-                            break;
-                    }
-                }
-            }
+        uint64_t start = vm_now_ns();
+        uint64_t retired = vm_run_slice(vm, slice);
+        uint64_t now = vm_now_ns();
 
-            // Execute instruction
-            cpu_emulate_cycle(&vm->cpu);
-
-            // Safely check VGA memory writes
-            if (vm->cpu.last_write_addr != 0xFFFFFFFF && 
-                vm->cpu.last_write_addr >= VGA_MEMORY_START && 
-                vm->cpu.last_write_addr < VGA_MEMORY_START + VGA_MEMORY_SIZE) {
-                // Only write if the address is valid
-                if (vm->cpu.last_write_addr < MEMORY_SIZE) {
-                    vm_write_memory(vm, 
-                                  vm->cpu.last_write_addr, 
-                                  vm->cpu.memory[vm->cpu.last_write_addr]);
-                }
-            }
+        // Size the next slice so one slice takes about VM_SLICE_NS
+        if (retired >= slice) {
+            uint64_t elapsed = now - start;
+            uint64_t target = elapsed ? slice * VM_SLICE_NS / elapsed : slice * 2;
+            slice = (slice + target) / 2;
+            if (slice < VM_SLICE_MIN) slice = VM_SLICE_MIN;
+            if (slice > VM_SLICE_MAX) slice = VM_SLICE_MAX;
+        }
 
-            // Check if IP is still valid
-            if (vm->cpu.ip >= MEMORY_SIZE) {
-                printf("CPU IP out of bounds: 0x%08X\n", vm->cpu.ip);
-                running = 0;
-                break;
+        if (now >= next_frame) {
+            vga_update(&vm->vga);
+            next_frame += VM_FRAME_NS;
+            if (next_frame < now) {
+                next_frame = now + VM_FRAME_NS;
             }
         }
 
-        if (running) {
-            vga_update(&vm->vga);
-            SDL_Delay(16);
+        if (vm->dump_requested) {
+            vm->dump_requested = 0;
+            if (vm->dump_path) vga_dump(&vm->vga, vm->dump_path);
+        }
+
+        // Without a window nobody can look at a halted guest any more
+        if (vm->headless && vm->cpu.halted) {
+            vm->running = 0;
+        }
+
+        // Nothing useful to run until the next display refresh, or until
+        // the disk read the guest is blocked in completes
+        if (vm->running && vm_disk_waiting(vm)) {
+            now = vm_now_ns();
+            vm_disk_wait(vm, next_frame > now ? next_frame - now : 0);
+        } else if (vm->running &&
+            (vm->cpu.halted || (vm->idle && !vm->unthrottled))) {
+            vm_sleep_until(next_frame);
         }
     }
+
+    vga_update(&vm->vga);
+    if (vm->dump_path) {
+        vga_dump(&vm->vga, vm->dump_path);
+    }
 }
 
 void vm_cleanup(VM* vm) {
-    if (vm->disk_file) {
-        fclose(vm->disk_file);
+    if (vm->cpu.trace) {
+        trace_stop(vm);
     }
+    vm_disk_close(vm);
+    diskcache_destroy(vm->disk_cache);
+    vm->disk_cache = NULL;
+    cpu_cleanup(&vm->cpu);
+    imagecache_release(vm->disk_data);
+    free(vm->disk_path);
     if (vm->write_hooks) {
         free(vm->write_hooks);
     }
     vga_cleanup(&vm->vga);
 }
 
+// Clone a running VM. Guest memory is shared copy-on-write with the parent:
+// pages are not copied, except that the pages the parent wrote since its
+// last fork are added to a new image. The parent must not be running on
+// another thread meanwhile.
+int vm_fork(VM* parent, VM* child, const VMConfig* config) {
+    // A read in flight would land in the parent only
+    vm_disk_flush(parent);
+
+    // The clone always gets the parent's amount of guest RAM
+    VMConfig child_config = *config;
+    child_config.memory_size = parent->cpu.memory_size;
+    child_config.disk_overlay = NULL;
+    if (!vm_init(child, &child_config)) {
+        return 0;
+    }
+    if (!cpu_fork(&child->cpu, &parent->cpu)) {
+        printf("Failed to fork CPU state\n");
+        vm_cleanup(child);
+        return 0;
+    }
+
+    memcpy(child->vga.screen, parent->vga.screen, sizeof(child->vga.screen));
+    child->vga.cursor_x = parent->vga.cursor_x;
+    child->vga.cursor_y = parent->vga.cursor_y;
+    child->vga.dirty_rows = VGA_ALL_ROWS;
+    child->instructions = parent->instructions;
+    memcpy(child->bios, parent->bios, sizeof(child->bios));
+
+    // A reference of its own, so the clone does not depend on the parent's lifetime
+    if (parent->disk_data) {
+        child->disk_data = imagecache_retain(parent->disk_data);
+        child->disk_size = parent->disk_size;
+        child->disk_path = strdup(parent->disk_path);
+    }
+    // The clone starts from the parent's writes but keeps its own from here
+    if (parent->disk_overlay) {
+        child->disk_overlay = diskoverlay_clone(parent->disk_overlay);
+        if (!child->disk_overlay) {
+            vm_cleanup(child);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 // Function to load and run an ISO
 int vm_load_iso(VM* vm, const char* filename) {
     return load_iso(vm, filename);
-}
-
-// INT 13h handler for disk operations
-void vm_handle_disk_interrupt(VM* vm) {
-    uint8_t function = (vm->cpu.registers[0] >> 8) & 0xFF;
-    uint8_t cylinder = (vm->cpu.registers[1] >> 8) & 0xFF;
-    uint8_t sector = vm->cpu.registers[1] & 0xFF;
-    uint8_t head = (vm->cpu.registers[2] >> 8) & 0xFF;
-    uint8_t count = (vm->cpu.registers[0] & 0xFF);
-    uint16_t buffer_seg = vm->cpu.es;
-    uint16_t buffer_off = vm->cpu.registers[3] & 0xFFFF;
-
-    switch (function) {
-        case 0x02: // Read sectors
-            if (vm->disk_file) {
-                long offset = ((cylinder * 2 * 18) + (head * 18) + (sector - 1)) * 
-                            FLOPPY_SECTOR_SIZE;
-                fseek(vm->disk_file, offset, SEEK_SET);
-                
-                uint32_t buffer_addr = (buffer_seg << 4) + buffer_off;
-                uint8_t buffer[FLOPPY_SECTOR_SIZE];
-                
-                for (int i = 0; i < count; i++) {
-                    if (fread(buffer, 1, FLOPPY_SECTOR_SIZE, vm->disk_file) == FLOPPY_SECTOR_SIZE) {
-                        for (int j = 0; j < FLOPPY_SECTOR_SIZE; j++) {
-                            vm_write_memory(vm, buffer_addr + j, buffer[j]);
-                        }
-                        buffer_addr += FLOPPY_SECTOR_SIZE;
-                    }
-                }
-                
-                // Clear CF to indicate success
-                vm->cpu.flags &= ~1;
-            }
-            break;
-    }
 }
\ No newline at end of file
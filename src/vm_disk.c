@@ -0,0 +1,347 @@
+#include <vm.h>
+#include <stdio.h>
+#include <string.h>
+
+// Floppy geometry used to turn CHS addresses into sector numbers
+#define DISK_HEADS 2
+#define DISK_SECTORS_PER_TRACK 18
+
+#define DISK_STATUS_OK 0x00
+#define DISK_STATUS_BAD_COMMAND 0x01
+#define DISK_STATUS_WRITE_PROTECTED 0x03
+#define DISK_STATUS_NOT_FOUND 0x04
+#define DISK_STATUS_CONTROLLER_FAILED 0x20
+
+static void vm_disk_set_carry(VM* vm, int carry) {
+    uint32_t flags = cpu_get_flags(&vm->cpu);
+    cpu_set_flags(&vm->cpu, carry ? flags | 1 : flags & ~1u);
+}
+
+// Whole sectors of a read that fit both the image and guest memory
+static uint32_t vm_disk_clamp(VM* vm, uint64_t lba, uint32_t count, uint32_t address) {
+    uint64_t sectors = vm->disk_size / VM_SECTOR_SIZE;
+    uint64_t available = lba < sectors ? sectors - lba : 0;
+    uint32_t room = address < vm->cpu.memory_size ?
+        (vm->cpu.memory_size - address) / VM_SECTOR_SIZE : 0;
+    uint32_t done = count;
+    if (done > available) done = (uint32_t)available;
+    if (done > room) done = room;
+    return done;
+}
+
+// Report a finished transfer: AH = status and CF set unless it is 0; AL (or
+// the packet's block count for AH=42h/43h) = sectors transferred
+static void vm_disk_complete(VM* vm, uint32_t done, uint32_t status, uint32_t packet) {
+    CPU* cpu = &vm->cpu;
+    if (packet) {
+        cpu_write_word(cpu, packet + 2, (uint16_t)done);
+        cpu->registers[0] = (cpu->registers[0] & ~0xFF00u) | status << 8;
+    } else {
+        cpu->registers[0] = (cpu->registers[0] & ~0xFFFFu) | done | status << 8;
+    }
+    vm_disk_set_carry(vm, status != DISK_STATUS_OK);
+}
+
+static void vm_disk_finish(VM* vm, uint32_t done, uint32_t requested, uint32_t packet) {
+    vm_disk_complete(vm, done, done < requested ? DISK_STATUS_NOT_FOUND : DISK_STATUS_OK, packet);
+}
+
+// Lay the guest's own writes over sectors just read from the base image;
+// 0 when the overlay could not be read and buffer holds stale sectors
+static int vm_disk_patch(VM* vm, uint64_t lba, uint32_t sectors, uint8_t* buffer) {
+    return !vm->disk_overlay || diskoverlay_read(vm->disk_overlay, lba, sectors, buffer);
+}
+
+// Reads that go through a descriptor share the image cache's
+static int vm_disk_open(VM* vm) {
+    if (vm->disk_fd >= 0) return 1;
+    vm->disk_fd = imagecache_fd(vm->disk_data);
+    if (vm->disk_fd < 0) {
+        printf("Failed to open %s, reading through the mapping\n", vm->disk_path);
+        vm->async_disk = 0;
+        diskcache_destroy(vm->disk_cache);
+        vm->disk_cache = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Hand the read set up in vm->disk_read to an I/O thread; 0 when it has to
+// be done inline
+static int vm_disk_submit(VM* vm, uint8_t* buffer, uint64_t lba, uint32_t sectors) {
+    VmDiskRead* read = &vm->disk_read;
+    read->io.fd = vm->disk_fd;
+    read->io.buffer = buffer;
+    read->io.offset = lba * VM_SECTOR_SIZE;
+    read->io.size = (size_t)sectors * VM_SECTOR_SIZE;
+    if (!diskio_submit(&read->io)) {
+        vm->async_disk = 0;
+        return 0;
+    }
+    read->pending = 1;
+    return 1;
+}
+
+// Keep a fetched run of sectors and pass the guest its share of them,
+// counting those delivered in *delivered; 0 when the overlay failed and
+// nothing was kept or delivered
+static int vm_disk_fill(VM* vm, uint64_t lba, uint32_t sectors, uint32_t address,
+                        uint32_t wanted, uint32_t* delivered) {
+    DiskCache* cache = vm->disk_cache;
+    if (!vm_disk_patch(vm, lba, sectors, cache->staging)) return 0;
+    for (uint32_t i = 0; i < sectors; i++) {
+        memcpy(diskcache_insert(cache, lba + i),
+               &cache->staging[(size_t)i * VM_SECTOR_SIZE], VM_SECTOR_SIZE);
+    }
+    *delivered = sectors < wanted ? sectors : wanted;
+    if (*delivered) {
+        vm_write_range(vm, address, cache->staging, *delivered * VM_SECTOR_SIZE);
+    }
+    return 1;
+}
+
+// Serve the leading sectors the cache holds, then fetch the rest and any
+// readahead with a single read; 0 when the cache cannot be used
+static int vm_disk_cached_read(VM* vm, uint64_t lba, uint32_t done, uint32_t address,
+                               uint32_t requested, uint32_t packet) {
+    DiskCache* cache = vm->disk_cache;
+    uint32_t ahead = diskcache_readahead(cache, lba, done);
+    uint32_t served = 0;
+    const uint8_t* sector;
+    while (served < done && (sector = diskcache_lookup(cache, lba + served))) {
+        vm_write_range(vm, address + served * VM_SECTOR_SIZE, sector, VM_SECTOR_SIZE);
+        served++;
+    }
+    cache->stats.hits += served;
+    if (served == done) {
+        vm_disk_finish(vm, done, requested, packet);
+        return 1;
+    }
+    if (!vm_disk_open(vm)) return 0;
+
+    uint64_t first = lba + served;
+    uint32_t wanted = done - served;
+    uint64_t fetch = (uint64_t)wanted + ahead;
+    if (fetch > cache->capacity) fetch = cache->capacity;
+    if (fetch > vm->disk_size / VM_SECTOR_SIZE - first) {
+        fetch = vm->disk_size / VM_SECTOR_SIZE - first;
+    }
+    cache->stats.misses += wanted;
+    cache->stats.reads++;
+    cache->stats.readahead += fetch - wanted;
+
+    if (vm->async_disk) {
+        VmDiskRead* read = &vm->disk_read;
+        read->address = address;
+        read->requested = requested;
+        read->packet = packet;
+        read->cached = 1;
+        read->lba = first;
+        read->served = served;
+        read->wanted = wanted;
+        if (vm_disk_submit(vm, cache->staging, first, (uint32_t)fetch)) return 1;
+    }
+
+    size_t got = diskio_read(vm->disk_fd, cache->staging, (size_t)fetch * VM_SECTOR_SIZE,
+                             first * VM_SECTOR_SIZE);
+    uint32_t delivered = 0;
+    if (!vm_disk_fill(vm, first, (uint32_t)(got / VM_SECTOR_SIZE),
+                      address + served * VM_SECTOR_SIZE, wanted, &delivered)) {
+        vm_disk_complete(vm, served, DISK_STATUS_CONTROLLER_FAILED, packet);
+        return 1;
+    }
+    vm_disk_finish(vm, served + delivered, requested, packet);
+    return 1;
+}
+
+static void vm_disk_read(VM* vm, uint64_t lba, uint32_t count, uint32_t address,
+                         uint32_t packet) {
+    uint32_t done = vm_disk_clamp(vm, lba, count, address);
+    if (done && vm->disk_cache && done <= vm->disk_cache->capacity &&
+        vm_disk_cached_read(vm, lba, done, address, count, packet)) {
+        return;
+    }
+    if (done && vm->async_disk && vm_disk_open(vm)) {
+        VmDiskRead* read = &vm->disk_read;
+        read->address = address;
+        read->requested = count;
+        read->packet = packet;
+        read->cached = 0;
+        read->lba = lba;
+        if (vm_disk_submit(vm, &vm->cpu.memory[address], lba, done)) return;
+    }
+    if (done) {
+        memcpy(&vm->cpu.memory[address], vm->disk_data + lba * VM_SECTOR_SIZE,
+               (size_t)done * VM_SECTOR_SIZE);
+        int patched = vm_disk_patch(vm, lba, done, &vm->cpu.memory[address]);
+        cpu_note_write(&vm->cpu, address, done * VM_SECTOR_SIZE);
+        if (!patched) {
+            vm_disk_complete(vm, 0, DISK_STATUS_CONTROLLER_FAILED, packet);
+            return;
+        }
+    }
+    vm_disk_finish(vm, done, count, packet);
+}
+
+// Writes land in the overlay, created on the first one unless the VM was
+// given a persistent file; the base image is never modified
+static void vm_disk_write(VM* vm, uint64_t lba, uint32_t count, uint32_t address,
+                          uint32_t packet) {
+    uint32_t done = vm_disk_clamp(vm, lba, count, address);
+    if (done && !vm->disk_overlay) {
+        vm->disk_overlay = diskoverlay_open(NULL, vm->disk_size / VM_SECTOR_SIZE,
+                                            VM_SECTOR_SIZE);
+        if (!vm->disk_overlay) {
+            vm_disk_complete(vm, 0, DISK_STATUS_WRITE_PROTECTED, packet);
+            return;
+        }
+    }
+
+    const uint8_t* data = &vm->cpu.memory[address];
+    uint32_t written = done ? diskoverlay_write(vm->disk_overlay, lba, done, data) : 0;
+    // Write through, so the cache never serves what the guest replaced
+    if (vm->disk_cache) {
+        for (uint32_t i = 0; i < written; i++) {
+            memcpy(diskcache_insert(vm->disk_cache, lba + i),
+                   &data[(size_t)i * VM_SECTOR_SIZE], VM_SECTOR_SIZE);
+        }
+    }
+    if (written < done) {
+        vm_disk_complete(vm, written, DISK_STATUS_CONTROLLER_FAILED, packet);
+        return;
+    }
+    vm_disk_finish(vm, done, count, packet);
+}
+
+// CHS address of an AH=02h/03h call as a sector number; sectors are
+// numbered from 1, and sector 0 maps past the end of the disk
+static uint64_t vm_disk_chs(VM* vm) {
+    CPU* cpu = &vm->cpu;
+    uint8_t cylinder = (cpu->registers[1] >> 8) & 0xFF;
+    uint8_t sector = cpu->registers[1] & 0xFF;
+    uint8_t head = (cpu->registers[2] >> 8) & 0xFF;
+    if (!sector) return vm->disk_size / VM_SECTOR_SIZE;
+    return ((uint64_t)cylinder * DISK_HEADS + head) * DISK_SECTORS_PER_TRACK + sector - 1;
+}
+
+// Disk address packet of an AH=42h/43h call at DS:SI; 0 if it is malformed
+static uint32_t vm_disk_packet(VM* vm, uint64_t* lba, uint32_t* count, uint32_t* address) {
+    CPU* cpu = &vm->cpu;
+    uint32_t packet = (cpu->ds << 4) + (cpu->registers[4] & 0xFFFF);
+    if (cpu_read_byte(cpu, packet) < 0x10) {
+        cpu->registers[0] = (cpu->registers[0] & ~0xFF00u) | DISK_STATUS_BAD_COMMAND << 8;
+        vm_disk_set_carry(vm, 1);
+        return 0;
+    }
+    *count = cpu_read_word(cpu, packet + 2);
+    *address = (cpu_read_word(cpu, packet + 6) << 4) + cpu_read_word(cpu, packet + 4);
+    *lba = cpu_read_dword(cpu, packet + 8) | (uint64_t)cpu_read_dword(cpu, packet + 12) << 32;
+    return packet;
+}
+
+// INT 13h handler for disk operations
+void vm_handle_disk_interrupt(VM* vm) {
+    CPU* cpu = &vm->cpu;
+    uint8_t function = (cpu->registers[0] >> 8) & 0xFF;
+    if (!vm->disk_data) return;
+
+    uint64_t lba;
+    uint32_t count, address, packet;
+    switch (function) {
+        case 0x02: // Read sectors, CHS addressed
+        case 0x03: // Write sectors, CHS addressed
+            count = cpu->registers[0] & 0xFF;
+            address = (cpu->es << 4) + (cpu->registers[3] & 0xFFFF);
+            if (function == 0x02) {
+                vm_disk_read(vm, vm_disk_chs(vm), count, address, 0);
+            } else {
+                vm_disk_write(vm, vm_disk_chs(vm), count, address, 0);
+            }
+            break;
+        case 0x41: // Check extensions present
+            if ((cpu->registers[3] & 0xFFFF) == 0x55AA) {
+                cpu->registers[3] = (cpu->registers[3] & ~0xFFFFu) | 0xAA55;
+                cpu->registers[0] = (cpu->registers[0] & ~0xFF00u) | 0x2100;  // Version 1.1
+                cpu->registers[1] = (cpu->registers[1] & ~0xFFFFu) | 0x0001;  // Packet calls
+                vm_disk_set_carry(vm, 0);
+            } else {
+                cpu->registers[0] = (cpu->registers[0] & ~0xFF00u) | DISK_STATUS_BAD_COMMAND << 8;
+                vm_disk_set_carry(vm, 1);
+            }
+            break;
+        case 0x42: // Extended read, LBA addressed through the packet at DS:SI
+            if ((packet = vm_disk_packet(vm, &lba, &count, &address))) {
+                vm_disk_read(vm, lba, count, address, packet);
+            }
+            break;
+        case 0x43: // Extended write; AL asks for verification, which is implied
+            if ((packet = vm_disk_packet(vm, &lba, &count, &address))) {
+                vm_disk_write(vm, lba, count, address, packet);
+            }
+            break;
+    }
+}
+
+int vm_disk_waiting(const VM* vm) {
+    return vm->disk_read.pending;
+}
+
+int vm_disk_wait(VM* vm, uint64_t timeout_ns) {
+    return !vm->disk_read.pending || diskio_wait(&vm->disk_read.io, timeout_ns);
+}
+
+// Deliver a completed asynchronous read; 0 while it is still in flight
+int vm_disk_poll(VM* vm) {
+    VmDiskRead* read = &vm->disk_read;
+    if (!read->pending) return 1;
+    if (!diskio_done(&read->io)) return 0;
+
+    read->pending = 0;
+    uint32_t sectors = (uint32_t)(read->io.result / VM_SECTOR_SIZE);
+    uint32_t done = 0;
+    int patched = 1;
+    if (read->cached) {
+        patched = vm_disk_fill(vm, read->lba, sectors,
+                               read->address + read->served * VM_SECTOR_SIZE,
+                               read->wanted, &done);
+        done += read->served;
+    } else {
+        // The I/O thread wrote guest memory behind the CPU's back
+        if (read->io.result) {
+            patched = vm_disk_patch(vm, read->lba, sectors, &vm->cpu.memory[read->address]);
+            cpu_note_write(&vm->cpu, read->address, (uint32_t)read->io.result);
+        }
+        done = patched ? sectors : 0;
+    }
+    if (!patched) {
+        vm_disk_complete(vm, done, DISK_STATUS_CONTROLLER_FAILED, read->packet);
+    } else {
+        vm_disk_finish(vm, done, read->requested, read->packet);
+    }
+    // Only a deferred read signals its completion; the guest was stalled
+    // in its INT 13h meanwhile
+    cpu_interrupt(&vm->cpu, VM_DISK_IRQ_VECTOR);
+    return 1;
+}
+
+// Finish any read in flight, for callers that need the guest consistent
+void vm_disk_flush(VM* vm) {
+    while (!vm_disk_poll(vm)) {
+        diskio_wait(&vm->disk_read.io, 1000000000ULL);
+    }
+}
+
+// Throw away everything the guest wrote
+int vm_disk_discard(VM* vm) {
+    vm_disk_flush(vm);
+    if (!vm->disk_overlay) return 1;
+    if (vm->disk_cache) diskcache_clear(vm->disk_cache);
+    return diskoverlay_discard(vm->disk_overlay);
+}
+
+void vm_disk_close(VM* vm) {
+    vm_disk_flush(vm);
+    vm->disk_fd = -1;
+    diskoverlay_close(vm->disk_overlay);
+    vm->disk_overlay = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,322 @@
+#include <vm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Snapshot layout, all integers little-endian:
+//   header   "XVMS", version, memory size, page size
+//   cpu      registers[8], ip, flags, cs..gs, halted, tsc
+//   vm       retired instruction count
+//   vga      cursor x/y, then the text cells as character/attribute pairs
+//   disk     image size (0 when no disk is attached), feature bits
+//   memory   runs of non-zero pages {first page, count, data}, count 0 ends
+//   overlay  with SNAPSHOT_OVERLAY, runs of sectors the guest wrote to the
+//            disk {first sector (64-bit), count, data}, count 0 ends
+#define SNAPSHOT_MAGIC "XVMS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE_SIZE CPU_PAGE_SIZE
+#define SNAPSHOT_IVT 1      // Feature bit: INT vectors through the table at 0
+#define SNAPSHOT_OVERLAY 2  // Feature bit: disk writes follow memory
+#define SNAPSHOT_DISK_RUN 64  // Most sectors in one overlay run
+
+static int put_u16(FILE* f, uint16_t v) {
+    uint8_t b[2] = {v & 0xFF, v >> 8};
+    return fwrite(b, 1, 2, f) == 2;
+}
+
+static int put_u32(FILE* f, uint32_t v) {
+    uint8_t b[4] = {v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24};
+    return fwrite(b, 1, 4, f) == 4;
+}
+
+static int put_u64(FILE* f, uint64_t v) {
+    return put_u32(f, (uint32_t)v) && put_u32(f, (uint32_t)(v >> 32));
+}
+
+static int get_u16(FILE* f, uint16_t* v) {
+    uint8_t b[2];
+    if (fread(b, 1, 2, f) != 2) return 0;
+    *v = b[0] | (b[1] << 8);
+    return 1;
+}
+
+static int get_u32(FILE* f, uint32_t* v) {
+    uint8_t b[4];
+    if (fread(b, 1, 4, f) != 4) return 0;
+    *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    return 1;
+}
+
+static int get_u64(FILE* f, uint64_t* v) {
+    uint32_t lo, hi;
+    if (!get_u32(f, &lo) || !get_u32(f, &hi)) return 0;
+    *v = lo | ((uint64_t)hi << 32);
+    return 1;
+}
+
+static int page_is_zero(const uint8_t* page) {
+    const uint64_t* words = (const uint64_t*)page;
+    for (uint32_t i = 0; i < SNAPSHOT_PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i]) return 0;
+    }
+    return 1;
+}
+
+static int snapshot_write_overlay(DiskOverlay* overlay, FILE* f) {
+    uint8_t* buffer = malloc((size_t)SNAPSHOT_DISK_RUN * overlay->sector_size);
+    int ok = buffer != NULL;
+    uint64_t lba = 0;
+    uint32_t count;
+    while (ok && (count = diskoverlay_next_run(overlay, &lba, SNAPSHOT_DISK_RUN))) {
+        size_t bytes = (size_t)count * overlay->sector_size;
+        ok = diskoverlay_read(overlay, lba, count, buffer) &&
+             put_u64(f, lba) && put_u32(f, count) && fwrite(buffer, 1, bytes, f) == bytes;
+        lba += count;
+    }
+    free(buffer);
+    return ok && put_u64(f, 0) && put_u32(f, 0);
+}
+
+// Parse the saved disk writes into a temporary overlay, so a corrupt or
+// truncated section fails before the VM's own overlay is touched
+static DiskOverlay* snapshot_read_overlay(VM* vm, FILE* f) {
+    uint64_t sectors = vm->disk_size / VM_SECTOR_SIZE;
+    DiskOverlay* saved = diskoverlay_open(NULL, sectors, VM_SECTOR_SIZE);
+    if (!saved) return NULL;
+    uint8_t* buffer = malloc((size_t)SNAPSHOT_DISK_RUN * VM_SECTOR_SIZE);
+    if (!buffer) {
+        printf("Failed to allocate snapshot buffer\n");
+        diskoverlay_close(saved);
+        return NULL;
+    }
+    int ok = 1;
+    for (;;) {
+        uint64_t lba;
+        uint32_t count;
+        if (!get_u64(f, &lba) || !get_u32(f, &count)) {
+            printf("Truncated snapshot\n");
+            ok = 0;
+            break;
+        }
+        if (count == 0) break;
+        if (count > SNAPSHOT_DISK_RUN || lba >= sectors || count > sectors - lba) {
+            printf("Corrupt snapshot disk run %llu+%u\n", (unsigned long long)lba, count);
+            ok = 0;
+            break;
+        }
+        size_t bytes = (size_t)count * VM_SECTOR_SIZE;
+        if (fread(buffer, 1, bytes, f) != bytes) {
+            printf("Truncated snapshot\n");
+            ok = 0;
+            break;
+        }
+        if (diskoverlay_write(saved, lba, count, buffer) != count) {
+            printf("Failed to restore disk writes\n");
+            ok = 0;
+            break;
+        }
+    }
+    free(buffer);
+    if (!ok) {
+        diskoverlay_close(saved);
+        return NULL;
+    }
+    return saved;
+}
+
+// Make the disk the base image plus the saved writes. A temporary overlay
+// is simply replaced; a persistent one keeps its file and takes a copy.
+static int snapshot_apply_overlay(VM* vm, DiskOverlay* saved) {
+    if (!vm_disk_discard(vm)) {
+        diskoverlay_close(saved);
+        return 0;
+    }
+    if (!saved) return 1;
+    if (!vm->overlay_path || !vm->disk_overlay) {
+        diskoverlay_close(vm->disk_overlay);
+        vm->disk_overlay = saved;
+        return 1;
+    }
+    uint8_t* buffer = malloc((size_t)SNAPSHOT_DISK_RUN * VM_SECTOR_SIZE);
+    int ok = buffer != NULL;
+    uint64_t lba = 0;
+    uint32_t count;
+    while (ok && (count = diskoverlay_next_run(saved, &lba, SNAPSHOT_DISK_RUN))) {
+        ok = diskoverlay_read(saved, lba, count, buffer) &&
+             diskoverlay_write(vm->disk_overlay, lba, count, buffer) == count;
+        lba += count;
+    }
+    if (!ok) printf("Failed to restore disk writes\n");
+    free(buffer);
+    diskoverlay_close(saved);
+    return ok;
+}
+
+int vm_snapshot_write(VM* vm, FILE* f) {
+    CPU* cpu = &vm->cpu;
+    vm_disk_flush(vm);  // Capture the guest after its read, not during it
+    int ok = fwrite(SNAPSHOT_MAGIC, 1, 4, f) == 4 &&
+             put_u32(f, SNAPSHOT_VERSION) &&
+             put_u32(f, cpu->memory_size) &&
+             put_u32(f, SNAPSHOT_PAGE_SIZE);
+
+    for (int i = 0; i < 8 && ok; i++) {
+        ok = put_u32(f, cpu->registers[i]);
+    }
+    ok = ok && put_u32(f, cpu->ip) && put_u32(f, cpu_get_flags(cpu)) &&
+         put_u16(f, cpu->cs) && put_u16(f, cpu->ds) && put_u16(f, cpu->es) &&
+         put_u16(f, cpu->ss) && put_u16(f, cpu->fs) && put_u16(f, cpu->gs) &&
+         put_u32(f, cpu->halted) && put_u64(f, cpu->tsc) &&
+         put_u64(f, vm->instructions);
+
+    ok = ok && put_u16(f, vm->vga.cursor_x) && put_u16(f, vm->vga.cursor_y) &&
+         fwrite(vm->vga.screen, 1, sizeof(vm->vga.screen), f) == sizeof(vm->vga.screen);
+
+    // Writes the guest made to its disk are part of its state
+    int overlay = vm->disk_data && vm->disk_overlay && vm->disk_overlay->written;
+    ok = ok && put_u64(f, vm->disk_data ? (uint64_t)vm->disk_size : 0) &&
+         put_u64(f, (cpu->ivt ? SNAPSHOT_IVT : 0) | (overlay ? SNAPSHOT_OVERLAY : 0));
+
+    // Most of guest memory is never touched, so only non-zero pages are kept
+    uint32_t page = 0;
+    while (ok && page < cpu->num_pages) {
+        if (page_is_zero(&cpu->memory[(size_t)page * SNAPSHOT_PAGE_SIZE])) {
+            page++;
+            continue;
+        }
+        uint32_t first = page;
+        while (page < cpu->num_pages &&
+               !page_is_zero(&cpu->memory[(size_t)page * SNAPSHOT_PAGE_SIZE])) {
+            page++;
+        }
+        size_t bytes = (size_t)(page - first) * SNAPSHOT_PAGE_SIZE;
+        ok = put_u32(f, first) && put_u32(f, page - first) &&
+             fwrite(&cpu->memory[(size_t)first * SNAPSHOT_PAGE_SIZE], 1, bytes, f) == bytes;
+    }
+    ok = ok && put_u32(f, 0) && put_u32(f, 0);
+    return ok && (!overlay || snapshot_write_overlay(vm->disk_overlay, f));
+}
+
+// Save the complete guest state; decoded code and JIT output are rebuilt
+int vm_snapshot(VM* vm, const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        printf("Failed to create snapshot: %s\n", path);
+        return 0;
+    }
+    int ok = vm_snapshot_write(vm, f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        printf("Failed to write snapshot: %s\n", path);
+        remove(path);
+    }
+    return ok;
+}
+
+int vm_snapshot_read(VM* vm, FILE* f) {
+    CPU* cpu = &vm->cpu;
+    vm_disk_flush(vm);  // A read landing later would overwrite restored memory
+    char magic[4];
+    uint32_t version, memory_size, page_size;
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0 ||
+        !get_u32(f, &version) || !get_u32(f, &memory_size) || !get_u32(f, &page_size)) {
+        printf("Not a snapshot file\n");
+        return 0;
+    }
+    if (version != SNAPSHOT_VERSION || page_size != SNAPSHOT_PAGE_SIZE) {
+        printf("Unsupported snapshot (version %u, %u byte pages)\n",
+               version, page_size);
+        return 0;
+    }
+    if (memory_size != cpu->memory_size) {
+        printf("Snapshot needs %u bytes of guest memory, VM has %u\n",
+               memory_size, cpu->memory_size);
+        return 0;
+    }
+
+    uint32_t halted = 0, flags = 0;
+    int ok = 1;
+    for (int i = 0; i < 8 && ok; i++) {
+        ok = get_u32(f, &cpu->registers[i]);
+    }
+    ok = ok && get_u32(f, &cpu->ip) && get_u32(f, &flags) &&
+         get_u16(f, &cpu->cs) && get_u16(f, &cpu->ds) && get_u16(f, &cpu->es) &&
+         get_u16(f, &cpu->ss) && get_u16(f, &cpu->fs) && get_u16(f, &cpu->gs) &&
+         get_u32(f, &halted) && get_u64(f, &cpu->tsc) &&
+         get_u64(f, &vm->instructions);
+    cpu->halted = halted;
+    cpu_set_flags(cpu, flags);
+
+    uint16_t cursor_x = 0, cursor_y = 0;
+    ok = ok && get_u16(f, &cursor_x) && get_u16(f, &cursor_y) &&
+         fread(vm->vga.screen, 1, sizeof(vm->vga.screen), f) == sizeof(vm->vga.screen);
+    vm->vga.cursor_x = cursor_x;
+    vm->vga.cursor_y = cursor_y;
+    vm->vga.dirty_rows = VGA_ALL_ROWS;
+
+    uint64_t disk_size, features;
+    ok = ok && get_u64(f, &disk_size) && get_u64(f, &features);
+    if (!ok) {
+        printf("Truncated snapshot\n");
+        return 0;
+    }
+    if (disk_size) {
+        if (!vm->disk_data || (uint64_t)vm->disk_size != disk_size) {
+            printf("Snapshot expects a %llu byte disk image\n",
+                   (unsigned long long)disk_size);
+            return 0;
+        }
+    } else if (features & SNAPSHOT_OVERLAY) {
+        printf("Corrupt snapshot: disk writes without a disk\n");
+        return 0;
+    }
+
+    cpu->ivt = (features & SNAPSHOT_IVT) != 0;
+
+    cpu_clear_memory(cpu);
+    for (;;) {
+        uint32_t first, count;
+        if (!get_u32(f, &first) || !get_u32(f, &count)) {
+            printf("Truncated snapshot\n");
+            return 0;
+        }
+        if (count == 0) break;
+        if (first > cpu->num_pages || count > cpu->num_pages - first) {
+            printf("Corrupt snapshot page run %u+%u\n", first, count);
+            return 0;
+        }
+        size_t bytes = (size_t)count * SNAPSHOT_PAGE_SIZE;
+        if (fread(&cpu->memory[(size_t)first * SNAPSHOT_PAGE_SIZE], 1, bytes, f) != bytes) {
+            printf("Truncated snapshot\n");
+            return 0;
+        }
+        cpu_mark_dirty(cpu, first * SNAPSHOT_PAGE_SIZE, (uint32_t)bytes);
+    }
+
+    // The disk goes back to the base image plus the writes saved with it,
+    // once the whole section has been read
+    if (disk_size) {
+        DiskOverlay* saved = NULL;
+        if ((features & SNAPSHOT_OVERLAY) && !(saved = snapshot_read_overlay(vm, f))) {
+            return 0;
+        }
+        if (!snapshot_apply_overlay(vm, saved)) return 0;
+        if (vm->disk_cache) diskcache_clear(vm->disk_cache);
+    }
+
+    cpu_flush_icache(cpu);
+    vm->idle = 0;
+    return 1;
+}
+
+// Replace the running guest with a saved one; on failure the guest is undefined
+int vm_restore(VM* vm, const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        printf("Failed to open snapshot: %s\n", path);
+        return 0;
+    }
+    int ok = vm_snapshot_read(vm, f);
+    fclose(f);
+    return ok;
+}
\ No newline at end of file